@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Measures 4 KiB random read IOPS on a HOLEPUNCH mapped device with fio.
+# Reads go through the whole data path: remap, read, decrypt in the bottom
+# half. Run against the same device before and after a data path change.
+
+usage() {
+  printf "Usage: $0 -d [mapped-dev] [-s [seconds]] [-q [iodepth]] [-j [jobs]]\n\n"
+  printf "[mapped-dev] : HOLEPUNCH mapped device, e.g. /dev/mapper/eraser\n"
+  printf "[seconds] : Run time (default 30)\n"
+  printf "[iodepth] : Outstanding I/Os per job (default 32)\n"
+  printf "[jobs] : Number of fio jobs (default 4)\n\n"
+  exit 1
+}
+
+DEV=""
+SECONDS_=30
+DEPTH=32
+JOBS=4
+
+while [ "$1" != "" ]; do
+  case $1 in
+      -h|--help)
+        usage
+        ;;
+      -d|--dev)
+        DEV=$2
+        shift
+        ;;
+      -s|--seconds)
+        SECONDS_=$2
+        shift
+        ;;
+      -q|--iodepth)
+        DEPTH=$2
+        shift
+        ;;
+      -j|--jobs)
+        JOBS=$2
+        shift
+        ;;
+      *)
+        usage
+        ;;
+  esac
+  shift
+done
+
+if [ -z "$DEV" ]; then
+  usage
+fi
+
+if ! command -v fio > /dev/null; then
+  printf "fio not found\n"
+  exit 1
+fi
+
+# Direct I/O so that every read reaches the target instead of the page cache.
+fio --name=hp_randread --filename="$DEV" --readonly --direct=1 \
+    --rw=randread --bs=4k --ioengine=libaio --iodepth="$DEPTH" \
+    --numjobs="$JOBS" --runtime="$SECONDS_" --time_based \
+    --group_reporting --output-format=terse --terse-version=3 \
+  | awk -F';' '{ printf "randread 4k: %s IOPS, %s KiB/s\n", $8, $7 }'
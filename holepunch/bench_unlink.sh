@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Measures the per-unlink cost of the HOLEPUNCH unlink probe, on a HOLEPUNCH
+# mount and on an unrelated file system. Run once with the module loaded and
+# once without (skip -t then) to get the baseline for the other file system.
+
+usage() {
+  printf "Usage: $0 -n [num] -o [other-dir] [-t [target-dir]]\n\n"
+  printf "[num] : Number of empty files to unlink per run\n"
+  printf "[other-dir] : Directory on a file system not backed by HOLEPUNCH\n"
+  printf "[target-dir] : Directory on a HOLEPUNCH mount (optional)\n\n"
+  exit 1
+}
+
+FILES=""
+OTHER=""
+TARGET=""
+
+while [ "$1" != "" ]; do
+  case $1 in
+      -h|--help)
+        usage
+        ;;
+      -n|--num)
+        FILES=$2
+        shift
+        ;;
+      -o|--other)
+        OTHER=$2
+        shift
+        ;;
+      -t|--target)
+        TARGET=$2
+        shift
+        ;;
+      *)
+        usage
+        ;;
+  esac
+  shift
+done
+
+if [ -z "$FILES" ] || [ -z "$OTHER" ]; then
+  usage
+fi
+
+# Creates $FILES empty files in $1, then times removing them all with a
+# single rm process. Prints nanoseconds per unlink.
+bench() {
+  dir="$1/hp_unlink_bench"
+  mkdir -p "$dir"
+  (cd "$dir" && seq -f "f%.0f" 1 "$FILES" | xargs touch)
+  sync
+
+  start=$(date +%s%N)
+  find "$dir" -type f -delete
+  end=$(date +%s%N)
+
+  rmdir "$dir"
+  echo $(( (end - start) / FILES ))
+}
+
+if grep -qs "^dm_holepunch " /proc/modules; then
+  printf "dm-holepunch loaded\n"
+else
+  printf "dm-holepunch NOT loaded (baseline)\n"
+fi
+
+printf "Other file system:  %s ns/unlink\n" "$(bench "$OTHER")"
+
+if [ -n "$TARGET" ]; then
+  printf "HOLEPUNCH mount:    %s ns/unlink\n" "$(bench "$TARGET")"
+  # Keep the deletion work out of the next measurement.
+  sleep 2
+fi
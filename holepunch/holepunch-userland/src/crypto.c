@@ -131,6 +131,40 @@ void decrypt(char *src, char *dst, u64 buf_len, char *key, char *iv) {
     finish_decrypt(ctx, dst + len);
 }
 
+/*
+ * Bulk random data.
+ */
+
+/* Starts an AES-256-CTR keystream seeded from the random device. Used where
+ * far more random bytes are needed than /dev/urandom should be asked for. */
+EVP_CIPHER_CTX *start_random_stream() {
+    EVP_CIPHER_CTX *ctx;
+    unsigned char seed[32 + 16];
+
+    if (!(ctx = EVP_CIPHER_CTX_new())) {
+        ERR_print_errors_fp(stderr);
+        die("Cannot create cipher\n");
+    }
+
+    get_random_data(seed, sizeof(seed));
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, seed, seed + 32) != 1) {
+        ERR_print_errors_fp(stderr);
+        die("Cannot init crypto context\n");
+    }
+    memset(seed, 0, sizeof(seed));
+    return ctx;
+}
+
+/* Fills a buffer with the next bytes of the keystream. */
+void get_random_stream(EVP_CIPHER_CTX *ctx, char *buf, u64 buf_len) {
+    memset(buf, 0, buf_len);
+    do_encrypt(ctx, buf, buf, buf_len);
+}
+
+void finish_random_stream(EVP_CIPHER_CTX *ctx) {
+    EVP_CIPHER_CTX_free(ctx);
+}
+
 /* Derives a key from a password with PBKDF2 - SHA256. */
 void generate_key(char *pass, int key_len, char *key, char *salt, int salt_len) {
     PKCS5_PBKDF2_HMAC(pass, strlen(pass), salt, salt_len, ERASER_PBKDF2_ITER, EVP_sha256(), key_len, key);
@@ -21,11 +21,16 @@
  * ERASER core.
  */
 
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <pthread.h>
+
 #include "utils.h"
 #include "crypto.h"
 #include "netlink.h"
 #include "holepunch.h"
 #include "tpm.h"
+#include "rotate.h"
 
 
 void handle_signal(int sig) {
@@ -208,31 +213,31 @@ out:
     return is_success;
 }
 
-/* Closes a ERASER instance. */
-void do_close(char *eraser_name) {
+/*
+ * Looks up an open ERASER instance in the proc file and returns its
+ * device-mapper name, or NULL if there is none. Caller frees.
+ */
+static char *find_mapped_dev(char *eraser_name) {
 
     char *buf;
     char *tok_buf;
     char *tok;
     unsigned len;
     char *name;
-    int done;
-
-    sync();
 
     /* Read the ERASER proc file. */
     buf = read_text_file(HOLEPUNCH_PROC_FILE, &len);
     if (!len) {
         print_red("There are no ERASER devices open.\n");
-        return;
+        return NULL;
     }
 
     buf[len - 1] = '\0';
     tok_buf = buf;
 
     /* Check all open ERASER instances. */
-    done = 0;
-    while (!done && (tok = strsep(&tok_buf, " "))) {
+    name = NULL;
+    while (!name && (tok = strsep(&tok_buf, " "))) {
 
         if (strcmp(tok, eraser_name) != 0) {
             /* This is not what we are looking for. */
@@ -241,21 +246,91 @@ void do_close(char *eraser_name) {
         else {
             /* Found! */
             strsep(&tok_buf, " ");
-            name = rindex(strsep(&tok_buf, " "), '/') + 1;
-            if (!close_eraser(name)) {
-                print_red("DEBUG: Cannot close %s\n", name);
-            }
-
-            done = 1;
+            name = strdup(rindex(strsep(&tok_buf, " "), '/') + 1);
         }
     }
 
     /* Not found. */
-    if (!done) {
+    if (!name) {
         print_red("No ERASER named \"%s\"\n", eraser_name);
     }
 
     free(buf);
+    return name;
+}
+
+/* Closes a ERASER instance. */
+void do_close(char *eraser_name) {
+
+    char *name;
+
+    sync();
+
+    name = find_mapped_dev(eraser_name);
+    if (!name)
+        return;
+
+    if (!close_eraser(name)) {
+        print_red("DEBUG: Cannot close %s\n", name);
+    }
+
+    free(name);
+}
+
+/* Sends a target message to a ERASER instance by device-mapper name. */
+int message_eraser(char *mapped_dev, char *message) {
+
+    struct dm_task *dmt;
+    int is_success = 0;
+
+    if (!(dmt = dm_task_create(DM_DEVICE_TARGET_MSG))) {
+        print_red("DEBUG: Cannot create dm_task\n");
+        return 0;
+    }
+
+    if (!dm_task_set_name(dmt, mapped_dev)) {
+        print_red("DEBUG: Cannot set device name\n");
+        goto out;
+    }
+
+    if (!dm_task_set_sector(dmt, 0)) {
+        goto out;
+    }
+
+    if (!dm_task_set_message(dmt, message)) {
+        print_red("DEBUG: Cannot set message\n");
+        goto out;
+    }
+
+    if (!dm_task_run(dmt)) {
+        print_red("DEBUG: Cannot issue ioctl\n");
+        goto out;
+    }
+    is_success = 1;
+
+out:
+    dm_task_destroy(dmt);
+    return is_success;
+}
+
+/*
+ * Blocks until every file unlinked on a ERASER instance before the call is
+ * irrecoverable.
+ */
+void do_barrier(char *eraser_name) {
+
+    char *name;
+
+    name = find_mapped_dev(eraser_name);
+    if (!name)
+        exit(1);
+
+    if (!message_eraser(name, "barrier")) {
+        free(name);
+        die("Barrier failed on %s\n", eraser_name);
+    }
+
+    free(name);
 }
 
 /* Device mapper open. */
@@ -331,6 +406,11 @@ out:
     return is_success;
 }
 
+/* Milliseconds from a to b. */
+static long elapsed_ms(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
 /* Open a ERASER instance. */
 void do_open(char *dev_path, char *eraser_name, char *mapped_dev) {
     // print_red("NOT IMPLEMENTED\n");
@@ -341,6 +421,7 @@ void do_open(char *dev_path, char *eraser_name, char *mapped_dev) {
     int fd;
     char *buf;
     int netlink_pid;
+    struct timespec t_start, t_ready, t_loaded;
 
     /* Open device. */
     if ((fd = open(dev_path, O_RDWR)) == -1) {
@@ -369,7 +450,9 @@ void do_open(char *dev_path, char *eraser_name, char *mapped_dev) {
     strcat(mapped_dev_path, mapped_dev);
 
     /* Start the netlink client. */
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
     netlink_pid = start_netlink_client(eraser_name);
+    clock_gettime(CLOCK_MONOTONIC, &t_ready);
     if (netlink_pid != 0) {
         /* Device-mapper open. */
         if (!open_eraser(dev_path, mapped_dev, hp_h->data_end - hp_h->data_start, eraser_name, mapped_dev_path, netlink_pid)) {
@@ -378,11 +461,14 @@ void do_open(char *dev_path, char *eraser_name, char *mapped_dev) {
             goto free_name;
         }
 
-        print_green("Success!\n");
+        clock_gettime(CLOCK_MONOTONIC, &t_loaded);
+        print_green("Success! Helper ready in %ld ms, target loaded in %ld ms.\n",
+                    elapsed_ms(&t_start, &t_ready), elapsed_ms(&t_ready, &t_loaded));
     }
 
     #ifdef ERASER_DEBUG
         print_green("Journal start: %llu\n", hp_h->journal_start);
+        print_green("Hot list sector: %llu\n", hp_h->hot_start);
         print_green("Key table start: %llu\n", hp_h->key_table_start);
         print_green("PPRF fkt start: %llu\n", hp_h->fkt_start);
         print_green("PPRF key start: %llu\n", hp_h->pprf_start);
@@ -402,29 +488,142 @@ free_headers:
     print_green("Done!\n");
 }
 
-/* Start netlink client. */
+/* Start netlink client; returns its pid once it is listening, 0 on failure. */
 int start_netlink_client(char *eraser_name) {
 
     int pid;
+    int ready[2];
+    char c;
+
+    if (pipe(ready) == -1) {
+        print_red("Cannot create pipe.\n");
+        return 0;
+    }
 
     pid = fork();
     if (pid != 0) {
+        close(ready[1]);
+        if (pid == -1 || read(ready[0], &c, 1) != 1) {
+            print_red("Netlink client did not start.\n");
+            pid = 0;
+        }
+        close(ready[0]);
         return pid;
     }
 
-    enter_netlink_loop(); /* There is no return until ERASER device is closed. */
+    close(ready[0]);
+    enter_netlink_loop(eraser_name, ready[1]); /* There is no return until ERASER device is closed. */
     return pid;
 }
 
 
-/* Create a ERASER instance. */
-void do_create(char *dev_path, int nv_index) {
+/*
+ * Bulk random fill, used to overwrite metadata regions at create time. Each
+ * thread runs its own AES-CTR keystream and claims FILL_CHUNK sectors at a
+ * time, written with O_DIRECT so the page cache stays out of the way.
+ */
+struct fill_state {
+    int fd;
+    u64 start;
+    u64 count;
+    u64 next;   /* Next chunk to claim, in sectors from start. */
+    u64 done;   /* Sectors written so far. */
+};
+
+static void *fill_worker(void *arg) {
+    struct fill_state *f = arg;
+    EVP_CIPHER_CTX *ctx;
+    char *buf;
+    u64 s, n;
+
+    if (posix_memalign((void **) &buf, ERASER_SECTOR, FILL_CHUNK * ERASER_SECTOR)) {
+        die("Cannot allocate fill buffer\n");
+    }
+    ctx = start_random_stream();
+
+    while ((s = __atomic_fetch_add(&f->next, FILL_CHUNK, __ATOMIC_RELAXED)) < f->count) {
+        n = (f->count - s < FILL_CHUNK) ? f->count - s : FILL_CHUNK;
+        get_random_stream(ctx, buf, n * ERASER_SECTOR);
+        if (pwrite(f->fd, buf, n * ERASER_SECTOR, (f->start + s) * ERASER_SECTOR)
+                != n * ERASER_SECTOR) {
+            die("Error writing to device.\n");
+        }
+        __atomic_add_fetch(&f->done, n, __ATOMIC_RELAXED);
+    }
+
+    finish_random_stream(ctx);
+    free(buf);
+    return NULL;
+}
+
+static void print_fill_progress(struct fill_state *f, struct timespec *t_start) {
+    struct timespec t_now;
+    u64 done;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_now);
+    done = __atomic_load_n(&f->done, __ATOMIC_RELAXED);
+    ms = elapsed_ms(t_start, &t_now);
+    print_green("\r-> Filled %llu / %llu MiB (%llu MiB/s)   ",
+                done * ERASER_SECTOR >> 20, f->count * ERASER_SECTOR >> 20,
+                ms ? (done * ERASER_SECTOR >> 20) * 1000 / ms : 0);
+}
+
+/* Overwrites count sectors of the device, starting at sector start, with
+ * random data. */
+void fill_random_sectors(char *dev_path, u64 start, u64 count) {
+    struct fill_state f;
+    struct timespec t_start;
+    pthread_t threads[FILL_MAX_THREADS];
+    long nr_threads;
+    int i;
+
+    if ((f.fd = open(dev_path, O_WRONLY | O_DIRECT)) == -1) {
+        die("Cannot open device %s\n", dev_path);
+    }
+    f.start = start;
+    f.count = count;
+    f.next = 0;
+    f.done = 0;
+
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nr_threads < 1)
+        nr_threads = 1;
+    if (nr_threads > FILL_MAX_THREADS)
+        nr_threads = FILL_MAX_THREADS;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < nr_threads; ++i) {
+        if (pthread_create(&threads[i], NULL, fill_worker, &f) != 0) {
+            die("Cannot start fill thread\n");
+        }
+    }
+
+    while (__atomic_load_n(&f.done, __ATOMIC_RELAXED) < count) {
+        print_fill_progress(&f, &t_start);
+        usleep(FILL_PROGRESS_US);
+    }
+    for (i = 0; i < nr_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    print_fill_progress(&f, &t_start);
+    print_green("\n");
+
+    if (fsync(f.fd) == -1) {
+        die("Cannot sync device %s\n", dev_path);
+    }
+    close(f.fd);
+}
+
+/* Create a ERASER instance. The key table is left for the first mount to
+ * initialize unless fill_key_table is set. */
+void do_create(char *dev_path, int nv_index, int fill_key_table) {
 
     // struct eraser_header *h;
     unsigned char master_key[HOLEPUNCH_KEY_LEN];
     u64 dev_size;
     u64 inode_count;
-    int fd, i;
+    int fd;
 
     /* Open device. */
     if ((fd = open(dev_path, O_RDWR)) == -1) {
@@ -446,7 +645,7 @@ void do_create(char *dev_path, int nv_index) {
     print_green("-> Expecting %llu inodes for an ext4 partition\n\n", inode_count);
 #endif
     /* Compute sizes for holepunch metadata */
-    struct holepunch_header *hp_h = malloc(ERASER_SECTOR * ERASER_HEADER_LEN);
+    struct holepunch_header *hp_h = calloc(ERASER_HEADER_LEN, ERASER_SECTOR);
     u64 key_table_len = div_ceil(inode_count, HP_KEY_PER_SECTOR);
 
     /* The depth of the pprf is chosen such that num leaves is at least the
@@ -456,7 +655,8 @@ void do_create(char *dev_path, int nv_index) {
     u64 pprf_len = div_ceil(hp_h->pprf_capacity, HP_PPRF_PER_SECTOR);
 
     hp_h->journal_start = ERASER_HEADER_LEN;
-    hp_h->key_table_start = hp_h->journal_start + HP_JOURNAL_LEN;
+    hp_h->hot_start = hp_h->journal_start + HP_JOURNAL_LEN;
+    hp_h->key_table_start = hp_h->hot_start + 1;
     hp_h->fkt_start = hp_h->key_table_start + key_table_len;
     hp_h->fkt_bottom_width = div_ceil(pprf_len, HP_FKT_PER_SECTOR);
     hp_h->fkt_top_width = div_ceil(hp_h->fkt_bottom_width, HP_FKT_PER_SECTOR);
@@ -471,6 +671,7 @@ void do_create(char *dev_path, int nv_index) {
 
 #ifdef ERASER_DEBUG
     print_green("Journal start: %llu\n", hp_h->journal_start);
+    print_green("Hot list sector: %llu\n", hp_h->hot_start);
     print_green("Key table start: %llu\n", hp_h->key_table_start);
     print_green("PPRF fkt start: %llu\n", hp_h->fkt_start);
     print_green("PPRF key start: %llu\n", hp_h->pprf_start);
@@ -495,18 +696,19 @@ void do_create(char *dev_path, int nv_index) {
     }
     memset(master_key, 0, HOLEPUNCH_KEY_LEN);
 
+    /* Randomize the rest of the journal, the hot list sector (random data
+     * lacks its magic) and, if asked to, the key table. The PPRF init on first
+     * mount generates every file key from scratch, so the key table only needs
+     * overwriting to scrub what was there before. */
+    fill_random_sectors(dev_path, hp_h->journal_start + 1,
+                        HP_JOURNAL_LEN + (fill_key_table ? key_table_len : 0));
+
     /* Write the header, then a journal entry for PPRF init. */
     write_sectors(fd, hp_h, ERASER_HEADER_LEN);
-    u64 *journal_ctl = malloc(ERASER_SECTOR);
+    u64 *journal_ctl = calloc(1, ERASER_SECTOR);
     journal_ctl[0] = HPJ_PPRF_INIT;
     get_random_data(journal_ctl + 1, HOLEPUNCH_KEY_LEN);
     write_sectors(fd, journal_ctl, 1);
-    /* Randomize the rest of the journal and all of the key table. */
-    for (i = 1; i < HP_JOURNAL_LEN + key_table_len; ++i) {
-        /* Done one sector at a time so as not to overwhelm /dev/urandom. */
-        get_random_data(journal_ctl, ERASER_SECTOR);
-        write_sectors(fd, journal_ctl, 1);
-    }
     free(journal_ctl);
     /* The journal entry will take care of the rest. */
 
@@ -523,6 +725,84 @@ tpm_error:
     cleanup_random();
 }
 
+/* Returns 1 if a HOLEPUNCH instance is open on the device. */
+static int holepunch_is_open(char *dev_path) {
+    struct stat dev, real;
+    char *buf;
+    char *tok_buf;
+    char *tok;
+    unsigned len;
+    int found = 0;
+
+    if (access(HOLEPUNCH_PROC_FILE, R_OK) == -1 || stat(dev_path, &dev) == -1)
+        return 0;
+
+    buf = read_text_file(HOLEPUNCH_PROC_FILE, &len);
+    tok_buf = buf;
+    while (!found && strsep(&tok_buf, " ") && (tok = strsep(&tok_buf, " "))) {
+        if (stat(tok, &real) == 0 && real.st_rdev == dev.st_rdev)
+            found = 1;
+        strsep(&tok_buf, "\n"); /* Skip to the end of line. */
+    }
+
+    free(buf);
+    return found;
+}
+
+/* Rotate the PPRF key of a closed HOLEPUNCH instance, offline. */
+void do_rotate(char *dev_path) {
+    struct holepunch_header *hp_h;
+    struct timespec t_start, t_done;
+    int fd;
+
+    if (holepunch_is_open(dev_path)) {
+        die("HOLEPUNCH is open on %s; close it first\n", dev_path);
+    }
+
+    /* Open device. */
+    if ((fd = open(dev_path, O_RDWR | O_DIRECT)) == -1) {
+        die("Cannot open device %s\n", dev_path);
+    }
+
+    init_random();
+    init_crypto();
+
+    /* Read header. */
+    if (posix_memalign((void **) &hp_h, ERASER_SECTOR, ERASER_HEADER_LEN * ERASER_SECTOR)) {
+        die("Cannot allocate header\n");
+    }
+    read_sectors(fd, hp_h, ERASER_HEADER_LEN);
+    if (!hp_h->in_use) {
+        print_red("HOLEPUNCH on %s has never been opened; nothing to rotate.\n", dev_path);
+        goto free_header;
+    }
+
+    /* Get password from user and check if correct. */
+    hp_get_keys(ERASER_OPEN, hp_h);
+    if (!hp_verify_key(hp_h)) {
+        print_red("Incorrect password!\n");
+        goto free_header;
+    }
+
+    /* The master key is read from and written to the TPM directly. */
+    tpm = setup_tpm(tpm_owner_pass);
+    nvram = setup_nvram(hp_h->nv_index, HOLEPUNCH_KEY_LEN, tpm_owner_pass, tpm);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    rotate_offline(fd, hp_h, nvram);
+    clock_gettime(CLOCK_MONOTONIC, &t_done);
+    print_green("\nDone in %ld ms!\n\n", elapsed_ms(&t_start, &t_done));
+
+    cleanup_nvram(nvram);
+    cleanup_tpm(tpm);
+free_header:
+    cleanup_keys();
+    free(hp_h);
+    close(fd);
+    cleanup_crypto();
+    cleanup_random();
+}
+
 /* Reads the ERASER proc file and lists all open ERASER instances. */
 void do_list() {
     char *buf;
@@ -541,8 +821,10 @@ void do_list() {
         print_green("\nEraser Name: %s\n", tok);
         print_green("  --> Real Device: %s\n", strsep(&tok_buf, " "));
         print_green("  --> Virtual Device: %s\n", strsep(&tok_buf, " "));
-
-        strsep(&tok_buf, "\n"); /* Skip to the end of line. */
+        if ((tok = strsep(&tok_buf, " ")) && !strcmp(tok, "warm"))
+            print_green("  --> Cache Warm-up: %s sectors\n", strsep(&tok_buf, "\n"));
+        else
+            strsep(&tok_buf, "\n"); /* Skip to the end of line. */
     }
 
     free(buf);
@@ -44,6 +44,11 @@ int do_decrypt(EVP_CIPHER_CTX *, char *, char *, u64);
 int finish_decrypt(EVP_CIPHER_CTX *, char *);
 void decrypt(char *, char *, u64, char *, char *);
 
+/* AES-CTR keystream for bulk random data. */
+EVP_CIPHER_CTX *start_random_stream();
+void get_random_stream(EVP_CIPHER_CTX *, char *, u64);
+void finish_random_stream(EVP_CIPHER_CTX *);
+
 /* PBKDF2 key derivation and digest. */
 void generate_key(char *, int, char *, char *, int);
 void digest_key(char *, int, char *, int, char *, int);
@@ -36,6 +36,7 @@
 #define ERASER_SECTOR 4096   /* In bytes. */
 #define ERASER_HEADER_LEN 1  /* In blocks. */
 #define ERASER_KEY_LEN 32    /* In bytes. */
+#define HOLEPUNCH_KEY_LEN ERASER_KEY_LEN
 #define ERASER_IV_LEN 16     /* In bytes. */
 #define ERASER_SALT_LEN 32   /* In bytes. */
 #define ERASER_DIGEST_LEN 32 /* In bytes. */
@@ -59,13 +60,13 @@
 
 
 #define MAX_DEPTH 64
-#ifdef ERASER_DEBUG
-#define NODE_LABEL_LEN (MAX_DEPTH+7)/8
-struct node_label {
-    u64 label;
-    char depth;
+
+/* Must match the kernel side definition (without HOLEPUNCH_DEBUG). */
+enum {
+    PPRF_INTERNAL = 0,
+    PPRF_KEYLEAF,
+    PPRF_PUNCTURE,
 };
-#endif
 
 struct pprf_keynode {
     union {
@@ -75,10 +76,7 @@ struct pprf_keynode {
         } next;
         char key[PRG_INPUT_LEN];
     } v;
-    char flag;
-#ifdef ERASER_DEBUG
-    struct node_label lbl;
-#endif
+    char type;
 };
 
 
@@ -133,6 +131,9 @@ struct holepunch_header {
     char pprf_depth;
     char in_use;
 
+    /* Hot list sector, between the journal and the key table. */
+    u64 hot_start;
+
     /* tag_counter and pprf_size are stored in the top-level FKT block
 	 * since they are mutable - this helps save an IO op */
 };
@@ -141,23 +142,28 @@ struct holepunch_key {
     char key[HOLEPUNCH_KEY_LEN];
 };
 
-/* Journal constants; only HPJ_PPRF_INIT needed, but whatever. */
+/* Journal constants; must match the kernel side enum. */
 
 #define HPJ_NONE 0UL
 #define HPJ_MASTER_ROT 1UL
 #define HPJ_PPRF_ROT 2UL
 #define HPJ_PPRF_INIT 3UL
-#define HPJ_GENERIC 4UL
+#define HPJ_PPRF_PUNCT 4UL
+#define HPJ_GENERIC 5UL
 
 #define HP_KEY_PER_SECTOR ((ERASER_SECTOR - 32)/ERASER_KEY_LEN)
 #define HP_PPRF_PER_SECTOR (ERASER_SECTOR/sizeof(struct pprf_keynode))
-#define HP_FKT_PER_SECTOR (ERASER_SECTOR/ERASER_KEY_LEN)
+#define HP_FKT_PER_SECTOR ((ERASER_SECTOR - 16)/ERASER_KEY_LEN)
+
+#define HP_MAGIC1 0xbffb8ee808b32e40
+#define HP_MAGIC2 0xec993fbb3ce4623a
 
+/* The on-disk metadata sectors; must match the kernel side definitions. */
 struct __attribute__((aligned(ERASER_SECTOR))) holepunch_filekey_sector {
     u64 tag;
+    u64 padding;
     u64 magic1;
     u64 magic2;
-    u64 magic3;
     struct holepunch_key entries[HP_KEY_PER_SECTOR];
 };
 
@@ -166,9 +172,25 @@ struct __attribute__((aligned(ERASER_SECTOR))) holepunch_pprf_keynode_sector {
 };
 
 struct __attribute__((aligned(ERASER_SECTOR))) holepunch_pprf_fkt_sector {
+    u32 pprf_size;
+    u64 tag_counter;
+    u32 padding;
     struct holepunch_key entries[HP_FKT_PER_SECTOR];
 };
 
+/* Master key record in the journal control block; see the kernel side. */
+#define HP_HASH_LEN 32
+#define HPJ_MASTER_REC_OFFSET (ERASER_SECTOR / 2) /* In bytes. */
+#define HPJ_MASTER_REC_MAGIC 0x6d6b7265636f7264
+#define HPJ_MASTER_REC_SLOTS 3
+
+struct holepunch_master_record {
+    u64 magic;
+    struct {
+        char enc_key[HOLEPUNCH_KEY_LEN];
+        char hash[HP_HASH_LEN];
+    } slots[HPJ_MASTER_REC_SLOTS];
+};
 
 
 /* size padded to 64 bytes, must be multiple of sector size */
@@ -193,12 +215,21 @@ void cleanup_keys();
 
 void do_init_filekeys(int, struct holepunch_header *, u64);
 
+/* Bulk random fill at create time. */
+#define FILL_CHUNK 256       /* In sectors. */
+#define FILL_MAX_THREADS 16
+#define FILL_PROGRESS_US 100000
+void fill_random_sectors(char *, u64, u64);
+
 /* Actual commands. */
 int close_eraser(char *);
 void do_close(char *);
+int message_eraser(char *, char *);
+void do_barrier(char *);
 int open_eraser(char *, char *, u64, char*, char*, int);
 void do_open(char *, char *, char *);
-void do_create(char *, int);
+void do_create(char *, int, int);
+void do_rotate(char *);
 void do_list();
 
 int start_netlink_client(char *);
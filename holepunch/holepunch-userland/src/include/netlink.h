@@ -33,10 +33,12 @@ enum {
     ERASER_MSG_GET_KEY,
     ERASER_MSG_SET_KEY,
     ERASER_MSG_DIE,
+    ERASER_MSG_HELPER_READY,
+    ERASER_MSG_SET_KEY_FAIL,
 };
 
 #define MAX_PAYLOAD (ERASER_NAME_LEN + ERASER_KEY_LEN)
 
-void enter_netlink_loop();
+void enter_netlink_loop(char *eraser_name, int ready_fd);
 
 #endif /* NETLINK_H */
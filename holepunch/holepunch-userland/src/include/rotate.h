@@ -0,0 +1,72 @@
+/*
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rotate.h
+ *
+ * Offline PPRF key rotation.
+ */
+
+#ifndef ROTATE_H
+#define ROTATE_H
+
+#include "crypto.h"
+#include "holepunch.h"
+#include "tpm.h"
+
+/* The key table is rotated this many sectors at a time; each window is read,
+ * re-encrypted on all threads, then written back and synced. */
+#define ROTATE_WINDOW 2048    /* In sectors. */
+#define ROTATE_MAX_THREADS 16
+
+/* Per-thread cipher contexts, rekeyed for each operation. */
+struct rotate_crypto {
+    EVP_CIPHER_CTX *ecb;
+    EVP_CIPHER_CTX *cbc;
+};
+
+struct rotate_state {
+    int fd;
+    struct holepunch_header *h;
+    struct eraser_nvram *nvram;
+    u64 key_table_len;
+    u64 fkt_len;
+
+    unsigned char master_key[HOLEPUNCH_KEY_LEN];
+    unsigned char prg_input[HOLEPUNCH_KEY_LEN * 2];
+
+    /* Decrypted FKT, both levels, and the PPRF keys. */
+    struct holepunch_pprf_fkt_sector *fkt;
+    struct pprf_keynode *pprf;
+    u32 pprf_size;
+    struct pprf_keynode pprf_new;
+
+    int nr_threads;
+    u64 bad_sectors;
+};
+
+/* A range of key table sectors in the current window, for one thread. */
+struct rotate_job {
+    struct rotate_state *r;
+    char *buf;
+    u64 first;  /* Key table index of buf. */
+    u64 nr;
+    u64 result;
+    void (*fn)(struct rotate_job *, struct rotate_crypto *);
+};
+
+void rotate_offline(int, struct holepunch_header *, struct eraser_nvram *);
+
+#endif /* ROTATE_H */
@@ -24,6 +24,23 @@
 #ifndef TPM_H
 #define TPM_H
 
+#ifdef ERASER_NO_TPM
+/* Software-only backend; only the types the rest of the tool relies on. */
+typedef unsigned TSS_RESULT;
+typedef unsigned TSS_HCONTEXT;
+typedef unsigned TSS_HTPM;
+typedef unsigned TSS_HNVSTORE;
+#define TSS_SUCCESS 0
+
+/* Where the software "NVRAM" lives. */
+#ifndef HOLEPUNCH_SOFT_TPM_PATH
+#define HOLEPUNCH_SOFT_TPM_PATH "/tmp/tpm_test"
+#endif
+/* Emulated NVRAM write latency, to benchmark without a TPM. In microseconds. */
+#ifndef HOLEPUNCH_SOFT_TPM_DELAY_US
+#define HOLEPUNCH_SOFT_TPM_DELAY_US 0
+#endif
+#else
 #include <tss/platform.h>
 #include <tss/tss_defines.h>
 #include <tss/tss_typedef.h>
@@ -31,6 +48,7 @@
 #include <tss/tspi.h>
 #include <tss/tss_error.h>
 #include <trousers/trousers.h>
+#endif
 
 struct eraser_tpm {
     TSS_HCONTEXT context;
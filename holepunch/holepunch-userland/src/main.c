@@ -37,27 +37,33 @@
 #define COMMAND_OPEN "open"
 #define COMMAND_CLOSE "close"
 #define COMMAND_LIST "list"
+#define COMMAND_BARRIER "barrier"
+#define COMMAND_ROTATE "rotate"
 
 #define COMMAND_PPRF_TEST "pprf_test"
 #define COMMAND_PPRF_TIME "pprf_time"
 
 const char *argp_program_version = "ERASER ver.2016.xx.xx";
 const char *argp_program_bug_address = "<onarliog@ccs.neu.edu>";
-static const char doc[] = "Create, open, close, list ERASER devices.";
+static const char doc[] = "Create, open, close, list ERASER devices, wait for deletions to persist, or rotate keys offline.";
 static const char args_doc[] =
     COMMAND_CREATE  " <block-device> <tpm-nvram-index>\n"
     COMMAND_OPEN    " <block-device> <eraser-name>\n"
     COMMAND_CLOSE   " <eraser-name>\n"
-    COMMAND_LIST    "\n";
+    COMMAND_LIST    "\n"
+    COMMAND_BARRIER " <eraser-name>\n"
+    COMMAND_ROTATE  " <block-device>\n";
 
 static struct argp_option options[] = {
     {"device-name", 'd', "<mapped-device-name>", 0, "Mapped device name"},
+    {"fill-key-table", 'f', 0, 0, "On create, overwrite the key table with random data instead of leaving it to the first open"},
     {0}
 };
 
 struct arguments {
     char *args[4];
     char *mapped_dev;
+    int fill_key_table;
 };
 
 static error_t parse_arguments(int key, char *arg, struct argp_state *state) {
@@ -68,10 +74,15 @@ static error_t parse_arguments(int key, char *arg, struct argp_state *state) {
     case 'd':
         arguments->mapped_dev = arg;
         break;
+    case 'f':
+        arguments->fill_key_table = 1;
+        break;
     case ARGP_KEY_ARG:
         if ((state->arg_num > 2 && strcmp(arguments->args[0], COMMAND_OPEN) == 0) ||
             (state->arg_num > 2 && strcmp(arguments->args[0], COMMAND_CREATE) == 0) ||
             (state->arg_num > 1 && strcmp(arguments->args[0], COMMAND_CLOSE) == 0) ||
+            (state->arg_num > 1 && strcmp(arguments->args[0], COMMAND_BARRIER) == 0) ||
+            (state->arg_num > 1 && strcmp(arguments->args[0], COMMAND_ROTATE) == 0) ||
             (state->arg_num > 0 && strcmp(arguments->args[0], COMMAND_LIST) == 0)){
             /* Too many arguments. */
             argp_usage(state);
@@ -83,6 +94,8 @@ static error_t parse_arguments(int key, char *arg, struct argp_state *state) {
             (state->arg_num < 1 && strcmp(arguments->args[0], COMMAND_LIST) == 0) ||
             (state->arg_num < 3 && strcmp(arguments->args[0], COMMAND_CREATE) == 0) ||
             (state->arg_num < 2 && strcmp(arguments->args[0], COMMAND_CLOSE) == 0) ||
+            (state->arg_num < 2 && strcmp(arguments->args[0], COMMAND_BARRIER) == 0) ||
+            (state->arg_num < 2 && strcmp(arguments->args[0], COMMAND_ROTATE) == 0) ||
             (state->arg_num < 3 && strcmp(arguments->args[0], COMMAND_OPEN) == 0)) {
             /* Missing arguments. */
             argp_usage(state);
@@ -106,6 +119,7 @@ int main(int argc, char **argv) {
 
     /* Default arguments. */
     arguments.mapped_dev = "holepunch";
+    arguments.fill_key_table = 0;
 
     /* Parse arguments. */
     argp_parse(&arg_parser, argc, argv, 0, 0, &arguments);
@@ -114,7 +128,7 @@ int main(int argc, char **argv) {
     if (strcmp(arguments.args[0], COMMAND_CREATE) == 0) {
 
         print_green("Creating HOLEPUNCH on %s\n", arguments.args[1]);
-        do_create(arguments.args[1], atoi(arguments.args[2]));
+        do_create(arguments.args[1], atoi(arguments.args[2]), arguments.fill_key_table);
     }
     else if (strcmp(arguments.args[0], COMMAND_OPEN) == 0) {
 
@@ -126,6 +140,14 @@ int main(int argc, char **argv) {
         print_green("Closing HOLEPUNCH device %s \n", arguments.args[1]);
         do_close(arguments.args[1]);
     }
+    else if (strcmp(arguments.args[0], COMMAND_BARRIER) == 0) {
+        do_barrier(arguments.args[1]);
+    }
+    else if (strcmp(arguments.args[0], COMMAND_ROTATE) == 0) {
+
+        print_green("Rotating HOLEPUNCH keys on %s\n", arguments.args[1]);
+        do_rotate(arguments.args[1]);
+    }
     else if (strcmp(arguments.args[0], COMMAND_LIST) == 0) {
         print_green("Listing open HOLEPUNCH devices.\n");
         do_list();
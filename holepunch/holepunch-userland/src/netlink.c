@@ -27,30 +27,141 @@
 #include "netlink.h"
 #include "tpm.h"
 
+#include <pthread.h>
+
 extern struct eraser_tpm *tpm;
 extern struct eraser_nvram *nvram;
 
-void enter_netlink_loop() {
-    int s;
+/*
+ * Master key writes are answered asynchronously. The receive loop hands SET
+ * requests to a writer thread through a single-slot mailbox, so a slow NVRAM
+ * write never holds up the socket, and a SET that arrives before the previous
+ * one was picked up simply replaces it. Only the newest key matters.
+ */
+struct key_mailbox {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int stop;
+    char eraser_name[ERASER_NAME_LEN + 1];
+    unsigned char key[HOLEPUNCH_KEY_LEN];
+};
+
+static struct key_mailbox mailbox = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* The TSS context is not thread safe. */
+static pthread_mutex_t tpm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nl_sock;
+static int self_pid;
+
+/* Sends a reply to the kernel; key may be NULL. */
+static void send_reply(int type, char *eraser_name, unsigned char *key) {
     struct sockaddr_nl sa;
     struct nlmsghdr *h;
     struct iovec iov;
     struct msghdr msg;
 
-    unsigned char *key_out; /* TPM lib allocates this for us. */
-    unsigned char key[HOLEPUNCH_KEY_LEN];
+    /* Set destination. */
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_pid = 0; /* For Linux Kernel. */
+    sa.nl_groups = 0; /* Unicast. */
+
+    h = (struct nlmsghdr *) malloc(NLMSG_SPACE(MAX_PAYLOAD));
+    memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
+    h->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
+    h->nlmsg_pid = self_pid;
+    h->nlmsg_type = type;
+    strcpy(NLMSG_DATA(h), eraser_name);
+    if (key)
+        memcpy(NLMSG_DATA(h) + ERASER_NAME_LEN, key, HOLEPUNCH_KEY_LEN);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) h;
+    iov.iov_len = h->nlmsg_len;
+    msg.msg_name = (void *) &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    sendmsg(nl_sock, &msg, 0);
+
+    memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
+    free(h);
+}
+
+/* Writer thread: commits the newest key to the TPM, then ACKs it, or NACKs it
+ * if the write failed so the kernel can retry or give up. */
+static void *key_writer(void *arg) {
     char eraser_name[ERASER_NAME_LEN + 1];
+    unsigned char key[HOLEPUNCH_KEY_LEN];
+    TSS_RESULT r;
 
-    int self_pid;
+    while (1) {
+        pthread_mutex_lock(&mailbox.lock);
+        while (!mailbox.pending && !mailbox.stop) {
+            pthread_cond_wait(&mailbox.cond, &mailbox.lock);
+        }
+        if (!mailbox.pending) {
+            pthread_mutex_unlock(&mailbox.lock);
+            break;
+        }
+        strcpy(eraser_name, mailbox.eraser_name);
+        memcpy(key, mailbox.key, HOLEPUNCH_KEY_LEN);
+        mailbox.pending = 0;
+        pthread_mutex_unlock(&mailbox.lock);
 
-    s = -1;
-    do {
-        s = socket(PF_NETLINK, SOCK_RAW, ERASER_NETLINK);
-        if (s < 0) {
-            print_red("Cannot create socket. Will retry.\n");
+        /* Write key to TPM. */
+        pthread_mutex_lock(&tpm_lock);
+        r = write_nvram(nvram, key);
+        pthread_mutex_unlock(&tpm_lock);
+
+        if (r != TSS_SUCCESS) {
+            print_red("Cannot write master key!");
+            send_reply(ERASER_MSG_SET_KEY_FAIL, eraser_name, key);
+        } else {
+            /* Echo the key so the kernel can match the ACK to its request. */
+            send_reply(ERASER_MSG_SET_KEY, eraser_name, key);
         }
-        sleep(3);
-    } while (s < 0);
+        memset(key, 0, HOLEPUNCH_KEY_LEN);
+    }
+    return NULL;
+}
+
+/* Retry interval for socket creation failures, doubled up to the max. */
+#define SOCKET_RETRY_MIN_US 10000
+#define SOCKET_RETRY_MAX_US 3000000
+
+/*
+ * Serves key requests for eraser_name until the kernel says to stop. Once the
+ * socket is bound, a byte is written to ready_fd, so the caller can load the
+ * target right away, and the kernel is told in case it already asked.
+ */
+void enter_netlink_loop(char *eraser_name_in, int ready_fd) {
+    struct sockaddr_nl sa;
+    struct nlmsghdr *h;
+    struct iovec iov;
+    struct msghdr msg;
+    pthread_t writer;
+    useconds_t backoff;
+
+    unsigned char *key_out; /* TPM lib allocates this for us. */
+    unsigned char key[HOLEPUNCH_KEY_LEN];
+    char eraser_name[ERASER_NAME_LEN + 1];
+
+    backoff = SOCKET_RETRY_MIN_US;
+    while ((nl_sock = socket(PF_NETLINK, SOCK_RAW, ERASER_NETLINK)) < 0) {
+        print_red("Cannot create socket. Will retry.\n");
+        usleep(backoff);
+        if (backoff < SOCKET_RETRY_MAX_US / 2)
+            backoff *= 2;
+        else
+            backoff = SOCKET_RETRY_MAX_US;
+    }
     print_green("Socket created.\n");
 
     /* Bind. */
@@ -59,29 +170,36 @@ void enter_netlink_loop() {
     sa.nl_family = AF_NETLINK;
     sa.nl_pid = self_pid; /* Self pid. */
     sa.nl_groups = 0; /* Unicast. */
-    bind(s, (struct sockaddr *) &sa, sizeof(sa));
+    if (bind(nl_sock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        die("Cannot bind socket.\n");
+    }
 
-    /* Set destination. */
-    memset(&sa, 0, sizeof(sa));
-    sa.nl_family = AF_NETLINK;
-    sa.nl_pid = 0; /* For Linux Kernel. */
-    sa.nl_groups = 0; /* Unicast. */
+    if (pthread_create(&writer, NULL, key_writer, NULL) != 0) {
+        die("Cannot start key writer thread.\n");
+    }
 
-    /* Payload setup. */
-    h = (struct nlmsghdr *) malloc(NLMSG_SPACE(MAX_PAYLOAD));
-    memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
-    h->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-    h->nlmsg_pid = self_pid; /* Self pid. */
+    /* Ready: unblock the caller, and the kernel if it is already waiting. */
+    memset(eraser_name, 0, sizeof(eraser_name));
+    strncpy(eraser_name, eraser_name_in, ERASER_NAME_LEN);
+    if (write(ready_fd, "", 1) != 1) {
+        print_red("Cannot signal helper ready.\n");
+    }
+    close(ready_fd);
+    send_reply(ERASER_MSG_HELPER_READY, eraser_name, NULL);
 
+    /* Receive buffer setup. */
+    h = (struct nlmsghdr *) malloc(NLMSG_SPACE(MAX_PAYLOAD));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) h;
+    iov.iov_len = NLMSG_SPACE(MAX_PAYLOAD);
     msg.msg_name = (void *) &sa;
     msg.msg_namelen = sizeof(sa);
-    iov.iov_base = (void *) h;
-    iov.iov_len = h->nlmsg_len;
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
 
     while (1) {
-        if (recvmsg(s, &msg, 0) == -1) {
+        memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
+        if (recvmsg(nl_sock, &msg, 0) == -1) {
             print_red("Receive failed.");
             sleep(5);
         } else {
@@ -90,61 +208,36 @@ void enter_netlink_loop() {
                 memcpy(eraser_name, NLMSG_DATA(h), ERASER_NAME_LEN);
                 eraser_name[ERASER_NAME_LEN] = '\0';
 
-                /* Retrieve key from TPM. */
+                /* Only ever hand out the key in NVRAM, never one still
+                 * waiting for the writer: the kernel recovers a newer key
+                 * from the master key record on disk. */
+                pthread_mutex_lock(&tpm_lock);
                 if (read_nvram(nvram, &key_out) != TSS_SUCCESS) {
+                    pthread_mutex_unlock(&tpm_lock);
                     print_red("Cannot read master key!");
                     /* TODO: Do something about it. */
                     break;
                 }
-
-                /* Send key. */
-                memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
-                h->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-                h->nlmsg_pid = self_pid;
-                h->nlmsg_type = ERASER_MSG_GET_KEY;
-                strcpy(NLMSG_DATA(h), eraser_name);
-                memcpy(NLMSG_DATA(h) + ERASER_NAME_LEN, key_out, HOLEPUNCH_KEY_LEN);
-
+                pthread_mutex_unlock(&tpm_lock);
+                memcpy(key, key_out, HOLEPUNCH_KEY_LEN);
                 memset(key_out, 0, HOLEPUNCH_KEY_LEN);
                 free(key_out);
 
-                iov.iov_base = (void *) h;
-                iov.iov_len = h->nlmsg_len;
-                msg.msg_name = (void *) &sa;
-                msg.msg_namelen = sizeof(sa);
-                msg.msg_iov = &iov;
-                msg.msg_iovlen = 1;
-
-                sendmsg(s, &msg, 0);
+                /* Send key. */
+                send_reply(ERASER_MSG_GET_KEY, eraser_name, key);
+                memset(key, 0, HOLEPUNCH_KEY_LEN);
 
             } else if (h->nlmsg_type == ERASER_MSG_SET_KEY) {
-                memcpy(eraser_name, NLMSG_DATA(h), ERASER_NAME_LEN);
-                eraser_name[ERASER_NAME_LEN] = '\0';
-                memcpy(key, NLMSG_DATA(h) + ERASER_NAME_LEN, HOLEPUNCH_KEY_LEN);
-
-                /* Write key to TPM. */
-                if (write_nvram(nvram, key) != TSS_SUCCESS) {
-                    print_red("Cannot write master key!");
-                    /* TODO: Do something about it. */
-                    break;
-                }
-                memset(key, 0, HOLEPUNCH_KEY_LEN);
+                /* Hand off to the writer; the ACK is sent once the key is in
+                 * the TPM. */
+                pthread_mutex_lock(&mailbox.lock);
+                memcpy(mailbox.eraser_name, NLMSG_DATA(h), ERASER_NAME_LEN);
+                mailbox.eraser_name[ERASER_NAME_LEN] = '\0';
+                memcpy(mailbox.key, NLMSG_DATA(h) + ERASER_NAME_LEN, HOLEPUNCH_KEY_LEN);
+                mailbox.pending = 1;
+                pthread_cond_signal(&mailbox.cond);
+                pthread_mutex_unlock(&mailbox.lock);
 
-                /* Send ACK to kernel. */
-                memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
-                h->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-                h->nlmsg_pid = self_pid;
-                h->nlmsg_type = ERASER_MSG_SET_KEY;
-                strcpy(NLMSG_DATA(h), eraser_name);
-
-                iov.iov_base = (void *) h;
-                iov.iov_len = h->nlmsg_len;
-                msg.msg_name = (void *) &sa;
-                msg.msg_namelen = sizeof(sa);
-                msg.msg_iov = &iov;
-                msg.msg_iovlen = 1;
-
-                sendmsg(s, &msg, 0);
             } else if (h->nlmsg_type == ERASER_MSG_DIE) {
 #ifdef ERASER_DEBUG
                 print_red("ERASER closing down. I will also exit.\n");
@@ -153,7 +246,17 @@ void enter_netlink_loop() {
             }
         }
     }
-    close(s);
+
+    /* Let the writer drain whatever is still pending. */
+    pthread_mutex_lock(&mailbox.lock);
+    mailbox.stop = 1;
+    pthread_cond_signal(&mailbox.cond);
+    pthread_mutex_unlock(&mailbox.lock);
+    pthread_join(writer, NULL);
+
+    memset(h, 0, NLMSG_SPACE(MAX_PAYLOAD));
+    free(h);
+    close(nl_sock);
     cleanup_nvram(nvram);
     cleanup_tpm(tpm);
 }
@@ -0,0 +1,585 @@
+/*
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rotate.c
+ *
+ * Offline PPRF key rotation. Produces the same on-disk result as the kernel's
+ * holepunch_do_pprf_rotation followed by a master key rotation, and journals
+ * the same way, so that a crash at any point is recovered by the next open or
+ * by running the rotation again.
+ */
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "rotate.h"
+
+/*
+ * Crypto, mirroring the kernel side helpers. enc is 1 to encrypt, 0 to
+ * decrypt, as for OpenSSL.
+ */
+
+static void rotate_crypto_init(struct rotate_crypto *c) {
+    if (!(c->ecb = EVP_CIPHER_CTX_new()) || !(c->cbc = EVP_CIPHER_CTX_new())) {
+        ERR_print_errors_fp(stderr);
+        die("Cannot create cipher\n");
+    }
+
+    if (EVP_CipherInit_ex(c->ecb, EVP_aes_256_ecb(), NULL, NULL, NULL, 1) != 1 ||
+        EVP_CipherInit_ex(c->cbc, EVP_aes_256_cbc(), NULL, NULL, NULL, 1) != 1) {
+        ERR_print_errors_fp(stderr);
+        die("Cannot init crypto context\n");
+    }
+}
+
+static void rotate_crypto_free(struct rotate_crypto *c) {
+    EVP_CIPHER_CTX_free(c->ecb);
+    EVP_CIPHER_CTX_free(c->cbc);
+}
+
+/* Rekeys ctx and runs it over len bytes; len must be a block multiple. */
+static void rotate_cipher(EVP_CIPHER_CTX *ctx, void *dst, void *src, u64 len,
+                          int enc, void *key, void *iv) {
+    int out;
+
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, enc) != 1) {
+        ERR_print_errors_fp(stderr);
+        die("Cannot init crypto context\n");
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if (EVP_CipherUpdate(ctx, dst, &out, src, len) != 1) {
+        ERR_print_errors_fp(stderr);
+        die("Encryption error\n");
+    }
+}
+
+/* Generate the IV for a sector. */
+static void rotate_gen_iv(struct rotate_crypto *c, struct rotate_state *r,
+                          unsigned char *iv, u64 sector) {
+    unsigned char input[ERASER_IV_LEN] = {0};
+
+    *(u64 *) input = sector;
+    rotate_cipher(c->ecb, iv, input, ERASER_IV_LEN, 1, r->h->iv_key, NULL);
+}
+
+/* AES-CBC on a single sector. */
+static void rotate_cbc_sector(struct rotate_crypto *c, struct rotate_state *r,
+                              void *dst, void *src, int enc, void *key, u64 sector) {
+    unsigned char iv[ERASER_IV_LEN];
+
+    rotate_gen_iv(c, r, iv, sector);
+    rotate_cipher(c->cbc, dst, src, ERASER_SECTOR, enc, key, iv);
+}
+
+/* AES-CBC on a key table sector; the tag stays in the clear. */
+static void rotate_cbc_filekey_sector(struct rotate_crypto *c, struct rotate_state *r,
+                                      void *dst, void *src, int enc, void *key,
+                                      u64 sector) {
+    unsigned char iv[ERASER_IV_LEN];
+
+    rotate_gen_iv(c, r, iv, sector);
+    rotate_cipher(c->cbc, dst + 16, src + 16, ERASER_SECTOR - 16, enc, key, iv);
+    if (dst != src)
+        memcpy(dst, src, 16);
+}
+
+/*
+ * PPRF evaluation, as in the kernel's pprf-tree.c: walk down to the keyleaf
+ * covering tag, then expand it with the AES-ECB PRG for the remaining levels.
+ * Returns 0 on success, -1 if tag was punctured.
+ */
+static int rotate_evaluate(struct rotate_crypto *c, struct rotate_state *r,
+                           struct pprf_keynode *pprf, u32 pprf_size, u64 tag,
+                           unsigned char *out) {
+    struct pprf_keynode *cur = pprf;
+    unsigned char in[PRG_INPUT_LEN];
+    unsigned char prg_out[PRG_INPUT_LEN * 2];
+    unsigned depth = (unsigned char) r->h->pprf_depth;
+    unsigned d;
+    u32 next;
+
+    tag <<= 64 - depth;
+    for (d = 0; d < depth; ++d) {
+        if (cur->type == PPRF_KEYLEAF)
+            break;
+        if (cur->type != PPRF_INTERNAL)
+            return -1;
+
+        next = (tag & (1ull << (63 - d))) ? cur->v.next.ir : cur->v.next.il;
+        if (next >= pprf_size)
+            return -1;
+        cur = pprf + next;
+    }
+
+    memcpy(in, cur->v.key, PRG_INPUT_LEN);
+    for (; d < depth; ++d) {
+        rotate_cipher(c->ecb, prg_out, r->prg_input, PRG_INPUT_LEN * 2, 1, in, NULL);
+        if (tag & (1ull << (63 - d)))
+            memcpy(in, prg_out + PRG_INPUT_LEN, PRG_INPUT_LEN);
+        else
+            memcpy(in, prg_out, PRG_INPUT_LEN);
+    }
+    memcpy(out, in, PRG_INPUT_LEN);
+    return 0;
+}
+
+/*
+ * Disk I/O helpers. The device is opened with O_DIRECT, so buffers come from
+ * rotate_alloc.
+ */
+
+static void *rotate_alloc(u64 nr) {
+    void *buf;
+
+    if (posix_memalign(&buf, ERASER_SECTOR, nr * ERASER_SECTOR))
+        die("Cannot allocate %llu sectors\n", nr);
+    return buf;
+}
+
+static void rotate_read(struct rotate_state *r, void *buf, u64 sector, u64 nr) {
+    if (pread(r->fd, buf, nr * ERASER_SECTOR, sector * ERASER_SECTOR) != nr * ERASER_SECTOR)
+        die("Error reading from device.\n");
+}
+
+static void rotate_write(struct rotate_state *r, void *buf, u64 sector, u64 nr) {
+    if (pwrite(r->fd, buf, nr * ERASER_SECTOR, sector * ERASER_SECTOR) != nr * ERASER_SECTOR)
+        die("Error writing to device.\n");
+}
+
+static void rotate_sync(struct rotate_state *r) {
+    if (fdatasync(r->fd) == -1)
+        die("Cannot sync device.\n");
+}
+
+/*
+ * FKT and PPRF key.
+ */
+
+/* Return the FKT key for a PPRF FKT bottom sector. */
+static inline char *rotate_fkt_bottom_key(struct rotate_state *r, u64 index) {
+    return r->fkt[index / HP_FKT_PER_SECTOR].entries[index % HP_FKT_PER_SECTOR].key;
+}
+
+/* Return the FKT key for a PPRF keynode sector. */
+static inline char *rotate_pprf_sector_key(struct rotate_state *r, u64 index) {
+    return r->fkt[index / HP_FKT_PER_SECTOR + r->h->fkt_top_width]
+        .entries[index % HP_FKT_PER_SECTOR].key;
+}
+
+/* Decrypts the FKT in memory: the top level with the master key, then the
+ * bottom level with the keys in the top. */
+static void rotate_decrypt_fkt(struct rotate_state *r, struct rotate_crypto *c) {
+    u64 s;
+
+    for (s = 0; s < r->h->fkt_top_width; ++s)
+        rotate_cbc_sector(c, r, r->fkt + s, r->fkt + s, 0, r->master_key,
+                          r->h->fkt_start + s);
+    for (; s < r->fkt_len; ++s)
+        rotate_cbc_sector(c, r, r->fkt + s, r->fkt + s, 0,
+                          rotate_fkt_bottom_key(r, s - r->h->fkt_top_width),
+                          r->h->fkt_start + s);
+}
+
+static void rotate_read_fkt(struct rotate_state *r, struct rotate_crypto *c) {
+    r->fkt = rotate_alloc(r->fkt_len);
+    rotate_read(r, r->fkt, r->h->fkt_start, r->fkt_len);
+    rotate_decrypt_fkt(r, c);
+}
+
+static void rotate_read_pprf(struct rotate_state *r, struct rotate_crypto *c) {
+    char *buf;
+    u64 len, i;
+
+    r->pprf_size = r->fkt->pprf_size;
+    len = div_ceil(r->pprf_size, HP_PPRF_PER_SECTOR);
+    if (!r->pprf_size || len > r->h->data_start - r->h->pprf_start)
+        die("PPRF key size %u is corrupt; wrong password?\n", r->pprf_size);
+
+    buf = rotate_alloc(len);
+    r->pprf = malloc(len * HP_PPRF_PER_SECTOR * sizeof(struct pprf_keynode));
+    if (!r->pprf)
+        die("Cannot allocate PPRF key\n");
+
+    /* Keynodes do not fill sectors exactly, so they are copied out. */
+    rotate_read(r, buf, r->h->pprf_start, len);
+    for (i = 0; i < len; ++i) {
+        rotate_cbc_sector(c, r, buf + i * ERASER_SECTOR, buf + i * ERASER_SECTOR, 0,
+                          rotate_pprf_sector_key(r, i), r->h->pprf_start + i);
+        memcpy(r->pprf + i * HP_PPRF_PER_SECTOR, buf + i * ERASER_SECTOR,
+               HP_PPRF_PER_SECTOR * sizeof(struct pprf_keynode));
+    }
+    free(buf);
+}
+
+/* Reset the FKT to random data, keeping only the PPRF size and tag counter,
+ * then write the new single-node PPRF key. */
+static void rotate_reset_pprf(struct rotate_state *r, struct rotate_crypto *c) {
+    EVP_CIPHER_CTX *ctx;
+    char *buf;
+
+    ctx = start_random_stream();
+    get_random_stream(ctx, (char *) r->fkt, r->fkt_len * ERASER_SECTOR);
+    finish_random_stream(ctx);
+
+    rotate_cbc_sector(c, r, r->fkt, r->fkt, 0, r->master_key, r->h->fkt_start);
+    r->fkt->tag_counter = r->key_table_len;
+    r->fkt->pprf_size = 1;
+    rotate_cbc_sector(c, r, r->fkt, r->fkt, 1, r->master_key, r->h->fkt_start);
+    rotate_write(r, r->fkt, r->h->fkt_start, r->fkt_len);
+    rotate_decrypt_fkt(r, c);
+
+    buf = rotate_alloc(1);
+    memset(buf, 0, ERASER_SECTOR);
+    memcpy(buf, &r->pprf_new, sizeof(r->pprf_new));
+    rotate_cbc_sector(c, r, buf, buf, 1, rotate_pprf_sector_key(r, 0), r->h->pprf_start);
+    rotate_write(r, buf, r->h->pprf_start, 1);
+    rotate_sync(r);
+    free(buf);
+}
+
+/*
+ * Key table.
+ */
+
+/* Decrypts a key table sector with the key pprf gives for its tag; returns 1
+ * if the magic bytes check out. */
+static int rotate_decrypt_key_sector(struct rotate_state *r, struct rotate_crypto *c,
+                                     struct holepunch_filekey_sector *plain,
+                                     struct holepunch_filekey_sector *cipher,
+                                     struct pprf_keynode *pprf, u32 pprf_size,
+                                     u64 sector) {
+    unsigned char key[HOLEPUNCH_KEY_LEN];
+
+    if (rotate_evaluate(c, r, pprf, pprf_size, cipher->tag, key))
+        return 0;
+    rotate_cbc_filekey_sector(c, r, plain, cipher, 0, key, sector);
+    memset(key, 0, HOLEPUNCH_KEY_LEN);
+    return plain->magic1 == HP_MAGIC1 && plain->magic2 == HP_MAGIC2;
+}
+
+/* Finds the first sector in the job that is not yet under the new PPRF key. */
+static void rotate_check_job(struct rotate_job *j, struct rotate_crypto *c) {
+    struct holepunch_filekey_sector *plain = rotate_alloc(1);
+    struct rotate_state *r = j->r;
+
+    for (j->result = 0; j->result < j->nr; ++j->result) {
+        if (!rotate_decrypt_key_sector(r, c, plain,
+                (void *) j->buf + j->result * ERASER_SECTOR, &r->pprf_new, 1,
+                r->h->key_table_start + j->first + j->result))
+            break;
+    }
+    memset(plain, 0, ERASER_SECTOR);
+    free(plain);
+}
+
+/*
+ * Moves every sector in the job to the new PPRF key, in place. A sector may
+ * already be under the new key if a previous run wrote it before crashing.
+ */
+static void rotate_key_job(struct rotate_job *j, struct rotate_crypto *c) {
+    struct holepunch_filekey_sector *plain = rotate_alloc(1);
+    struct holepunch_filekey_sector *cipher;
+    struct rotate_state *r = j->r;
+    unsigned char key[HOLEPUNCH_KEY_LEN];
+    u64 i, sno, s;
+
+    for (i = 0; i < j->nr; ++i) {
+        cipher = (void *) j->buf + i * ERASER_SECTOR;
+        sno = j->first + i;
+        s = r->h->key_table_start + sno;
+
+        if (!rotate_decrypt_key_sector(r, c, plain, cipher, r->pprf, r->pprf_size, s) &&
+            !rotate_decrypt_key_sector(r, c, plain, cipher, &r->pprf_new, 1, s)) {
+            print_red("\nBad magic bytes found and reset; inodes %llu-%llu "
+                      "(filekey sector %llu) may experience data loss\n",
+                      sno * HP_KEY_PER_SECTOR, (sno + 1) * HP_KEY_PER_SECTOR - 1, sno);
+            __atomic_add_fetch(&r->bad_sectors, 1, __ATOMIC_RELAXED);
+            plain->magic1 = HP_MAGIC1;
+            plain->magic2 = HP_MAGIC2;
+        }
+
+        plain->tag = sno;
+        rotate_evaluate(c, r, &r->pprf_new, 1, sno, key);
+        rotate_cbc_filekey_sector(c, r, cipher, plain, 1, key, s);
+    }
+    memset(key, 0, HOLEPUNCH_KEY_LEN);
+    memset(plain, 0, ERASER_SECTOR);
+    free(plain);
+}
+
+static void *rotate_worker(void *arg) {
+    struct rotate_job *j = arg;
+    struct rotate_crypto c;
+
+    rotate_crypto_init(&c);
+    j->fn(j, &c);
+    rotate_crypto_free(&c);
+    return NULL;
+}
+
+/* Splits nr sectors of buf between the threads and runs fn on each part.
+ * Returns the number of jobs, in order, in jobs. */
+static int rotate_run(struct rotate_state *r, char *buf, u64 first, u64 nr,
+                      void (*fn)(struct rotate_job *, struct rotate_crypto *),
+                      struct rotate_job *jobs) {
+    pthread_t threads[ROTATE_MAX_THREADS];
+    u64 per = div_ceil(nr, r->nr_threads);
+    u64 off;
+    int i, n;
+
+    for (off = 0, n = 0; off < nr; off += per, ++n) {
+        jobs[n].r = r;
+        jobs[n].buf = buf + off * ERASER_SECTOR;
+        jobs[n].first = first + off;
+        jobs[n].nr = (nr - off < per) ? nr - off : per;
+        jobs[n].fn = fn;
+        if (pthread_create(&threads[n], NULL, rotate_worker, &jobs[n]) != 0)
+            die("Cannot start rotation thread\n");
+    }
+    for (i = 0; i < n; ++i)
+        pthread_join(threads[i], NULL);
+    return n;
+}
+
+/* Finds where an interrupted rotation stopped: the first sector not yet under
+ * the new key. */
+static u64 rotate_find_start(struct rotate_state *r) {
+    struct rotate_job jobs[ROTATE_MAX_THREADS];
+    char *buf = rotate_alloc(ROTATE_WINDOW);
+    u64 s, n;
+    int i, nr_jobs;
+
+    for (s = 0; s < r->key_table_len; s += n) {
+        n = (r->key_table_len - s < ROTATE_WINDOW) ? r->key_table_len - s : ROTATE_WINDOW;
+        rotate_read(r, buf, r->h->key_table_start + s, n);
+        nr_jobs = rotate_run(r, buf, s, n, rotate_check_job, jobs);
+        for (i = 0; i < nr_jobs; ++i) {
+            if (jobs[i].result < jobs[i].nr) {
+                free(buf);
+                return jobs[i].first + jobs[i].result;
+            }
+        }
+    }
+    free(buf);
+    return r->key_table_len;
+}
+
+/* Moves the key table from start on to the new key, one window at a time. A
+ * window is synced before the next one is read, so that rotated sectors only
+ * get ahead of the first unrotated one within a window. */
+static void rotate_key_table(struct rotate_state *r, u64 start) {
+    struct rotate_job jobs[ROTATE_MAX_THREADS];
+    struct timespec t_start, t_now;
+    char *buf = rotate_alloc(ROTATE_WINDOW);
+    u64 s, n;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (s = start; s < r->key_table_len; s += n) {
+        n = (r->key_table_len - s < ROTATE_WINDOW) ? r->key_table_len - s : ROTATE_WINDOW;
+        rotate_read(r, buf, r->h->key_table_start + s, n);
+        rotate_run(r, buf, s, n, rotate_key_job, jobs);
+        rotate_write(r, buf, r->h->key_table_start + s, n);
+        rotate_sync(r);
+
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+        ms = (t_now.tv_sec - t_start.tv_sec) * 1000 + (t_now.tv_nsec - t_start.tv_nsec) / 1000000;
+        print_green("\r-> Rotated %llu / %llu key table sectors (%llu MiB/s)   ",
+                    s + n, r->key_table_len,
+                    ms ? ((s + n - start) * ERASER_SECTOR >> 20) * 1000 / ms : 0);
+    }
+    print_green("\n");
+    memset(buf, 0, ROTATE_WINDOW * ERASER_SECTOR);
+    free(buf);
+}
+
+/*
+ * Master key rotation and journal.
+ */
+
+/* Copies the new top level FKT blocks to their place, then hands the new key
+ * to the TPM and clears the journal. */
+static void rotate_master_apply(struct rotate_state *r, u64 *ctl, char *blocks,
+                                unsigned char *new_key) {
+    rotate_write(r, blocks, r->h->fkt_start, r->h->fkt_top_width);
+    rotate_sync(r);
+    if (write_nvram(r->nvram, new_key) != TSS_SUCCESS)
+        die("Cannot write master key! It will be recovered at the next open.\n");
+    memcpy(r->master_key, new_key, HOLEPUNCH_KEY_LEN);
+
+    memset(ctl, 0, ERASER_SECTOR);
+    rotate_write(r, ctl, r->h->journal_start, 1);
+    rotate_sync(r);
+}
+
+/* Journal, then complete, a master key rotation; same as the kernel's
+ * journalled holepunch_rotate_master. */
+static void rotate_master(struct rotate_state *r, struct rotate_crypto *c, u64 *ctl) {
+    struct holepunch_master_record *rec = (void *) ctl + HPJ_MASTER_REC_OFFSET;
+    unsigned char new_key[HOLEPUNCH_KEY_LEN];
+    char *blocks = rotate_alloc(r->h->fkt_top_width);
+    u64 i;
+
+    get_random_data(new_key, HOLEPUNCH_KEY_LEN);
+    for (i = 0; i < r->h->fkt_top_width; ++i)
+        rotate_cbc_sector(c, r, blocks + i * ERASER_SECTOR, r->fkt + i, 1, new_key,
+                          r->h->fkt_start + i);
+    rotate_write(r, blocks, r->h->journal_start + 1, r->h->fkt_top_width);
+    rotate_sync(r);
+
+    /* Only the key in the TPM now can be stale. */
+    memset(ctl, 0, ERASER_SECTOR);
+    ctl[0] = HPJ_MASTER_ROT;
+    rec->magic = HPJ_MASTER_REC_MAGIC;
+    rotate_cipher(c->ecb, rec->slots[0].enc_key, new_key, HOLEPUNCH_KEY_LEN, 1,
+                  r->master_key, NULL);
+    SHA256(r->master_key, HOLEPUNCH_KEY_LEN, rec->slots[0].hash);
+    rotate_write(r, ctl, r->h->journal_start, 1);
+    rotate_sync(r);
+
+    rotate_master_apply(r, ctl, blocks, new_key);
+    memset(new_key, 0, HOLEPUNCH_KEY_LEN);
+    free(blocks);
+}
+
+/*
+ * Recovers what the kernel would at mount from the master key record: a
+ * master key rotation, or a newer master key that never made it to the TPM.
+ * Leaves r->master_key as the key the FKT is encrypted with.
+ */
+static void rotate_recover_master(struct rotate_state *r, struct rotate_crypto *c,
+                                  u64 *ctl) {
+    struct holepunch_master_record *rec = (void *) ctl + HPJ_MASTER_REC_OFFSET;
+    unsigned char hash[HP_HASH_LEN];
+    unsigned char new_key[HOLEPUNCH_KEY_LEN];
+    char *blocks;
+    int i;
+
+    i = HPJ_MASTER_REC_SLOTS;
+    if (rec->magic == HPJ_MASTER_REC_MAGIC) {
+        SHA256(r->master_key, HOLEPUNCH_KEY_LEN, hash);
+        for (i = 0; i < HPJ_MASTER_REC_SLOTS; ++i) {
+            if (!memcmp(hash, rec->slots[i].hash, HP_HASH_LEN))
+                break;
+        }
+    }
+    if (i < HPJ_MASTER_REC_SLOTS)
+        rotate_cipher(c->ecb, new_key, rec->slots[i].enc_key, HOLEPUNCH_KEY_LEN, 0,
+                      r->master_key, NULL);
+
+    if (ctl[0] == HPJ_MASTER_ROT) {
+        if (i < HPJ_MASTER_REC_SLOTS) {
+            print_green("Recovering master key rotation\n");
+            blocks = rotate_alloc(r->h->fkt_top_width);
+            rotate_read(r, blocks, r->h->journal_start + 1, r->h->fkt_top_width);
+            rotate_master_apply(r, ctl, blocks, new_key);
+            free(blocks);
+        } else {
+            memset(ctl, 0, ERASER_SECTOR);
+            rotate_write(r, ctl, r->h->journal_start, 1);
+            rotate_sync(r);
+        }
+    } else if (i < HPJ_MASTER_REC_SLOTS) {
+        print_green("Recovering pending master key commit\n");
+        if (write_nvram(r->nvram, new_key) != TSS_SUCCESS)
+            die("Cannot write master key!\n");
+        memcpy(r->master_key, new_key, HOLEPUNCH_KEY_LEN);
+    }
+    memset(new_key, 0, HOLEPUNCH_KEY_LEN);
+}
+
+/*
+ * Rotates the PPRF key of a closed device on all CPUs. fd must be open with
+ * O_DIRECT; the header is already verified.
+ */
+void rotate_offline(int fd, struct holepunch_header *h, struct eraser_nvram *nvram) {
+    struct rotate_state r;
+    struct rotate_crypto c;
+    unsigned char new_key[HOLEPUNCH_KEY_LEN];
+    unsigned char *key_out;
+    u64 *ctl;
+    u64 start;
+    int i, resume;
+
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.h = h;
+    r.nvram = nvram;
+    r.key_table_len = h->fkt_start - h->key_table_start;
+    r.fkt_len = h->fkt_top_width + h->fkt_bottom_width;
+    for (i = 0; i < HOLEPUNCH_KEY_LEN * 2; ++i)
+        r.prg_input[i] = i;
+
+    r.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (r.nr_threads < 1)
+        r.nr_threads = 1;
+    if (r.nr_threads > ROTATE_MAX_THREADS)
+        r.nr_threads = ROTATE_MAX_THREADS;
+    rotate_crypto_init(&c);
+
+    if (read_nvram(nvram, &key_out) != TSS_SUCCESS)
+        die("Cannot read master key!\n");
+    memcpy(r.master_key, key_out, HOLEPUNCH_KEY_LEN);
+    memset(key_out, 0, HOLEPUNCH_KEY_LEN);
+    free(key_out);
+
+    ctl = rotate_alloc(1);
+    rotate_read(&r, ctl, h->journal_start, 1);
+    rotate_recover_master(&r, &c, ctl);
+
+    /* Journal the new PPRF key, or pick up the one already journalled. */
+    resume = ctl[0] == HPJ_PPRF_ROT;
+    if (resume) {
+        print_green("Resuming interrupted PPRF key rotation\n");
+        rotate_cipher(c.ecb, new_key, ctl + 1, HOLEPUNCH_KEY_LEN, 0, r.master_key, NULL);
+    } else if (ctl[0] == HPJ_NONE) {
+        get_random_data(new_key, HOLEPUNCH_KEY_LEN);
+        memset(ctl, 0, ERASER_SECTOR);
+        ctl[0] = HPJ_PPRF_ROT;
+        rotate_cipher(c.ecb, ctl + 1, new_key, HOLEPUNCH_KEY_LEN, 1, r.master_key, NULL);
+        rotate_write(&r, ctl, h->journal_start, 1);
+        rotate_sync(&r);
+    } else {
+        die("Journal entry of type %llu pending; open and close the device "
+            "first to recover it.\n", ctl[0]);
+    }
+    r.pprf_new.type = PPRF_KEYLEAF;
+    memcpy(r.pprf_new.v.key, new_key, HOLEPUNCH_KEY_LEN);
+    memset(new_key, 0, HOLEPUNCH_KEY_LEN);
+
+    rotate_read_fkt(&r, &c);
+    rotate_read_pprf(&r, &c);
+
+    print_green("-> Rotating %llu key table sectors on %d threads\n",
+                r.key_table_len, r.nr_threads);
+    start = resume ? rotate_find_start(&r) : 0;
+    rotate_key_table(&r, start);
+    if (r.bad_sectors)
+        print_red("%llu key table sectors had bad magic bytes\n", r.bad_sectors);
+
+    rotate_reset_pprf(&r, &c);
+    rotate_master(&r, &c, ctl);
+
+    rotate_crypto_free(&c);
+    memset(r.master_key, 0, HOLEPUNCH_KEY_LEN);
+    memset(&r.pprf_new, 0, sizeof(r.pprf_new));
+    memset(r.pprf, 0, div_ceil(r.pprf_size, HP_PPRF_PER_SECTOR) * HP_PPRF_PER_SECTOR *
+           sizeof(struct pprf_keynode));
+    memset(r.fkt, 0, r.fkt_len * ERASER_SECTOR);
+    free(r.pprf);
+    free(r.fkt);
+    free(ctl);
+}
@@ -25,7 +25,11 @@
 #include "holepunch.h"
 #include "tpm.h"
 
-/* If defined, use simple file I/O instead of a TPM chip. For testing only. */
+/*
+ * If defined, use simple file I/O instead of a TPM chip. Speaks the same
+ * protocol as the real thing, so it can stand in for benchmarks; never use it
+ * for real data.
+ */
 #ifdef ERASER_NO_TPM
 
 void check_tpm_success(TSS_RESULT r) {}
@@ -38,18 +42,32 @@ struct eraser_nvram *setup_nvram(unsigned index, int len, char *owner_pass, stru
 TSS_RESULT write_nvram(struct eraser_nvram *n, unsigned char *data) {
     int f;
 
-    f = open("/tmp/tpm_test", O_RDWR | O_CREAT);
-    write(f, data, HOLEPUNCH_KEY_LEN);
+    f = open(HOLEPUNCH_SOFT_TPM_PATH, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (f == -1)
+        return 1;
+    if (write(f, data, HOLEPUNCH_KEY_LEN) != HOLEPUNCH_KEY_LEN || fsync(f) == -1) {
+        close(f);
+        return 1;
+    }
     close(f);
+
+    if (HOLEPUNCH_SOFT_TPM_DELAY_US)
+        usleep(HOLEPUNCH_SOFT_TPM_DELAY_US);
     return TSS_SUCCESS;
 }
 
 TSS_RESULT read_nvram(struct eraser_nvram *n, unsigned char **out) {
     int f;
 
-    f = open("/tmp/tpm_test", O_RDWR);
+    f = open(HOLEPUNCH_SOFT_TPM_PATH, O_RDONLY);
+    if (f == -1)
+        return 1;
     *out = malloc(HOLEPUNCH_KEY_LEN);
-    read(f, *out, HOLEPUNCH_KEY_LEN);
+    if (read(f, *out, HOLEPUNCH_KEY_LEN) != HOLEPUNCH_KEY_LEN) {
+        free(*out);
+        close(f);
+        return 1;
+    }
     close(f);
     return TSS_SUCCESS;
 }
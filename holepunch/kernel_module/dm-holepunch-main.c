@@ -22,8 +22,24 @@
  */
 
 #include "dm-holepunch-main.h"
+#include <linux/timekeeping.h>
 
 #define STATEUNIT 100000
+
+/* Default deletion deadline for new instances, in msecs. */
+static unsigned delete_deadline_ms = HOLEPUNCH_DELETE_DEADLINE_MS;
+module_param(delete_deadline_ms, uint, S_IWUSR | S_IRUSR);
+MODULE_PARM_DESC(delete_deadline_ms, "Max time to durable deletion in ms (0: no batching)");
+
+/* Default map cache budget for new instances, in KiB. */
+static unsigned cache_budget_kb = HOLEPUNCH_CACHE_BUDGET_KB;
+module_param(cache_budget_kb, uint, S_IWUSR | S_IRUSR);
+MODULE_PARM_DESC(cache_budget_kb, "Key table cache budget in KiB (0: no budget)");
+
+/* CPUs to run crypto workers on for new instances, as a CPU list. */
+static char *crypto_cpus = "";
+module_param(crypto_cpus, charp, S_IRUSR);
+MODULE_PARM_DESC(crypto_cpus, "CPUs for crypto workers, e.g. 0-3,8 (empty: all)");
 #ifdef HOLEPUNCH_DEBUG
 #include "linux/moduleparam.h"
 unsigned killcode = (unsigned) -1;
@@ -92,7 +108,9 @@ static int eraser_list_mounts(struct seq_file *f, void *v)
 	down(&holepunch_dev_lock);
 	list_for_each_entry(cur, &holepunch_dev_list, list)
 	{
-		seq_printf(f, "%s %s %s\n", cur->eraser_name, cur->real_dev_path, cur->virt_dev_path);
+		seq_printf(f, "%s %s %s warm %u/%u\n", cur->eraser_name,
+				cur->real_dev_path, cur->virt_dev_path,
+				READ_ONCE(cur->warm_done), cur->warm_total);
 	}
 	up(&holepunch_dev_lock);
 
@@ -159,28 +177,6 @@ static inline struct bio *eraser_allocate_bio(struct holepunch_dev *rd)
 	return eraser_allocate_bio_multi_vector(1, rd);
 }
 
-static struct eraser_io_work *eraser_allocate_io_work(struct bio *bio, struct holepunch_dev *rd)
-{
-	struct eraser_io_work *w;
-
-	w = mempool_alloc(rd->io_work_pool, GFP_NOIO);
-	if (!w)
-	{
-		DMWARN("Cannot allocate new io work!");
-	}
-	else
-	{
-		w->bio = bio;
-		w->rd = rd;
-	}
-	return w;
-}
-
-static inline void eraser_free_io_work(struct eraser_io_work *w)
-{
-	mempool_free(w, w->rd->io_work_pool);
-}
-
 static struct eraser_unlink_work *eraser_allocate_unlink_work(unsigned long ino, struct holepunch_dev *rd)
 {
 	struct eraser_unlink_work *w;
@@ -191,6 +187,9 @@ static struct eraser_unlink_work *eraser_allocate_unlink_work(unsigned long ino,
 	} else {
 		w->ino = ino;
 		w->rd = rd;
+		w->queued = jiffies;
+		w->inode = NULL;
+		w->unlinked = 1;
 	}
 	return w;
 }
@@ -221,6 +220,20 @@ static inline void eraser_free_map_cache(struct eraser_map_cache *c, struct hole
 	mempool_free(c, rd->map_cache_pool);
 }
 
+static void eraser_free_map_cache_rcu(struct rcu_head *head)
+{
+	struct eraser_map_cache *c = container_of(head, struct eraser_map_cache, rcu);
+
+	eraser_free_map_cache(c, c->rd);
+}
+
+static const struct rhashtable_params holepunch_cache_params = {
+	.key_len = sizeof(u64),
+	.key_offset = offsetof(struct eraser_map_cache, sector),
+	.head_offset = offsetof(struct eraser_map_cache, node),
+	.automatic_shrinking = true,
+};
+
 /*
  * ERASER device management functions.
  */
@@ -351,6 +364,47 @@ static void holepunch_cbc(struct holepunch_dev *rd, void *dst, void *src, u64 le
 	put_cpu();
 }
 
+/*
+ * Decrypts the sectors of a completed read in place, from its completion
+ * context. Uses this CPU's second pair of transforms, with interrupts off so
+ * that another completion can't get in halfway; the first pair may be in use
+ * by whatever was interrupted.
+ */
+static void holepunch_decrypt_atomic(struct holepunch_dev *rd, struct bio *bio,
+		struct bvec_iter iter, u8 *key)
+{
+	struct crypto_blkcipher *ecb, *cbc;
+	u8 input[ERASER_IV_LEN];
+	u8 iv[ERASER_IV_LEN];
+	struct bio_vec vec;
+	unsigned long flags;
+	void *p;
+	int cpu;
+
+	local_irq_save(flags);
+	cpu = rd->cpus + smp_processor_id();
+	ecb = rd->ecb_tfm[cpu];
+	cbc = rd->cbc_tfm[cpu];
+	crypto_blkcipher_setkey(ecb, rd->hp_h->iv_key, HOLEPUNCH_KEY_LEN);
+	crypto_blkcipher_setkey(cbc, key, HOLEPUNCH_KEY_LEN);
+	while (iter.bi_size)
+	{
+		vec = bio_iter_iovec(bio, iter);
+		bio_advance_iter(bio, &iter, vec.bv_len);
+
+		/* Same IV as holepunch_gen_iv. */
+		memset(input, 0, ERASER_IV_LEN);
+		*(u64 *)input = iter.bi_sector;
+		__holepunch_blkcipher(iv, input, ERASER_IV_LEN, HOLEPUNCH_ENCRYPT, ecb);
+		crypto_blkcipher_set_iv(cbc, iv, ERASER_IV_LEN);
+
+		p = kmap_atomic(vec.bv_page);
+		__holepunch_blkcipher(p, p, ERASER_SECTOR, HOLEPUNCH_DECRYPT, cbc);
+		kunmap_atomic(p);
+	}
+	local_irq_restore(flags);
+}
+
 /* Generate the IV for a sector. */
 static void holepunch_gen_iv(struct holepunch_dev *rd, u8 *iv, u64 sector)
 {
@@ -415,56 +469,161 @@ static void holepunch_hash(struct holepunch_dev *rd, void *in, u64 len, void *ou
 
 /*
  * Disk I/O helpers.
+ *
+ * All metadata I/O goes through batches: holepunch_meta_rw queues bios for a
+ * run of contiguous sectors and returns at once, and the caller waits for the
+ * whole batch when it needs the data or the durability. Metadata bios are
+ * tagged REQ_META | REQ_PRIO, so that they are not queued behind file data.
+ */
+
+static void holepunch_meta_batch_init(struct holepunch_meta_batch *b)
+{
+	atomic_set(&b->pending, 1);
+	init_completion(&b->done);
+	b->error = 0;
+}
+
+static void holepunch_meta_batch_end_io(struct bio *bio)
+{
+	struct holepunch_meta_batch *b = bio->bi_private;
+
+	if (bio->bi_error)
+		b->error = bio->bi_error;
+	if (atomic_dec_and_test(&b->pending))
+		complete(&b->done);
+	bio_put(bio);
+}
+
+/* Waits for all I/O in the batch; returns the last error, if any. */
+static int holepunch_meta_batch_wait(struct holepunch_meta_batch *b)
+{
+	if (!atomic_dec_and_test(&b->pending))
+		wait_for_completion(&b->done);
+	return b->error;
+}
+
+/* Buffers are either kmapped pool pages or vmalloc'd tables. */
+static inline struct page *holepunch_meta_page(void *buf)
+{
+	if (is_vmalloc_addr(buf))
+		return vmalloc_to_page(buf);
+	return virt_to_page(buf);
+}
+
+static struct bio *holepunch_meta_bio_alloc(struct holepunch_dev *rd, int rw,
+		u64 sector, unsigned n, bio_end_io_t *end_io, void *private)
+{
+	struct bio *bio;
+
+	bio = eraser_allocate_bio_multi_vector(n, rd);
+	bio->bi_bdev = rd->real_dev->bdev;
+	bio->bi_iter.bi_sector = sector * ERASER_SECTOR_SCALE;
+	bio->bi_rw |= REQ_META | REQ_PRIO | rw;
+	bio->bi_private = private;
+	bio->bi_end_io = end_io;
+	return bio;
+}
+
+/*
+ * Submits I/O of n sectors at sector (on the REAL device), ending with a
+ * single call to end_io. If the queue limits fill a bio early, the rest goes
+ * in a new bio that the full one is chained to, which completes last.
+ */
+static void __holepunch_meta_bio(struct holepunch_dev *rd, int rw, u64 sector,
+		void *buf, unsigned n, bio_end_io_t *end_io, void *private)
+{
+	struct bio *bio, *next;
+	unsigned i = 0;
+
+	bio = holepunch_meta_bio_alloc(rd, rw, sector, n, end_io, private);
+	while (i < n) {
+		if (bio_add_page(bio, holepunch_meta_page(buf + i * ERASER_SECTOR),
+				ERASER_SECTOR, 0) == ERASER_SECTOR) {
+			++i;
+			continue;
+		}
+		if (!bio->bi_vcnt) {
+			DMERR("Cannot add metadata sector %llu to a bio", sector + i);
+			bio->bi_error = -EIO;
+			bio_endio(bio);
+			return;
+		}
+		next = holepunch_meta_bio_alloc(rd, rw, sector + i, n - i, end_io,
+				private);
+		bio_chain(bio, next);
+		++rd->stats_meta_bios;
+		submit_bio(0, bio);
+		bio = next;
+	}
+
+	++rd->stats_meta_bios;
+	rd->stats_meta_sectors += n;
+	submit_bio(0, bio);
+}
+
+/*
+ * Queues I/O of nr sectors starting at sector (on the REAL device) from or
+ * into buf, which must be sector aligned and stay alive until the batch is
+ * waited on. Up to BIO_MAX_PAGES sectors go in each bio.
  */
+static void holepunch_meta_rw(struct holepunch_dev *rd,
+		struct holepunch_meta_batch *b, int rw, u64 sector, void *buf, u64 nr)
+{
+	unsigned n;
+
+	while (nr) {
+		n = min_t(u64, nr, BIO_MAX_PAGES);
+		atomic_inc(&b->pending);
+		__holepunch_meta_bio(rd, rw, sector, buf, n,
+				holepunch_meta_batch_end_io, b);
+
+		sector += n;
+		buf += n * ERASER_SECTOR;
+		nr -= n;
+	}
+}
+
+/* Sync I/O of nr contiguous sectors. */
+static int holepunch_meta_rw_sync(struct holepunch_dev *rd, int rw, u64 sector,
+		void *buf, u64 nr)
+{
+	struct holepunch_meta_batch b;
+	int r;
+
+	holepunch_meta_batch_init(&b);
+	holepunch_meta_rw(rd, &b, rw, sector, buf, nr);
+	r = holepunch_meta_batch_wait(&b);
+	if (r)
+		DMERR("Metadata %s of sectors %llu-%llu failed: %d",
+				(rw & WRITE) ? "write" : "read", sector, sector + nr - 1, r);
+	return r;
+}
 
 /*
- * Sync I/O helper for metadata operations.
- * @bdev: Block device.
+ * Sync I/O helper for single-sector metadata operations.
  * @sector: Sector no on REAL device!
  * @rw: READ or WRITE
  * @write_buf: Data buffer to write. Ignored for reads.
- * @read_buf: 
+ * @read_buf: Buffer to read into; a new page is allocated if NULL.
  * @return: Buffer containing read data. Caller frees memory.
  */
-static void *__eraser_rw_sector(struct block_device *bdev, u64 sector,
-		int rw, void *write_buf, void *read_buf, struct holepunch_dev *rd)
+static void *eraser_rw_sector(u64 sector, int rw, void *write_buf,
+		void *read_buf, struct holepunch_dev *rd)
 {
-	struct bio *bio;
-	struct page *p;
+	void *buf;
 
 	if (rw == WRITE && !write_buf)
 	{
 		DMWARN("Write buffer is NULL, aborting");
 		return NULL;
 	}
-	bio = eraser_allocate_bio(rd);
-	bio->bi_bdev = bdev;
-	bio->bi_iter.bi_sector = sector * ERASER_SECTOR_SCALE;
-
-	if (rw == READ) {
-		if (read_buf)
-			p = virt_to_page(read_buf);
-		else
-			p = eraser_allocate_page(rd);
-		bio->bi_rw &= ~REQ_WRITE;
-	} else {
-		p = virt_to_page(write_buf);
-		bio->bi_rw |= REQ_WRITE;
-	}
-	bio_add_page(bio, p, ERASER_SECTOR, 0);
-
-	submit_bio_wait(0, bio);
-	// DMINFO("///");
-
-	bio_put(bio);
-
-	return kmap(p);
-}
+	if (rw == READ)
+		buf = read_buf ? read_buf : kmap(eraser_allocate_page(rd));
+	else
+		buf = write_buf;
 
-/* Shortcut for I/O on the underlying block device. */
-static inline void *eraser_rw_sector(u64 sector, int rw, void *write_buf, void *read_buf, struct holepunch_dev *rd)
-{
-	return __eraser_rw_sector(rd->real_dev->bdev, sector, rw, write_buf, read_buf, rd);
+	holepunch_meta_rw_sync(rd, rw, sector, buf, 1);
+	return buf;
 }
 
 static inline void *eraser_write_sector(u64 sector, void *write_buf, struct holepunch_dev *rd) 
@@ -477,6 +636,59 @@ static inline void *eraser_read_sector(u64 sector, void *read_buf, struct holepu
 	return eraser_rw_sector(sector, READ, NULL, read_buf, rd);
 }
 
+/* Single-sector write that is on stable storage once it returns. */
+static inline int holepunch_write_sector_fua(u64 sector, void *buf,
+		struct holepunch_dev *rd)
+{
+	return holepunch_meta_rw_sync(rd, WRITE_FUA, sector, buf, 1);
+}
+
+#ifdef HOLEPUNCH_META_BENCH
+#define HOLEPUNCH_META_BENCH_SECTORS 8192 /* 32 MiB. */
+
+/*
+ * Compares metadata read throughput of the batched path against one
+ * synchronous single-page bio per sector, over the key table and FKT. Reads
+ * only; the batched pass goes first, so any device cache favors the other.
+ */
+static void holepunch_meta_benchmark(struct holepunch_dev *rd)
+{
+	struct bio *bio;
+	struct page *p;
+	void *buf;
+	u64 nr, s, t, ns_batch, ns_sync;
+
+	nr = min_t(u64, rd->hp_h->pprf_start - rd->hp_h->key_table_start,
+			HOLEPUNCH_META_BENCH_SECTORS);
+	buf = vmalloc(nr * ERASER_SECTOR);
+	if (!buf)
+		return;
+
+	t = ktime_get_ns();
+	holepunch_meta_rw_sync(rd, READ, rd->hp_h->key_table_start, buf, nr);
+	ns_batch = ktime_get_ns() - t;
+
+	p = eraser_allocate_page(rd);
+	t = ktime_get_ns();
+	for (s = 0; s < nr; ++s) {
+		bio = eraser_allocate_bio(rd);
+		bio->bi_bdev = rd->real_dev->bdev;
+		bio->bi_iter.bi_sector = (rd->hp_h->key_table_start + s) * ERASER_SECTOR_SCALE;
+		bio_add_page(bio, p, ERASER_SECTOR, 0);
+		submit_bio_wait(0, bio);
+		bio_put(bio);
+	}
+	ns_sync = ktime_get_ns() - t;
+	eraser_free_page(p, rd);
+	vfree(buf);
+
+	DMINFO("Metadata read of %llu sectors: batched %llu us (%llu MB/s), "
+			"per sector %llu us (%llu MB/s)", nr,
+			ns_batch / 1000, div64_u64(nr * ERASER_SECTOR * 1000, ns_batch ?: 1),
+			ns_sync / 1000, div64_u64(nr * ERASER_SECTOR * 1000, ns_sync ?: 1));
+}
+#endif
+
 // TODO improve these (see later note)
 static void holepunch_write_header(struct holepunch_dev *rd)
 {
@@ -540,51 +752,223 @@ static inline u8 *holepunch_pprf_sector_key(struct holepunch_dev *rd, u64 index)
 		.key;
 }
 
+/*
+ * Metadata loads, decrypted in parallel as they arrive.
+ */
+
+/* Lets a held load decrypt the chunks it has read and any still to come. */
+static void holepunch_load_release(struct holepunch_load *l)
+{
+	struct holepunch_load_chunk *c, *n;
+	unsigned long flags;
+	LIST_HEAD(chunks);
+
+	spin_lock_irqsave(&l->lock, flags);
+	l->held = 0;
+	list_splice_init(&l->deferred, &chunks);
+	spin_unlock_irqrestore(&l->lock, flags);
+
+	list_for_each_entry_safe(c, n, &chunks, list)
+		queue_work(system_unbound_wq, &c->work);
+}
+
+static void holepunch_load_put(struct holepunch_load *l)
+{
+	struct holepunch_load *next;
+	unsigned long flags;
+
+	if (!atomic_dec_and_test(&l->batch.pending))
+		return;
+	spin_lock_irqsave(&l->lock, flags);
+	l->done = 1;
+	next = l->next;
+	spin_unlock_irqrestore(&l->lock, flags);
+	/* Waiters may free l as soon as it is complete. */
+	complete_all(&l->batch.done);
+	if (next)
+		holepunch_load_release(next);
+}
+
+static void holepunch_load_work(struct work_struct *work)
+{
+	struct holepunch_load_chunk *c = container_of(work,
+			struct holepunch_load_chunk, work);
+	struct holepunch_load *l = c->load;
+	unsigned i;
+
+	for (i = 0; i < c->nr; ++i)
+		l->decrypt(l->rd, c->buf + i * ERASER_SECTOR, c->sector + i);
+	kfree(c);
+	holepunch_load_put(l);
+}
+
+static void holepunch_load_end_io(struct bio *bio)
+{
+	struct holepunch_load_chunk *c = bio->bi_private;
+	struct holepunch_load *l = c->load;
+	unsigned long flags;
+
+	if (bio->bi_error)
+		l->batch.error = bio->bi_error;
+	bio_put(bio);
+
+	spin_lock_irqsave(&l->lock, flags);
+	if (l->held) {
+		list_add_tail(&c->list, &l->deferred);
+		spin_unlock_irqrestore(&l->lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&l->lock, flags);
+	/* Unbound, so that chunks are decrypted on all CPUs and not just the
+	 * one taking the completion. */
+	queue_work(system_unbound_wq, &c->work);
+}
+
+/*
+ * Starts loading nr sectors at sector into buf; returns without waiting. With
+ * held set, nothing is decrypted until holepunch_load_release; with after
+ * set, nothing is decrypted until that load is done.
+ */
+static void holepunch_load_start(struct holepunch_dev *rd,
+		struct holepunch_load *l, u64 sector, void *buf, u64 nr,
+		void (*decrypt)(struct holepunch_dev *, void *, u64),
+		struct holepunch_load *after, int held)
+{
+	struct holepunch_load_chunk *c;
+	struct blk_plug plug;
+	unsigned long flags;
+	unsigned n;
+
+	l->rd = rd;
+	l->decrypt = decrypt;
+	l->buf = buf;
+	holepunch_meta_batch_init(&l->batch);
+	spin_lock_init(&l->lock);
+	l->held = held;
+	l->done = 0;
+	INIT_LIST_HEAD(&l->deferred);
+	l->next = NULL;
+	if (after) {
+		spin_lock_irqsave(&after->lock, flags);
+		if (!after->done) {
+			l->held = 1;
+			after->next = l;
+		}
+		spin_unlock_irqrestore(&after->lock, flags);
+	}
+
+	blk_start_plug(&plug);
+	while (nr) {
+		n = min_t(u64, nr, HP_LOAD_CHUNK);
+		c = kmalloc(sizeof(*c), GFP_KERNEL);
+		if (!c) {
+			DMERR("Cannot allocate metadata load chunk!");
+			l->batch.error = -ENOMEM;
+			break;
+		}
+		INIT_WORK(&c->work, holepunch_load_work);
+		c->load = l;
+		c->buf = buf;
+		c->sector = sector;
+		c->nr = n;
+		atomic_inc(&l->batch.pending);
+		__holepunch_meta_bio(rd, READ, sector, buf, n, holepunch_load_end_io, c);
+
+		sector += n;
+		buf += n * ERASER_SECTOR;
+		nr -= n;
+	}
+	blk_finish_plug(&plug);
+	holepunch_load_put(l);
+}
+
+/* Waits until the whole load is read and decrypted. May be called again. */
+static int holepunch_load_wait(struct holepunch_load *l)
+{
+	wait_for_completion(&l->batch.done);
+	return l->batch.error;
+}
+
+static void holepunch_load_fkt_top(struct holepunch_dev *rd, void *buf,
+		u64 sector)
+{
+	holepunch_cbc_sector_inplace(rd, buf, HOLEPUNCH_DECRYPT, rd->master_key,
+			sector);
+}
+
+static void holepunch_load_fkt_bottom(struct holepunch_dev *rd, void *buf,
+		u64 sector)
+{
+	holepunch_cbc_sector_inplace(rd, buf, HOLEPUNCH_DECRYPT,
+			holepunch_fkt_bottom_key(rd, sector - rd->hp_h->fkt_start
+				- rd->hp_h->fkt_top_width),
+			sector);
+}
+
+/* Keynodes do not fill sectors exactly, so they are copied out of the
+ * bounce buffer. */
+static void holepunch_load_pprf(struct holepunch_dev *rd, void *buf,
+		u64 sector)
+{
+	u64 s = sector - rd->hp_h->pprf_start;
+
+	holepunch_cbc_sector_inplace(rd, buf, HOLEPUNCH_DECRYPT,
+			holepunch_pprf_sector_key(rd, s), sector);
+	memcpy(rd->pprf_key + s * HP_PPRF_PER_SECTOR, buf,
+			sizeof(struct pprf_keynode) * HP_PPRF_PER_SECTOR);
+}
+
+/*
+ * rd->pprf_fkt must be allocated before calling this.
+ * Starts reading the whole FKT from disk. With held set, the top level is
+ * decrypted once the caller releases it (the master key is final); the bottom
+ * level once the top level is, since it holds the bottom level keys.
+ */
+static void holepunch_read_fkt_start(struct holepunch_dev *rd,
+		struct holepunch_load *top, struct holepunch_load *bottom,
+		int held)
+{
+	holepunch_load_start(rd, top, rd->hp_h->fkt_start, rd->pprf_fkt,
+			rd->hp_h->fkt_top_width, holepunch_load_fkt_top, NULL, held);
+	holepunch_load_start(rd, bottom, rd->hp_h->fkt_start + rd->hp_h->fkt_top_width,
+			rd->pprf_fkt + rd->hp_h->fkt_top_width,
+			rd->fkt_len - rd->hp_h->fkt_top_width, holepunch_load_fkt_bottom,
+			top, 0);
+}
+
+static void holepunch_read_fkt_finish(struct holepunch_dev *rd,
+		struct holepunch_load *top, struct holepunch_load *bottom)
+{
+	if (holepunch_load_wait(top) | holepunch_load_wait(bottom))
+		DMERR("FKT read failed!");
+}
+
 /* Assumes that the master key is in memory (from TPM or elsewhere)
  * rd->pprf_fkt must be allocated before calling this.
  * Reads+decrypts the FKT from disk.
  */
 static void holepunch_read_fkt(struct holepunch_dev *rd)
 {
-	void *data;
-	struct page *p;
-	u64 s;
+	struct holepunch_load top, bottom;
 
-	p = eraser_allocate_page(rd);
-	data = kmap(p);
 #ifdef HOLEPUNCH_DEBUG
 	dump_key(rd->master_key, "READING PPRF FKT WITH MASTER KEY:");
 #endif
-
-	for (s = 0; s != rd->hp_h->fkt_top_width; ++s)
-	{
-		eraser_read_sector(rd->hp_h->fkt_start + s, data, rd);
-		holepunch_cbc_sector(rd, rd->pprf_fkt + s, data, HOLEPUNCH_DECRYPT,
-				rd->master_key, rd->hp_h->fkt_start + s);
-		// eraser_free_sector(data, rd);
-	}
-	for (; s != rd->fkt_len; ++s)
-	{
-		eraser_read_sector(rd->hp_h->fkt_start + s, data, rd);
-		holepunch_cbc_sector(rd, rd->pprf_fkt + s, data, HOLEPUNCH_DECRYPT,
-				holepunch_fkt_bottom_key(rd, s - rd->hp_h->fkt_top_width),
-				rd->hp_h->fkt_start + s);
-		// eraser_free_sector(data, rd);
-	}
-
-	kunmap(p);
-	eraser_free_page(p, rd);
+	holepunch_read_fkt_start(rd, &top, &bottom, 0);
+	holepunch_read_fkt_finish(rd, &top, &bottom);
 }
 
-/* Assumes that the FKT is in memory
- * Will allocate rd->pprf_key if not already allocated
- * Reads+decrypts the PPRF key from disk. 
+/* Assumes that the top level FKT is in memory.
+ * Will allocate rd->pprf_key if not already allocated.
+ * Starts reading the PPRF key from disk into a bounce buffer; sectors are
+ * decrypted once the load after is done (the bottom level FKT, NULL if it is
+ * already in memory). Returns 1 if out of memory.
  */
-static int holepunch_read_pprf(struct holepunch_dev *rd)
+static int holepunch_read_pprf_start(struct holepunch_dev *rd,
+		struct holepunch_load *l, struct holepunch_load *after)
 {
 	void *data;
-	struct page *p;
-	u64 s;
+	u64 len;
 
 	if (!rd->pprf_key) {
 		rd->pprf_key_capacity = round_up(2 * holepunch_pprf_size_get(rd), HP_PPRF_PER_SECTOR);
@@ -594,22 +978,34 @@ static int holepunch_read_pprf(struct holepunch_dev *rd)
 			return 1;
 	}
 
-	p = eraser_allocate_page(rd);
-	data = kmap(p);
+	len = DIV_ROUND_UP(holepunch_pprf_size_get(rd), HP_PPRF_PER_SECTOR);
+	data = vmalloc(len * ERASER_SECTOR);
+	if (!data)
+		return 1;
+	holepunch_load_start(rd, l, rd->hp_h->pprf_start, data, len,
+			holepunch_load_pprf, after, 0);
+	return 0;
+}
 
-	for (s = 0; s < DIV_ROUND_UP(holepunch_pprf_size_get(rd), HP_PPRF_PER_SECTOR); ++s)
-	{
-		eraser_read_sector(rd->hp_h->pprf_start + s, data, rd);
-		holepunch_cbc_sector_inplace(rd, data, HOLEPUNCH_DECRYPT,
-				holepunch_pprf_sector_key(rd, s), rd->hp_h->pprf_start + s);
-		memcpy(rd->pprf_key + s * HP_PPRF_PER_SECTOR, data,
-				sizeof(struct pprf_keynode) * HP_PPRF_PER_SECTOR);
-		// eraser_free_sector(data, rd);
-	}
+static void holepunch_read_pprf_finish(struct holepunch_dev *rd,
+		struct holepunch_load *l)
+{
+	if (holepunch_load_wait(l))
+		DMERR("PPRF key read failed!");
+	vfree(l->buf);
+}
 
-	kunmap(p);
-	eraser_free_page(p, rd);
+/* Assumes that the FKT is in memory
+ * Will allocate rd->pprf_key if not already allocated
+ * Reads+decrypts the PPRF key from disk. 
+ */
+static int holepunch_read_pprf(struct holepunch_dev *rd)
+{
+	struct holepunch_load l;
 
+	if (holepunch_read_pprf_start(rd, &l, NULL))
+		return 1;
+	holepunch_read_pprf_finish(rd, &l);
 	return 0;
 }
 
@@ -628,64 +1024,185 @@ static int holepunch_evaluate_at_tag(struct holepunch_dev *rd, u64 tag, u8 *out,
 
 /* Prototypes of functions not directly involved in journaling */
 static void holepunch_tpm_set_master(struct holepunch_dev *rd, u8 *new_key);
-static void holepunch_do_master_rotation(struct holepunch_dev *rd, void *new_key);
+static int holepunch_flush_master_commit(struct holepunch_dev *rd);
 static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 		int ignore_magic);
 
 
-#ifdef HOLEPUNCH_JOURNAL
-/* Replay the journal. */
+/*
+ * Returns 1 and the newest master key in new_key if the master key record in
+ * the journal control block shows that the key in the TPM (rd->master_key at
+ * mount) is stale; 0 if the TPM already holds the newest key.
+ */
+static int holepunch_master_record_resolve(struct holepunch_dev *rd, void *ctl,
+		u8 *new_key)
+{
+	struct holepunch_master_record *rec = ctl + HPJ_MASTER_REC_OFFSET;
+	u8 hash[HP_HASH_LEN];
+	unsigned i;
+
+	if (rec->magic != HPJ_MASTER_REC_MAGIC)
+		return 0;
+
+	holepunch_hash(rd, rd->master_key, HOLEPUNCH_KEY_LEN, hash);
+	for (i = 0; i < HPJ_MASTER_REC_SLOTS; ++i) {
+		if (!memcmp(hash, rec->slots[i].hash, HP_HASH_LEN)) {
+			holepunch_ecb(rd, new_key, rec->slots[i].enc_key, HOLEPUNCH_KEY_LEN,
+					HOLEPUNCH_DECRYPT, rd->master_key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Perform the (post-journaling) steps necessary to rotate the master key, from
+ * the top level FKT blocks in the journal on disk. Both the journalled rotation
+ * and the offline rotate tool leave these behind, so this is needed whether or
+ * not HOLEPUNCH_JOURNAL is set.
+ */
+static void holepunch_recover_master_rotation(struct holepunch_dev *rd,
+		void *new_key)
+{
+	void *buf;
+
+	hp_dbg_incrstate_die(rd, "master rotation entry");
+
+	buf = vmalloc(rd->hp_h->fkt_top_width * ERASER_SECTOR);
+	if (!buf) {
+		DMERR("Cannot allocate master rotation buffer!");
+		return;
+	}
+	holepunch_meta_rw_sync(rd, READ, rd->hp_h->journal_start + 1, buf,
+			rd->hp_h->fkt_top_width);
+	holepunch_meta_rw_sync(rd, WRITE, rd->hp_h->fkt_start, buf,
+			rd->hp_h->fkt_top_width);
+	vfree(buf);
+	holepunch_tpm_set_master(rd, new_key);
+
+	hp_dbg_incrstate_die(rd, "master rotation exit");
+}
+
+/*
+ * Fill in the master key record for new_key, with one slot for every key the
+ * TPM could hold until new_key is acknowledged. Both builds keep it in the
+ * journal control block, written before anything depends on new_key.
+ */
+static void holepunch_master_record_fill(struct holepunch_dev *rd, u8 *new_key)
+{
+	struct holepunch_master_record *rec = &rd->master_rec;
+	u8 candidates[HPJ_MASTER_REC_SLOTS][HOLEPUNCH_KEY_LEN];
+	unsigned i, n;
+
+	n = 0;
+	spin_lock(&rd->master_commit_lock);
+	memcpy(candidates[n++], rd->tpm_master_key, HOLEPUNCH_KEY_LEN);
+	if (rd->master_commit_sent != rd->master_commit_done)
+		memcpy(candidates[n++], rd->new_master_key, HOLEPUNCH_KEY_LEN);
+	if (rd->master_commit_queued != rd->master_commit_sent)
+		memcpy(candidates[n++], rd->master_key, HOLEPUNCH_KEY_LEN);
+	spin_unlock(&rd->master_commit_lock);
+
+	memset(rec, 0, sizeof(*rec));
+	rec->magic = HPJ_MASTER_REC_MAGIC;
+	for (i = 0; i < n; ++i) {
+		holepunch_ecb(rd, rec->slots[i].enc_key, new_key, HOLEPUNCH_KEY_LEN,
+				HOLEPUNCH_ENCRYPT, candidates[i]);
+		holepunch_hash(rd, candidates[i], HOLEPUNCH_KEY_LEN, rec->slots[i].hash);
+	}
+	memset(candidates, 0, sizeof(candidates));
+}
 
+/* Writes the journal control block in buf, stamped with the master key
+ * record. rd->master_rec must have been loaded from disk first. */
 static inline void holepunch_journal_write_control(struct holepunch_dev *rd,
 	void* buf)
 {
 	hp_dbg_incrstate_die(rd, "write ctl jnl entry");
-	eraser_write_sector(rd->hp_h->journal_start, buf, rd);
+	memcpy(buf + HPJ_MASTER_REC_OFFSET, &rd->master_rec, sizeof(rd->master_rec));
+	holepunch_write_sector_fua(rd->hp_h->journal_start, buf, rd);
 	hp_dbg_incrstate_die(rd, "write ctl jnl exit");
 } 
 
-static void holepunch_journal_replay(struct holepunch_dev *rd)
+#ifdef HOLEPUNCH_JOURNAL
+
+/* Staged journal block for entry i. */
+static inline void *holepunch_journal_block(struct holepunch_dev *rd, int i)
 {
-	void *blk;
-	int i;
-	struct page *p;
+	return rd->journal_data + i * ERASER_SECTOR;
+}
 
-	p = eraser_allocate_page(rd);
-	blk = kmap(p);
+/*
+ * Write staged entries 1..n-1 to their addresses, as one plugged batch, then
+ * flush once. The addresses are mostly adjacent key table, FKT and PPRF
+ * sectors, which the block layer merges.
+ */
+static void holepunch_journal_apply(struct holepunch_dev *rd, int n)
+{
+	struct holepunch_meta_batch batch;
+	struct blk_plug plug;
+	int i;
 
-	for (i = 1; i < HP_JOURNAL_LEN; ++i)
+	holepunch_meta_batch_init(&batch);
+	blk_start_plug(&plug);
+	for (i = 1; i < n; ++i)
 	{
-		if (rd->journal[i] == rd->hp_h->journal_start)
-			break;
 		hp_dbg_incrstate_die(rd, "replay loop");
-
-		// TODO doing this all sequentially seems very inefficient
 	#ifdef HOLEPUNCH_DEBUG
 		KWORKERMSG("JOURNAL REPLAY: %llu -> %llu\n", 
 				rd->hp_h->journal_start + i, rd->journal[i]);
 	#endif
-		eraser_read_sector(rd->hp_h->journal_start + i, blk, rd);
-		eraser_write_sector(rd->journal[i], blk, rd);
+		holepunch_meta_rw(rd, &batch, WRITE, rd->journal[i],
+				holepunch_journal_block(rd, i), 1);
 	}
+	blk_finish_plug(&plug);
+	if (holepunch_meta_batch_wait(&batch))
+		DMERR("Journal replay failed!");
+	/* One flush for the lot, before the journal may be cleared. */
+	if (blkdev_issue_flush(rd->real_dev->bdev, GFP_KERNEL, NULL))
+		DMERR("Journal replay flush failed!");
+}
 
-	kunmap(p);
-	eraser_free_page(p, rd);
+/* Replay the journal found on disk. */
+static void holepunch_journal_replay(struct holepunch_dev *rd)
+{
+	int n;
+
+	for (n = 1; n < HP_JOURNAL_LEN; ++n)
+	{
+		if (rd->journal[n] == rd->hp_h->journal_start)
+			break;
+	}
+	holepunch_meta_rw_sync(rd, READ, rd->hp_h->journal_start + 1,
+			holepunch_journal_block(rd, 1), n - 1);
+	holepunch_journal_apply(rd, n);
 }
 
-/* Commit the current journal transaction. */
+/*
+ * Commit the current journal transaction: the staged blocks go to the journal
+ * in one write, then the control block, then the blocks to their addresses.
+ */
 static void holepunch_journal_commit(struct holepunch_dev *rd)
 {
+	int n;
+
 	if (!rd->journal)
 		return;
-	if (rd->journal_entry < HP_JOURNAL_LEN)
-		rd->journal[rd->journal_entry] = rd->hp_h->journal_start;
+	n = rd->journal_entry;
+	if (n < HP_JOURNAL_LEN)
+		rd->journal[n] = rd->hp_h->journal_start;
 	hp_dbg_incrstate_die(rd, "jnl commit entry");
 
-
+	holepunch_meta_rw_sync(rd, WRITE, rd->hp_h->journal_start + 1,
+			holepunch_journal_block(rd, 1), n - 1);
+	/* FUA only covers the control block; the blocks it marks valid must
+	 * be on media first. */
+	if (blkdev_issue_flush(rd->real_dev->bdev, GFP_KERNEL, NULL))
+		DMERR("Journal flush failed!");
 	holepunch_journal_write_control(rd, rd->journal);
 
 	/* journal entry committed - now actually perform the transaction */
-	holepunch_journal_replay(rd);
+	holepunch_journal_apply(rd, n);
 	rd->journal[0] = HPJ_NONE;
 	holepunch_journal_write_control(rd, rd->journal);
 
@@ -698,10 +1215,11 @@ static void holepunch_journal_commit(struct holepunch_dev *rd)
 
 
 /*
- * Queue a write for the current journal transaction (making one if necessary);
- * overwrites previous writes to the same location. If the journal is full,
- * commits and starts over; if this behavior isn't desired, use
- * rd->journal_entry and holepunch_journal_commit manually.
+ * Stage a write for the current journal transaction (making one if necessary);
+ * overwrites previous writes to the same location. Nothing reaches the disk
+ * until the commit. If the journal is full, commits and starts over; if this
+ * behavior isn't desired, use rd->journal_entry and holepunch_journal_commit
+ * manually.
  */
 static void holepunch_journal_write(struct holepunch_dev *rd, u64 addr, void *data,
 		unsigned hpj_ty)
@@ -727,44 +1245,61 @@ static void holepunch_journal_write(struct holepunch_dev *rd, u64 addr, void *da
 			break;
 	}
 	rd->journal[i] = addr;
-	eraser_write_sector(rd->hp_h->journal_start + i, data, rd);
-	rd->journal_entry++;
+	memcpy(holepunch_journal_block(rd, i), data, ERASER_SECTOR);
+	if (i == rd->journal_entry)
+		rd->journal_entry++;
 	hp_dbg_incrstate_die(rd, "jnl write exit");
 
 }
 
+/* Copy the new top level FKT from the staged blocks to its place, then hand
+ * the new key to the TPM. */
+static void holepunch_master_rotation_apply(struct holepunch_dev *rd,
+		void *new_key)
+{
+	hp_dbg_incrstate_die(rd, "master rotation transfer fkt top");
+	holepunch_meta_rw_sync(rd, WRITE, rd->hp_h->fkt_start,
+			rd->master_rot_data, rd->hp_h->fkt_top_width);
+	holepunch_tpm_set_master(rd, new_key);
+}
 
-/* Journal, then complete, a master key rotation. */
+/*
+ * Journal, then complete, a master key rotation. The FKT top is staged in its
+ * own buffer, since a transaction may be open with blocks in journal_data; it
+ * still goes through the on-disk journal, which that transaction only writes
+ * when it commits.
+ */
 static void holepunch_rotate_master(struct holepunch_dev *rd)
 {
-	struct page *p1, *p2;
-	void *ctl, *blk;
+	struct page *p;
+	void *ctl;
 	u64 i;
 	u8 new_key[HOLEPUNCH_KEY_LEN];
 
 	kernel_random(new_key, HOLEPUNCH_KEY_LEN);
-	p1 = eraser_allocate_page(rd);
-	p2 = eraser_allocate_page(rd);
-	ctl = kmap(p1);
-	blk = kmap(p2);
+	p = eraser_allocate_page(rd);
+	ctl = kmap(p);
 	
 	hp_dbg_incrstate_die(rd, "rotate master jnl entry");
 #ifdef HOLEPUNCH_DEBUG
 	dump_key(new_key, "WRITING (journal) PPRF FKT WITH NEW MASTER KEY:");
 #endif
 	*(u64 *)ctl = HPJ_MASTER_ROT;
-	holepunch_ecb(rd, ctl + 8, new_key, HOLEPUNCH_KEY_LEN, HOLEPUNCH_ENCRYPT, rd->master_key);
-	holepunch_hash(rd, rd->master_key, HOLEPUNCH_KEY_LEN, ctl + 8 + HOLEPUNCH_KEY_LEN);
+	holepunch_master_record_fill(rd, new_key);
 	for (i = 0; i < rd->hp_h->fkt_top_width; ++i)
 	{
 		hp_dbg_incrstate_die(rd, "rotate master jnl fkt top");
 
-		holepunch_cbc_sector(rd, blk, rd->pprf_fkt + i, HOLEPUNCH_ENCRYPT, new_key,
+		holepunch_cbc_sector(rd, rd->master_rot_data + i * ERASER_SECTOR,
+				rd->pprf_fkt + i, HOLEPUNCH_ENCRYPT, new_key,
 				rd->hp_h->fkt_start + i);
-		eraser_write_sector(rd->hp_h->journal_start + i + 1, blk, rd);
 	}
+	holepunch_meta_rw_sync(rd, WRITE, rd->hp_h->journal_start + 1,
+			rd->master_rot_data, rd->hp_h->fkt_top_width);
+	if (blkdev_issue_flush(rd->real_dev->bdev, GFP_KERNEL, NULL))
+		DMERR("Journal flush failed!");
 	holepunch_journal_write_control(rd, ctl);
-	holepunch_do_master_rotation(rd, new_key);
+	holepunch_master_rotation_apply(rd, new_key);
 #ifdef HOLEPUNCH_DEBUG
 	dump_key(rd->master_key, "\nRotated Master key\n");
 #endif
@@ -772,44 +1307,11 @@ static void holepunch_rotate_master(struct holepunch_dev *rd)
 	holepunch_journal_write_control(rd, ctl);
 
 
-	kunmap(p1);
-	kunmap(p2);
-	eraser_free_page(p1, rd);
-	eraser_free_page(p2, rd);
-
-	hp_dbg_incrstate_die(rd, "rotate master jnl exit");
-
-}
-
-/* Perform the (post-journaling) steps necessary to rotate the master key. */
-static void holepunch_do_master_rotation(struct holepunch_dev *rd, void *new_key)
-{
-	u64 i;
-	void *blk;
-	struct page *p;
-
-	p = eraser_allocate_page(rd);
-	blk = kmap(p);
-	
-	hp_dbg_incrstate_die(rd, "master rotation entry");
-
-
-	for (i = 0; i < rd->hp_h->fkt_top_width; ++i)
-	{
-		// TODO again, this feels a little silly to allocate and free for each
-		// block, and also to wait for each bio individually
-		hp_dbg_incrstate_die(rd, "master rotation transfer fkt top");
-
-		eraser_read_sector(rd->hp_h->journal_start + i + 1, blk, rd);
-		eraser_write_sector(rd->hp_h->fkt_start, blk, rd);
-		// eraser_free_sector(blk, rd);
-	}
-	holepunch_tpm_set_master(rd, new_key);
-
 	kunmap(p);
 	eraser_free_page(p, rd);
 
-	hp_dbg_incrstate_die(rd, "master rotation exit");
+	hp_dbg_incrstate_die(rd, "rotate master jnl exit");
+
 }
 
 /* Journal, then complete, a pprf key rotation. 
@@ -848,8 +1350,41 @@ static void holepunch_rotate_pprf(struct holepunch_dev *rd)
 
 #else
 /* Journaling disabled 
+ * Puncture writes are still staged: they go out asynchronously as they are
+ * made, and holepunch_journal_commit waits for all of them. The PPRF write
+ * lock serializes the stage.
  */
 
+/* Queue an async write of a copy of data. */
+static void holepunch_meta_stage(struct holepunch_dev *rd, u64 sector, void *data)
+{
+	struct page *p;
+	void *buf;
+
+	p = eraser_allocate_page(rd);
+	buf = kmap(p);
+	memcpy(buf, data, ERASER_SECTOR);
+	list_add(&p->lru, &rd->meta_stage_pages);
+	holepunch_meta_rw(rd, &rd->meta_stage, WRITE, sector, buf, 1);
+	kunmap(p);
+}
+
+static void holepunch_meta_stage_wait(struct holepunch_dev *rd)
+{
+	struct page *p;
+
+	if (list_empty(&rd->meta_stage_pages))
+		return;
+	if (holepunch_meta_batch_wait(&rd->meta_stage))
+		DMERR("Metadata write failed!");
+	while (!list_empty(&rd->meta_stage_pages)) {
+		p = list_first_entry(&rd->meta_stage_pages, struct page, lru);
+		list_del(&p->lru);
+		eraser_free_page(p, rd);
+	}
+	holepunch_meta_batch_init(&rd->meta_stage);
+}
+
 static void holepunch_journal_replay(struct holepunch_dev *rd)
 {
 	return;
@@ -857,7 +1392,7 @@ static void holepunch_journal_replay(struct holepunch_dev *rd)
 
 static void holepunch_journal_commit(struct holepunch_dev *rd)
 {
-	return;
+	holepunch_meta_stage_wait(rd);
 }
 
 static void holepunch_journal_write(struct holepunch_dev *rd, u64 addr, void *data,
@@ -867,22 +1402,46 @@ static void holepunch_journal_write(struct holepunch_dev *rd, u64 addr, void *da
 }
 
 static void holepunch_do_master_rotation(struct holepunch_dev *rd, void *new_key) {
+	struct holepunch_meta_batch batch;
 	struct page *p;
 	void *buf;
+	LIST_HEAD(pages);
 	int i;
 
+	/* The FKT is about to depend on new_key, which only reaches the TPM in
+	 * the background: record it first, so that mount can still recover it
+	 * after a crash in between. */
+	holepunch_master_record_fill(rd, new_key);
 	p = eraser_allocate_page(rd);
 	buf = kmap(p);
-	
+	memset(buf, 0, ERASER_SECTOR);
+	*(u64 *)buf = HPJ_NONE;
+	holepunch_journal_write_control(rd, buf);
+	kunmap(p);
+	eraser_free_page(p, rd);
+
+	holepunch_meta_batch_init(&batch);
 	for (i = 0; i < rd->hp_h->fkt_top_width; ++i) {
+		p = eraser_allocate_page(rd);
+		buf = kmap(p);
 		holepunch_cbc_sector(rd, buf, rd->pprf_fkt + i, HOLEPUNCH_ENCRYPT, new_key,
 				rd->hp_h->fkt_start + i);
-		eraser_write_sector(rd->hp_h->fkt_start + i, buf, rd);
+		list_add(&p->lru, &pages);
+		holepunch_meta_rw(rd, &batch, WRITE, rd->hp_h->fkt_start + i, buf, 1);
+		kunmap(p);
 	}
+	if (holepunch_meta_batch_wait(&batch))
+		DMERR("FKT write failed!");
+	/* The TPM must never hold a key the FKT on disk does not match. */
+	if (blkdev_issue_flush(rd->real_dev->bdev, GFP_KERNEL, NULL))
+		DMERR("FKT flush failed!");
 	holepunch_tpm_set_master(rd, new_key);
 
-	kunmap(p);
-	eraser_free_page(p, rd);
+	while (!list_empty(&pages)) {
+		p = list_first_entry(&pages, struct page, lru);
+		list_del(&p->lru);
+		eraser_free_page(p, rd);
+	}
 }
 
 static void holepunch_rotate_master(struct holepunch_dev *rd)
@@ -903,13 +1462,20 @@ static void holepunch_rotate_pprf(struct holepunch_dev *rd)
 #endif
 
 static inline void eraser_drop_map_cache(struct holepunch_dev *rd, struct eraser_map_cache *c);
+static void holepunch_put_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c);
 static void eraser_force_evict_map_cache(struct holepunch_dev *rd, int puncture);
+static struct kretprobe eraser_unlink_kretprobe;
 static struct eraser_map_cache *holepunch_find_cache_entry(struct holepunch_dev *rd,
-		u64 sector, u64 bucket);
-static struct eraser_map_cache *holepunch_read_cache_entry(struct holepunch_dev *rd,
-		u64 sector, int ignore_magic);
+		u64 sector);
+static void holepunch_read_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, int ignore_magic);
 static struct eraser_map_cache *holepunch_get_cache_entry(struct holepunch_dev *rd,
-		u64 ino, struct semaphore **cache_lock, int ignore_magic);
+		u64 ino, int ignore_magic);
+static struct eraser_map_cache *holepunch_block_cache_sector(struct holepunch_dev *rd,
+		u64 sector, struct holepunch_filekey_sector *plain, int *cached);
+static void holepunch_unblock_cache_sector(struct holepunch_dev *rd,
+		struct eraser_map_cache *pending);
 
 // static void holepunch_read_fksector_new_key(struct holepunch_dev *rd,
 // 		u64 sector, struct holepunch_filekey_sector* buf)
@@ -923,18 +1489,45 @@ static struct eraser_map_cache *holepunch_get_cache_entry(struct holepunch_dev *
 // }
 
 
+/*
+ * Waits for a window of key table writes from a PPRF rotation, then lets the
+ * cache read those sectors again, and starts the next window.
+ */
+static void holepunch_rotation_window_flush(struct holepunch_dev *rd,
+		struct holepunch_meta_batch *batch, struct blk_plug *plug,
+		struct page **pages, struct eraser_map_cache **pending, unsigned n)
+{
+	unsigned i;
+
+	blk_finish_plug(plug);
+	if (holepunch_meta_batch_wait(batch))
+		DMERR("Key table write failed!");
+	for (i = 0; i < n; ++i) {
+		kunmap(pages[i]);
+		holepunch_unblock_cache_sector(rd, pending[i]);
+	}
+	holepunch_meta_batch_init(batch);
+	blk_start_plug(plug);
+}
+
 /* Perform the (post-journaling) steps necessary to rotate the pprf key. 
- * new_key is initialized outside. */
+ * new_key is initialized outside. With ignore_magic set (initialization), the
+ * key table is generated from scratch rather than read back from disk. */
 static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 		int ignore_magic)
 {
 	// TODO this could be more efficient with memoization, since it's all sequential
 	// struct pprf_keynode new;
-	struct page *p, *cp;
-	u64 s, sno, bucket;
+	struct page *p;
+	u64 s, sno;
 	struct holepunch_filekey_sector *cipher, *plain;
-	struct eraser_map_cache *entry;
-	struct semaphore *other_cache_lock;
+	struct eraser_map_cache *pending;
+	struct page *window[HP_ROTATE_WINDOW];
+	struct eraser_map_cache *window_pending[HP_ROTATE_WINDOW];
+	struct holepunch_meta_batch batch;
+	struct blk_plug plug;
+	unsigned i, n;
+	int cached;
 	u8 key[HOLEPUNCH_KEY_LEN];
 	unsigned phase_two_flag;
 
@@ -942,9 +1535,7 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 	hp_dbg_incrstate_die(rd, "do pprf rotate: entry");
 
 	p = eraser_allocate_page(rd);
-	cp = eraser_allocate_page(rd);
 	plain = kmap(p);
-	cipher = kmap(cp);
 	rd->pprf_key_new.type = PPRF_KEYLEAF;
 	memcpy(rd->pprf_key_new.v.key, new_key, HOLEPUNCH_KEY_LEN);
 #ifdef HOLEPUNCH_DEBUG
@@ -966,15 +1557,16 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 		if (s % 500 == 0)
 			hp_dbg_incrstate_die(rd, "do pprf rotate: checking magic correct");
 
-		bucket = sno % ERASER_MAP_CACHE_BUCKETS;
-		other_cache_lock = &rd->cache_lock[bucket];
-		HP_DOWN(other_cache_lock, "Bucket %llu check in cache", bucket);
-		entry = holepunch_find_cache_entry(rd, sno, bucket);
+		pending = holepunch_block_cache_sector(rd, sno, plain, &cached);
 
 		/* If the sector is in cache, then it has not been rotated yet */
-		if (entry) {
-			memcpy(plain, entry->map, ERASER_SECTOR);
-			eraser_drop_map_cache(rd, entry);
+		if (cached)
+			break;
+
+		/* A freshly created table holds no keys yet, so there is nothing
+		 * on disk worth reading: generate the keys here instead. */
+		if (unlikely(ignore_magic)) {
+			kernel_random((u8 *) plain, ERASER_SECTOR);
 			break;
 		}
 
@@ -982,8 +1574,7 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 		eraser_read_sector(s, plain, rd);
 		holepunch_evaluate_at_tag(rd, plain->tag, key, &rd->pprf_key_new);
 		holepunch_cbc_filekey_sector(rd, plain, plain, HOLEPUNCH_DECRYPT, key, s);
-		if (unlikely(ignore_magic ||
-				plain->magic1 != HP_MAGIC1 || plain->magic2 != HP_MAGIC2)) {
+		if (unlikely(plain->magic1 != HP_MAGIC1 || plain->magic2 != HP_MAGIC2)) {
 #ifdef HOLEPUNCH_DEBUG
 			KWORKERMSG("Incorrect magic.\n");
 #endif
@@ -995,28 +1586,42 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 			break;
 		}
 
-		HP_UP(other_cache_lock, "REFRESH: Bucket %llu drop entry", bucket);
+		holepunch_unblock_cache_sector(rd, pending);
 	}
 	/* Then switch to: decrypt with old key, encrypt and writeback with new key. 
-	 * *entry* should be pointing to a cache entry already */
+	 * plain already holds the first sector, which is kept out of the cache.
+	 * Writes go out a window at a time; their sectors stay out of the cache
+	 * until the window is on disk. */
 	// KWORKERMSG("MID OF ROTATION Cached: %llu", rd->map_cache_count);
+	for (i = 0; i < HP_ROTATE_WINDOW; ++i)
+		window[i] = eraser_allocate_page(rd);
+	holepunch_meta_batch_init(&batch);
+	blk_start_plug(&plug);
+	n = 0;
 	phase_two_flag = 0;
 	for (; s != rd->hp_h->fkt_start; ++s)
 	{	
 		if (likely(phase_two_flag)) {
 			sno = s - rd->hp_h->key_table_start;
-			bucket = sno % ERASER_MAP_CACHE_BUCKETS;
-			other_cache_lock = &rd->cache_lock[bucket];
-			HP_DOWN(other_cache_lock, "Bucket %llu check in cache", bucket);
-			entry = holepunch_find_cache_entry(rd, sno, bucket);
-			if (entry) {
-				memcpy(plain, entry->map, ERASER_SECTOR);
-				eraser_drop_map_cache(rd, entry);
+			pending = holepunch_block_cache_sector(rd, sno, plain, &cached);
+			if (cached) {
+				/* Cached, so not rotated yet. */
+			}
+			else if (unlikely(ignore_magic)) {
+				kernel_random((u8 *) plain, ERASER_SECTOR);
 			}
 			else {
 				eraser_read_sector(s, plain, rd);
 				holepunch_evaluate_at_tag(rd, plain->tag, key, rd->pprf_key);
 				holepunch_cbc_filekey_sector(rd, plain, plain, HOLEPUNCH_DECRYPT, key, s);
+				/* The offline rotate tool writes many sectors at once, so a
+				 * crash can leave rotated sectors past the first unrotated
+				 * one. */
+				if (unlikely(plain->magic1 != HP_MAGIC1 || plain->magic2 != HP_MAGIC2)) {
+					holepunch_cbc_filekey_sector(rd, plain, plain, HOLEPUNCH_ENCRYPT, key, s);
+					holepunch_evaluate_at_tag(rd, plain->tag, key, &rd->pprf_key_new);
+					holepunch_cbc_filekey_sector(rd, plain, plain, HOLEPUNCH_DECRYPT, key, s);
+				}
 			}
 		}
 		else
@@ -1040,27 +1645,36 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 		}
 
 		holepunch_evaluate_at_tag(rd, plain->tag, key, &rd->pprf_key_new);
+		cipher = kmap(window[n]);
 		holepunch_cbc_filekey_sector(rd, cipher, plain, HOLEPUNCH_ENCRYPT, key, s);
-		eraser_write_sector(s, cipher, rd);
-
-		HP_UP(other_cache_lock, "REFRESH: Bucket %llu refreshed", bucket);
-		
+		holepunch_meta_rw(rd, &batch, WRITE, s, cipher, 1);
+		if (rd->key_table)
+			memcpy(rd->key_table + sno, plain, ERASER_SECTOR);
+
+		window_pending[n++] = pending;
+		if (n == HP_ROTATE_WINDOW) {
+			holepunch_rotation_window_flush(rd, &batch, &plug, window,
+					window_pending, n);
+			n = 0;
+		}
 	}
+	holepunch_rotation_window_flush(rd, &batch, &plug, window, window_pending, n);
+	blk_finish_plug(&plug);
+	for (i = 0; i < HP_ROTATE_WINDOW; ++i)
+		eraser_free_page(window[i], rd);
 #ifdef HOLEPUNCH_DEBUG
-	down_read(&rd->map_cache_count_sem);
-	KWORKERMSG("\n(Cached: %llu)\n",
-		rd->map_cache_count);
-		up_read(&rd->map_cache_count_sem);
+	KWORKERMSG("\n(Cached: %lld)\n",
+		percpu_counter_sum(&rd->map_cache_count));
 	DMINFO("Done with key transition, moving to FKT.");
 #endif
 	
-	/* Setup AES-CTR instance, then reset FKT. */
+	/* Setup AES-CTR instance, then reset FKT: fill it with random data, write
+	 * the whole FKT at once, then decrypt it back in place. */
 	kernel_random(key, HOLEPUNCH_KEY_LEN);
 	crypto_blkcipher_setkey(rd->ctr_tfm, key, HOLEPUNCH_KEY_LEN);
-	/* The top level FKT */
-	for (s = 0; s != rd->hp_h->fkt_top_width; ++s)
+	for (s = 0; s != rd->fkt_len; ++s)
 	{
-		hp_dbg_incrstate_die(rd, "do rotate pprf: write top fkt");
+		hp_dbg_incrstate_die(rd, "do rotate pprf: reset fkt");
 
 		__holepunch_blkcipher(rd->pprf_fkt + s, rd->pprf_fkt + s, ERASER_SECTOR,
 				HOLEPUNCH_ENCRYPT, rd->ctr_tfm);
@@ -1073,8 +1687,14 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 			holepunch_cbc_sector_inplace(rd, rd->pprf_fkt + s, HOLEPUNCH_ENCRYPT,
 					rd->master_key, rd->hp_h->fkt_start + s);
 		}
-		memcpy(cipher, rd->pprf_fkt+s, ERASER_SECTOR);
-		eraser_write_sector(rd->hp_h->fkt_start + s, cipher, rd);
+	}
+	hp_dbg_incrstate_die(rd, "do rotate pprf: write fkt");
+	holepunch_meta_rw_sync(rd, WRITE, rd->hp_h->fkt_start, rd->pprf_fkt,
+			rd->fkt_len);
+
+	/* The top level FKT */
+	for (s = 0; s != rd->hp_h->fkt_top_width; ++s)
+	{
 		holepunch_cbc_sector_inplace(rd, rd->pprf_fkt + s, HOLEPUNCH_DECRYPT,
 				rd->master_key, rd->hp_h->fkt_start + s);
 	}
@@ -1085,12 +1705,6 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 #endif
 	for (; s != rd->fkt_len; ++s)
 	{
-		hp_dbg_incrstate_die(rd, "do rotate pprf: write bot fkt");
-
-		__holepunch_blkcipher(rd->pprf_fkt + s, rd->pprf_fkt + s, ERASER_SECTOR,
-				HOLEPUNCH_ENCRYPT, rd->ctr_tfm);
-		memcpy(cipher, rd->pprf_fkt+s, ERASER_SECTOR);
-		eraser_write_sector(rd->hp_h->fkt_start + s, cipher, rd);
 		holepunch_cbc_sector_inplace(rd, rd->pprf_fkt + s, HOLEPUNCH_DECRYPT,
 				holepunch_fkt_bottom_key(rd, s - rd->hp_h->fkt_top_width),
 				rd->hp_h->fkt_start + s);
@@ -1105,9 +1719,7 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
 	eraser_write_sector(rd->hp_h->pprf_start, plain, rd);
 
 	kunmap(p);
-	kunmap(cp);
 	eraser_free_page(p, rd);
-	eraser_free_page(cp, rd);
 
 	hp_dbg_incrstate_die(rd, "do rotate pprf: exit");
 
@@ -1118,334 +1730,1738 @@ static void holepunch_do_pprf_rotation(struct holepunch_dev *rd, u8 *new_key,
  * Cache management.
  */
 
-/* Drop a cache entry. Bucket lock must be held. */
-static inline void eraser_drop_map_cache(struct holepunch_dev *rd, struct eraser_map_cache *c)
+/* Whether map is part of the pinned key table, and not a page of its own. */
+static inline int holepunch_map_pinned(struct holepunch_dev *rd,
+		struct holepunch_filekey_sector *map)
 {
-	list_del(&c->list);
-	eraser_free_sector(c->map, rd);
-	eraser_free_map_cache(c, rd);
-	down_write(&rd->map_cache_count_sem);
-	rd->map_cache_count -= 1;
-	up_write(&rd->map_cache_count_sem);
+	return rd->key_table && map >= rd->key_table
+			&& map < rd->key_table + rd->key_table_len;
 }
 
-static void holepunch_persist_unlink(struct holepunch_dev *rd,
-		struct eraser_map_cache *c, struct semaphore *cache_lock);
-
 /*
- * Drops all cache entries, writing them back to disk if dirty. Takes each
- * bucket lock in turn, in addition to the PPRF lock (read or write depending
- * on puncture).
+ * Drops a reference to a cache entry. The last one frees it; the entry itself
+ * only goes once RCU lookups that may still see it are done.
  */
-static void eraser_force_evict_map_cache(struct holepunch_dev *rd, int puncture)
+static void holepunch_put_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
 {
-	struct eraser_map_cache *c;
-	struct eraser_map_cache *n;
-	int i;
-	u8 key[HOLEPUNCH_KEY_LEN];
-#ifdef HOLEPUNCH_DEBUG
-	KWORKERMSG("Force eviction");
-#endif 
-	for (i = 0; i < ERASER_MAP_CACHE_BUCKETS; ++i)
-	{
-		down(&rd->cache_lock[i]);
-		list_for_each_entry_safe(c, n, &rd->map_cache_list[i], list)
-		{
-			if (c->status & ERASER_CACHE_DIRTY)
-			{
-				if (puncture) {
-					holepunch_persist_unlink(rd, c, &rd->cache_lock[i]);
-				}
-				else {
-					HP_DOWN_READ(&rd->pprf_sem, "evict cache");
-					holepunch_evaluate_at_tag(rd, *(u64 *)c->map, key,
-							rd->pprf_key);
-					HP_UP_READ(&rd->pprf_sem, "evict cache");
-					holepunch_cbc_filekey_sector(rd, c->map, c->map,
-							HOLEPUNCH_ENCRYPT, key, c->sector);
-					eraser_write_sector(c->sector, c->map, rd);
-				}
-			}
-			eraser_drop_map_cache(rd, c);
-		}
-		up(&rd->cache_lock[i]);
+	if (!atomic_dec_and_test(&c->refs))
+		return;
+	spin_lock(&rd->map_cache_lock);
+	list_del(&c->list);
+	spin_unlock(&rd->map_cache_lock);
+	if (c->map && !holepunch_map_pinned(rd, c->map)) {
+		percpu_counter_dec(&rd->map_cache_count);
+		eraser_free_sector(c->map, rd);
 	}
-	holepunch_journal_commit(rd);
+	call_rcu(&c->rcu, eraser_free_map_cache_rcu);
 }
 
-
-static struct eraser_map_cache *holepunch_find_cache_entry(struct holepunch_dev *rd,
-		u64 sector, u64 bucket) 
+/*
+ * Puts a newly loaded entry on a replacement queue: on Am if it is a ghost,
+ * else on A1in. Cache list lock must be held.
+ */
+static void holepunch_cache_admit(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
 {
-	struct eraser_map_cache *c;
-	list_for_each_entry(c, &rd->map_cache_list[bucket], list) {
-		if (c->sector == sector) {
-			c->last_access = jiffies;
-			return c;
+	struct holepunch_cache_ghost *g;
+
+	hash_for_each_possible(rd->map_cache_ghost_hash, g, hash, c->sector) {
+		if (g->sector == c->sector) {
+			hash_del(&g->hash);
+			c->queue = HP_CACHE_AM;
+			list_add(&c->lru, &rd->map_cache_am);
+			++rd->stats_cache_ghost_hit;
+			return;
 		}
 	}
-	return NULL;
+	c->queue = HP_CACHE_A1IN;
+	list_add(&c->lru, &rd->map_cache_a1in);
+	++rd->map_cache_a1in_len;
 }
 
-
-static struct eraser_map_cache *holepunch_read_cache_entry(struct holepunch_dev *rd,
-		u64 sector, int ignore_magic)
+/*
+ * Takes an entry off its replacement queue. Entries leaving A1in become
+ * ghosts, replacing the oldest one. Cache list lock must be held.
+ */
+static void holepunch_cache_forget(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
 {
-	struct eraser_map_cache *c;
-	u8 key[HOLEPUNCH_KEY_LEN];
-
-	c = eraser_allocate_map_cache(rd);
-	c->map = eraser_read_sector(rd->hp_h->key_table_start + sector, NULL, rd);
-	HP_DOWN_READ(&rd->pprf_sem, "PPRF: read sector");
-	holepunch_evaluate_at_tag(rd, c->map->tag, key, rd->pprf_key);
-	HP_UP_READ(&rd->pprf_sem, "PPRF: read sector");
-	holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_DECRYPT, key,
-			rd->hp_h->key_table_start + sector);
+	struct holepunch_cache_ghost *g;
 
-	if (likely(ignore_magic))
-		return c;
-	/* This should only happen during a key refresh - if we are reading a 
-	 * sector that has already been refreshed using the old key, the magic 
-	 * will be wrong. So encrypt and re-decrypt using the new key.
-	 * Locking not necessary because the new key will not be punctured at this
-	 * stage.
-	 */
-	if (unlikely(c->map->magic1 != HP_MAGIC1 || c->map->magic2 != HP_MAGIC2)) {
-#ifdef HOLEPUNCH_DEBUG
-		KWORKERMSG("Read sector %llu that has already been refreshed!", sector);
-#endif
-		holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_ENCRYPT, key,
-				rd->hp_h->key_table_start + sector);
-		holepunch_evaluate_at_tag(rd, c->map->tag, key, &rd->pprf_key_new);
-		holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_DECRYPT, key,
-				rd->hp_h->key_table_start + sector);
+	if (!list_empty(&c->dirty)) {
+		list_del_init(&c->dirty);
+		--rd->map_cache_dirty_len;
 	}
-
-	return c;
-
+	if (list_empty(&c->lru))
+		return;
+	list_del_init(&c->lru);
+	if (c->queue != HP_CACHE_A1IN)
+		return;
+	--rd->map_cache_a1in_len;
+	g = &rd->map_cache_ghost[rd->map_cache_ghost_next++ % HP_CACHE_GHOSTS];
+	if (!hlist_unhashed(&g->hash))
+		hash_del(&g->hash);
+	g->sector = c->sector;
+	hash_add(rd->map_cache_ghost_hash, &g->hash, c->sector);
 }
 
+/* Wakes the writeback thread. */
+static inline void holepunch_cache_kick(struct holepunch_dev *rd)
+{
+	if (!test_and_set_bit(0, &rd->cache_kick))
+		wake_up(&rd->cache_wait);
+}
 
 /*
- * Searches the cache for the entry containing the key for this inode; if not
- * found, reads the sector from disk and caches it. Passes the relevant bucket
- * lock to the caller.
+ * Files an entry by its status: on the dirty list, in the order it got there,
+ * while it holds keys not on disk; back at the head of its replacement queue
+ * once it is clean. Wakes the writeback thread when the first entry gets
+ * dirty, so it can time the writeback, and when too many are. Entry lock must
+ * be held.
  */
-
-static struct eraser_map_cache *holepunch_get_cache_entry(struct holepunch_dev *rd,
-		u64 ino, struct semaphore **cache_lock, int ignore_magic)
+static void holepunch_cache_refile(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
 {
-	struct eraser_map_cache *c;
-	u64 sector, bucket;
-	sector = ino / HP_KEY_PER_SECTOR;
-	bucket = sector % ERASER_MAP_CACHE_BUCKETS;
-
-	*cache_lock = &rd->cache_lock[bucket];
-	HP_DOWN(*cache_lock, "Bucket %llu get entry", bucket);
-
-	/* Look first */
-	c = holepunch_find_cache_entry(rd, sector, bucket);
-	if (c)
-		return c;
-
-	/* If not found, read it... */
-	c = holepunch_read_cache_entry(rd, sector, ignore_magic);
-
-	/* ...then add it to the cache */
-	c->sector = sector;
-	c->status = 0;
-	c->first_access = jiffies;
-	c->last_access = jiffies;
-	INIT_LIST_HEAD(&c->list);
-	list_add(&c->list, &rd->map_cache_list[bucket]);
-
-	down_write(&rd->map_cache_count_sem);
-	rd->map_cache_count += 1;
-	up_write(&rd->map_cache_count_sem);
-
-	return c;
+	int kick = 0;
+
+	spin_lock(&rd->map_cache_lock);
+	if (c->status & ERASER_CACHE_DEAD) {
+		/* Dropping took it off everything. */
+	} else if (c->status & (ERASER_CACHE_DIRTY | ERASER_CACHE_REKEYED)) {
+		if (list_empty(&c->dirty)) {
+			if (!list_empty(&c->lru)) {
+				list_del_init(&c->lru);
+				if (c->queue == HP_CACHE_A1IN)
+					--rd->map_cache_a1in_len;
+			}
+			kick = list_empty(&rd->map_cache_dirty)
+					|| rd->map_cache_dirty_len >= HP_CACHE_DIRTY_HIGH;
+			c->dirtied = jiffies;
+			list_add_tail(&c->dirty, &rd->map_cache_dirty);
+			++rd->map_cache_dirty_len;
+		}
+	} else {
+		if (!list_empty(&c->dirty)) {
+			list_del_init(&c->dirty);
+			--rd->map_cache_dirty_len;
+		}
+		if (list_empty(&c->lru)) {
+			if (c->queue == HP_CACHE_A1IN) {
+				list_add(&c->lru, &rd->map_cache_a1in);
+				++rd->map_cache_a1in_len;
+			} else {
+				list_add(&c->lru, &rd->map_cache_am);
+			}
+		}
+	}
+	spin_unlock(&rd->map_cache_lock);
+	if (kick)
+		holepunch_cache_kick(rd);
 }
 
-static void holepunch_get_inode_key(struct holepunch_dev *rd, u8 *dst, u64 ino)
+/*
+ * Drops a cache entry from the table, along with the table's reference, and
+ * puts next in its place if set. The caller must hold its own reference and
+ * the entry lock.
+ */
+static void __eraser_drop_map_cache(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, struct eraser_map_cache *next)
 {
-	struct holepunch_filekey_sector *sector;
-	struct semaphore *cache_lock;
-	sector = holepunch_get_cache_entry(rd, ino, &cache_lock, 0)->map;
-	memcpy(dst, sector->entries[ino % HP_KEY_PER_SECTOR].key, HOLEPUNCH_KEY_LEN);
-	HP_UP(cache_lock, "inode %llu get key", ino);
+	if (c->status & ERASER_CACHE_DEAD)
+		return;
+	if (c->status & ERASER_CACHE_REKEYED)
+		atomic_dec(&rd->cache_unwritten);
+	c->status = ERASER_CACHE_DEAD;
+	spin_lock(&rd->map_cache_lock);
+	holepunch_cache_forget(rd, c);
+	spin_unlock(&rd->map_cache_lock);
+	if (next)
+		rhashtable_replace_fast(&rd->map_cache, &c->node, &next->node,
+				holepunch_cache_params);
+	else
+		rhashtable_remove_fast(&rd->map_cache, &c->node,
+				holepunch_cache_params);
+	holepunch_put_cache_entry(rd, c);
 }
 
-/* Cache eviction runs in separate kernel thread, periodically. */
-static int holepunch_evict_map_cache(void *data)
+static inline void eraser_drop_map_cache(struct holepunch_dev *rd, struct eraser_map_cache *c)
 {
-	struct holepunch_dev *rd = (struct holepunch_dev *)data;
-	struct eraser_map_cache *c;
-	struct eraser_map_cache *n;
-	int will_evict;
-	int will_write_if_dirty;
-	int i;
-
-	/* unsigned long first_access_timeout; */
-	unsigned long last_access_timeout;
-	unsigned long last_dirty_timeout;
-
-	while (1)
-	{
-#ifdef HOLEPUNCH_DEBUG
-		// KWORKERMSG("Evict thread wake");
-#endif
-		/* first_access_timeout = jiffies - ERASER_CACHE_EXP_FIRST_ACCESS; */
-		last_access_timeout = jiffies - ERASER_CACHE_EXP_LAST_ACCESS;
-		last_dirty_timeout = jiffies - ERASER_CACHE_EXP_LAST_DIRTY;
-
-		for (i = 0; i < ERASER_MAP_CACHE_BUCKETS; ++i)
-		{
-			down(&rd->cache_lock[i]);
-
-			list_for_each_entry_safe(c, n, &rd->map_cache_list[i], list)
-			{
-				will_evict = 0;
-				will_write_if_dirty = 0;
-
-				if (time_after(last_dirty_timeout, c->last_dirty))
-					will_write_if_dirty = 1;
+	__eraser_drop_map_cache(rd, c, NULL);
+}
 
-				if (time_after(last_access_timeout, c->last_access))
-					will_evict = 1;
+/*
+ * Walks the cache list: returns the entry after c with a reference held, and
+ * drops the reference on c. Entries stay on the list while referenced, so the
+ * walk may sleep between entries; dropped ones still show up, marked dead.
+ */
+static struct eraser_map_cache *holepunch_cache_next(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	struct list_head *pos;
+	struct eraser_map_cache *n = NULL;
+
+	spin_lock(&rd->map_cache_lock);
+	pos = c ? c->list.next : rd->map_cache_list.next;
+	for (; pos != &rd->map_cache_list; pos = pos->next) {
+		n = list_entry(pos, struct eraser_map_cache, list);
+		if (atomic_inc_not_zero(&n->refs))
+			break;
+		n = NULL;
+	}
+	spin_unlock(&rd->map_cache_lock);
+	if (c)
+		holepunch_put_cache_entry(rd, c);
+	return n;
+}
 
-				if ((will_write_if_dirty || will_evict) && (c->status & ERASER_CACHE_DIRTY))
-				{
-#ifdef HOLEPUNCH_DEBUG
-					KWORKERMSG("Evict thread persisting sector %llu", c->sector);
-#endif
-					holepunch_persist_unlink(rd, c, &rd->cache_lock[i]);
-				}
-				if (will_evict && (rd->map_cache_count > ERASER_CACHE_MEMORY_PRESSURE))
-					eraser_drop_map_cache(rd, c);
-			}
-			up(&rd->cache_lock[i]);
-		}
+#define holepunch_for_each_cache_entry(rd, c) \
+	for (c = holepunch_cache_next(rd, NULL); c; c = holepunch_cache_next(rd, c))
 
-#ifdef HOLEPUNCH_DEBUG
-		// down_read(&rd->map_cache_count_sem);
-		// KWORKERMSG("Evict thread sleep (Cached: %llu)",
-		// 	rd->map_cache_count);
-		// up_read(&rd->map_cache_count_sem);
-#endif
-		msleep_interruptible(ERASER_CACHE_EVICTION_PERIOD * 1000);
+static void holepunch_persist_unlink(struct holepunch_dev *rd,
+		struct eraser_map_cache *c);
 
-		/*
-		 * We do simple & stupid sleep wait instead of signaling. Proper
-		 * eviction strategies should be studied for optimal performance.
-		 */
-		if (kthread_should_stop()) {
-			return 0;
-		}
+/* Marks a cache entry's keys as written. Entry lock must be held. */
+static inline void holepunch_cache_written(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	if (c->status & ERASER_CACHE_REKEYED) {
+		c->status &= ~ERASER_CACHE_REKEYED;
+		atomic_dec(&rd->cache_unwritten);
+		holepunch_cache_refile(rd, c);
 	}
-	return 0; /* Never. */
 }
 
 /*
- * I/O mapping & encryption/decryption functions.
+ * Encrypts a cached key table sector under its current tag into data. Needs
+ * the entry lock and the PPRF read lock held.
  */
-
-/* Called when an encrypted clone bio is written to disk. */
-static void HOLEPUNCH_ENCRYPTed_bio_end_io(struct bio *encrypted_bio)
+static void holepunch_encrypt_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, void *data)
 {
-	struct bio_vec vec;
-	struct eraser_io_work *w = (struct eraser_io_work *)encrypted_bio->bi_private;
-
-	encrypted_bio->bi_iter = w->bio->bi_iter;
-
-	bio_endio(w->bio);
-	bio_put(w->bio);
-
-	while (encrypted_bio->bi_iter.bi_size)
-	{
-		vec = bio_iter_iovec(encrypted_bio, encrypted_bio->bi_iter);
-		bio_advance_iter(encrypted_bio, &encrypted_bio->bi_iter, vec.bv_len);
-		eraser_free_page(vec.bv_page, w->rd);
-	}
+	u8 key[HOLEPUNCH_KEY_LEN];
 
-	bio_put(encrypted_bio);
-	eraser_free_io_work(w);
+	holepunch_evaluate_at_tag(rd, c->map->tag, key, rd->pprf_key);
+	holepunch_cbc_filekey_sector(rd, data, c->map, HOLEPUNCH_ENCRYPT, key,
+			rd->hp_h->key_table_start + c->sector);
 }
 
-/* Bottom-half entry for write operations. */
-static void eraser_do_write_bottomhalf(struct eraser_io_work *w)
+/*
+ * Writes a cached key table sector back under its current tag, without a
+ * puncture. This is all that is needed for keys that were never used; for
+ * dirty sectors it only makes the new keys durable, the old tag still has to
+ * be punctured. rw may carry WRITE_FUA for a write that must be on stable
+ * storage once this returns. Entry lock must be held.
+ */
+static void __holepunch_writeback_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, int rw)
 {
-	struct bio *clone, *encrypted_bio;
-	struct bio_vec vec;
 	struct page *p;
-	u8 key[HOLEPUNCH_KEY_LEN];
+	void *data;
 
-	if (w->is_file)
-	{
-		holepunch_get_inode_key(w->rd, key,
-				bio_iter_iovec(w->bio, w->bio->bi_iter)
-					.bv_page->mapping->host->i_ino);
+	p = eraser_allocate_page(rd);
+	data = kmap(p);
+	HP_DOWN_READ(&rd->pprf_sem, "writeback cache entry");
+	holepunch_encrypt_cache_entry(rd, c, data);
+	HP_UP_READ(&rd->pprf_sem, "writeback cache entry");
+	holepunch_meta_rw_sync(rd, rw, rd->hp_h->key_table_start + c->sector,
+			data, 1);
+	kunmap(p);
+	eraser_free_page(p, rd);
+	holepunch_cache_written(rd, c);
+}
+
+static void holepunch_writeback_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	__holepunch_writeback_cache_entry(rd, c, WRITE);
+}
+
+/*
+ * Drops all cache entries, writing them back to disk if dirty. Takes each
+ * entry lock in turn, in addition to the PPRF lock (read or write depending
+ * on puncture).
+ */
+static void eraser_force_evict_map_cache(struct holepunch_dev *rd, int puncture)
+{
+	struct eraser_map_cache *c;
+#ifdef HOLEPUNCH_DEBUG
+	KWORKERMSG("Force eviction");
+#endif 
+	holepunch_for_each_cache_entry(rd, c)
+	{
+		down(&c->lock);
+		if ((c->status & ERASER_CACHE_DIRTY) && puncture)
+			holepunch_persist_unlink(rd, c);
+		else if (c->status & (ERASER_CACHE_DIRTY | ERASER_CACHE_REKEYED))
+			holepunch_writeback_cache_entry(rd, c);
+		eraser_drop_map_cache(rd, c);
+		up(&c->lock);
+	}
+	holepunch_journal_commit(rd);
+}
+
+/* Sets the budget; the eviction thread trims the cache down to it. */
+static void holepunch_cache_set_budget(struct holepunch_dev *rd, unsigned kb)
+{
+	rd->cache_budget_kb = kb;
+	WRITE_ONCE(rd->cache_budget, (unsigned long) kb * 1024 / HP_CACHE_ENTRY_SIZE);
+}
+
+/* Number of entries over the budget. */
+static inline unsigned long holepunch_cache_excess(struct holepunch_dev *rd)
+{
+	unsigned long budget = READ_ONCE(rd->cache_budget);
+	s64 n = percpu_counter_read_positive(&rd->map_cache_count);
+
+	return budget && n > budget ? n - budget : 0;
+}
+
+/* Oldest clean entry on A1in, with a reference held. Cache list lock held. */
+static struct eraser_map_cache *holepunch_cache_victim_a1in(struct holepunch_dev *rd)
+{
+	struct eraser_map_cache *c;
+
+	list_for_each_entry_reverse(c, &rd->map_cache_a1in, lru) {
+		if (!c->status && atomic_inc_not_zero(&c->refs))
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Runs the Am clock hand from the tail: referenced entries get a second
+ * chance at the head, the first clean one that was not is returned, with a
+ * reference held. Cache list lock must be held.
+ */
+static struct eraser_map_cache *holepunch_cache_victim_am(struct holepunch_dev *rd)
+{
+	struct eraser_map_cache *c, *n;
+
+	list_for_each_entry_safe_reverse(c, n, &rd->map_cache_am, lru) {
+		if (c->referenced) {
+			c->referenced = 0;
+			list_move(&c->lru, &rd->map_cache_am);
+			continue;
+		}
+		if (!c->status && atomic_inc_not_zero(&c->refs))
+			return c;
+	}
+	return NULL;
+}
+
+/* Picks the next entry to drop: from A1in while it is over its share. */
+static struct eraser_map_cache *holepunch_cache_victim(struct holepunch_dev *rd)
+{
+	struct eraser_map_cache *c;
+	unsigned long budget = READ_ONCE(rd->cache_budget);
+	unsigned long kin;
+
+	if (!budget)
+		budget = percpu_counter_read_positive(&rd->map_cache_count);
+	kin = budget / HP_CACHE_A1IN_SHARE;
+
+	spin_lock(&rd->map_cache_lock);
+	if (rd->map_cache_a1in_len > kin) {
+		c = holepunch_cache_victim_a1in(rd);
+		if (!c)
+			c = holepunch_cache_victim_am(rd);
 	} else {
-		memcpy(key, w->rd->sec_key, HOLEPUNCH_KEY_LEN);
+		c = holepunch_cache_victim_am(rd);
+		if (!c)
+			c = holepunch_cache_victim_a1in(rd);
+	}
+	spin_unlock(&rd->map_cache_lock);
+	return c;
+}
+
+/*
+ * Drops up to nr clean entries, as the replacement policy picks them. Busy
+ * entries are skipped, never waited for, and nothing is written, so this is
+ * safe from memory reclaim. Returns the number of entries dropped.
+ */
+static unsigned long holepunch_cache_trim(struct holepunch_dev *rd,
+		unsigned long nr)
+{
+	struct eraser_map_cache *c;
+	unsigned long dropped = 0;
+	unsigned busy = 0;
+
+	while (dropped < nr && busy < HP_CACHE_TRIM_BUSY
+			&& (c = holepunch_cache_victim(rd))) {
+		if (down_trylock(&c->lock)) {
+			++busy;
+		} else {
+			/* Clean and not dropped yet. */
+			if (!c->status) {
+				eraser_drop_map_cache(rd, c);
+				++dropped;
+			} else {
+				++busy;
+			}
+			up(&c->lock);
+		}
+		holepunch_put_cache_entry(rd, c);
+	}
+	return dropped;
+}
+
+static unsigned long holepunch_cache_shrink_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct holepunch_dev *rd = container_of(shrink, struct holepunch_dev,
+			cache_shrinker);
+	s64 n = percpu_counter_read_positive(&rd->map_cache_count)
+			- atomic_read(&rd->cache_unwritten);
+
+	return n > 0 ? n : 0;
+}
+
+static unsigned long holepunch_cache_shrink_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct holepunch_dev *rd = container_of(shrink, struct holepunch_dev,
+			cache_shrinker);
+	unsigned long dropped;
+
+	dropped = holepunch_cache_trim(rd, sc->nr_to_scan);
+	rd->stats_cache_shrunk += dropped;
+	return dropped ? dropped : SHRINK_STOP;
+}
+
+/*
+ * Looks a sector up without taking any lock; returns it with a reference. If
+ * the sector is still being read, waits for it. Returns NULL if it is not
+ * cached, or if the pending entry was withdrawn.
+ */
+static struct eraser_map_cache *holepunch_find_cache_entry(struct holepunch_dev *rd,
+		u64 sector)
+{
+	struct eraser_map_cache *c;
+
+	rcu_read_lock();
+	c = rhashtable_lookup_fast(&rd->map_cache, &sector, holepunch_cache_params);
+	if (c && !atomic_inc_not_zero(&c->refs))
+		c = NULL;
+	rcu_read_unlock();
+	if (!c)
+		return NULL;
+
+	if (unlikely(!completion_done(&c->loaded))) {
+		++rd->stats_cache_miss_wait;
+		wait_for_completion(&c->loaded);
+	}
+	if (unlikely(!c->map)) {
+		holepunch_put_cache_entry(rd, c);
+		return NULL;
+	}
+	c->last_access = jiffies;
+	return c;
+}
+
+/* A new entry, not loaded yet, with the table's reference and the caller's. */
+static struct eraser_map_cache *holepunch_new_cache_entry(struct holepunch_dev *rd,
+		u64 sector)
+{
+	struct eraser_map_cache *c;
+
+	c = eraser_allocate_map_cache(rd);
+	c->sector = sector;
+	c->status = 0;
+	c->first_access = jiffies;
+	c->last_access = jiffies;
+	c->rd = rd;
+	atomic_set(&c->refs, 2);
+	spin_lock_init(&c->key_lock);
+	sema_init(&c->lock, 1);
+	init_completion(&c->loaded);
+	INIT_LIST_HEAD(&c->list);
+	INIT_LIST_HEAD(&c->lru);
+	INIT_LIST_HEAD(&c->dirty);
+	INIT_LIST_HEAD(&c->batch);
+	return c;
+}
+
+/*
+ * Publishes a new entry, so that later requesters for its sector wait on it.
+ * Returns -EEXIST if the sector already has an entry. Other errors come from
+ * growing the table, and usually go away once a rehash is done; after
+ * HP_CACHE_INSERT_TRIES the last one is returned.
+ */
+static int holepunch_insert_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	unsigned tries = 0;
+	int r;
+
+	while ((r = rhashtable_lookup_insert_fast(&rd->map_cache, &c->node,
+			holepunch_cache_params)) && r != -EEXIST
+			&& ++tries < HP_CACHE_INSERT_TRIES)
+		msleep(1);
+	return r;
+}
+
+/* Decrypts the sector of a pending entry, just read into its map. */
+static void holepunch_decrypt_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, int ignore_magic)
+{
+	u64 sector = c->sector;
+	u8 key[HOLEPUNCH_KEY_LEN];
+
+	HP_DOWN_READ(&rd->pprf_sem, "PPRF: read sector");
+	holepunch_evaluate_at_tag(rd, c->map->tag, key, rd->pprf_key);
+	HP_UP_READ(&rd->pprf_sem, "PPRF: read sector");
+	holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_DECRYPT, key,
+			rd->hp_h->key_table_start + sector);
+
+	if (likely(ignore_magic))
+		return;
+	/* This should only happen during a key refresh - if we are reading a 
+	 * sector that has already been refreshed using the old key, the magic 
+	 * will be wrong. So encrypt and re-decrypt using the new key.
+	 * Locking not necessary because the new key will not be punctured at this
+	 * stage.
+	 */
+	if (unlikely(c->map->magic1 != HP_MAGIC1 || c->map->magic2 != HP_MAGIC2)) {
+#ifdef HOLEPUNCH_DEBUG
+		KWORKERMSG("Read sector %llu that has already been refreshed!", sector);
+#endif
+		holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_ENCRYPT, key,
+				rd->hp_h->key_table_start + sector);
+		holepunch_evaluate_at_tag(rd, c->map->tag, key, &rd->pprf_key_new);
+		holepunch_cbc_filekey_sector(rd, c->map, c->map, HOLEPUNCH_DECRYPT, key,
+				rd->hp_h->key_table_start + sector);
+	}
+}
+
+/* Reads and decrypts the sector of a pending entry. */
+static void holepunch_read_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, int ignore_magic)
+{
+	/* Kept up to date in memory; rotation copies rotated sectors back. */
+	if (rd->key_table) {
+		c->map = rd->key_table + c->sector;
+		return;
+	}
+
+	c->map = eraser_read_sector(rd->hp_h->key_table_start + c->sector, NULL, rd);
+	holepunch_decrypt_cache_entry(rd, c, ignore_magic);
+}
+
+/*
+ * Lets the waiters on a loaded entry in, and puts it on a replacement queue:
+ * straight on Am if it is known to be hot, else as 2Q admits it. Only loaded
+ * entries are walked.
+ */
+static void holepunch_publish_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c, int hot)
+{
+	spin_lock(&rd->map_cache_lock);
+	list_add_tail(&c->list, &rd->map_cache_list);
+	if (hot) {
+		c->queue = HP_CACHE_AM;
+		list_add(&c->lru, &rd->map_cache_am);
+	} else {
+		holepunch_cache_admit(rd, c);
+	}
+	spin_unlock(&rd->map_cache_lock);
+	/* Pinned sectors are not the cache's memory to budget. */
+	if (!holepunch_map_pinned(rd, c->map)) {
+		percpu_counter_inc(&rd->map_cache_count);
+		if (unlikely(holepunch_cache_excess(rd)))
+			holepunch_cache_kick(rd);
+	}
+	complete_all(&c->loaded);
+}
+
+static void holepunch_load_key_table(struct holepunch_dev *rd, void *buf,
+		u64 sector)
+{
+	struct holepunch_filekey_sector *s = buf;
+	u8 key[HOLEPUNCH_KEY_LEN];
+
+	holepunch_evaluate_at_tag(rd, s->tag, key, rd->pprf_key);
+	holepunch_cbc_filekey_sector(rd, s, s, HOLEPUNCH_DECRYPT, key, sector);
+}
+
+/*
+ * Pinned mode: reads and decrypts the whole key table at mount, in large
+ * reads decrypted on all CPUs as they arrive. Cache misses then point into it
+ * instead of reading their sector, so no lookup does metadata I/O; dirty
+ * entries are written back as usual. Falls back to the cache alone if the
+ * table cannot be loaded. Runs before anything else can use the PPRF.
+ */
+static void holepunch_pin_key_table(struct holepunch_dev *rd)
+{
+	struct holepunch_filekey_sector *t;
+	struct holepunch_load l;
+	u64 len = rd->key_table_len * ERASER_SECTOR;
+
+	t = vmalloc(len);
+	if (!t) {
+		DMWARN("Cannot allocate %llu KiB to pin the key table", len / 1024);
+		return;
+	}
+	holepunch_load_start(rd, &l, rd->hp_h->key_table_start, t,
+			rd->key_table_len, holepunch_load_key_table, NULL, 0);
+	if (holepunch_load_wait(&l)) {
+		DMERR("Key table read failed; not pinning it");
+		memset(t, 0, len);
+		vfree(t);
+		return;
+	}
+	rd->key_table = t;
+	DMINFO("Pinned %llu KiB of key table", len / 1024);
+}
+
+/* Frees the pinned key table; no cache entry may point into it anymore. */
+static void holepunch_unpin_key_table(struct holepunch_dev *rd)
+{
+	if (!rd->key_table)
+		return;
+	memset(rd->key_table, 0, rd->key_table_len * ERASER_SECTOR);
+	vfree(rd->key_table);
+	rd->key_table = NULL;
+}
+
+static void holepunch_readahead(struct holepunch_dev *rd, u64 sector, int miss);
+
+/*
+ * Searches the cache for the entry containing the key for this inode; if not
+ * found, reads the sector from disk and caches it. Returns the entry with a
+ * reference held, or an ERR_PTR if it could not be cached. Hits take no lock
+ * at all. A miss first publishes a pending
+ * entry, then reads the sector without holding any lock: later requesters for
+ * the same sector wait for that one read, those for other sectors go ahead.
+ */
+static struct eraser_map_cache *holepunch_get_cache_entry(struct holepunch_dev *rd,
+		u64 ino, int ignore_magic)
+{
+	struct eraser_map_cache *c;
+	u64 sector;
+	int r;
+	sector = ino / HP_KEY_PER_SECTOR;
+
+	while (1) {
+		/* Look first */
+		c = holepunch_find_cache_entry(rd, sector);
+		if (likely(c)) {
+			percpu_counter_inc(&rd->stats_cache_hit);
+			if (!c->referenced)
+				c->referenced = 1;
+			if (unlikely(sector == READ_ONCE(rd->ra_mark)))
+				holepunch_readahead(rd, sector, 0);
+			return c;
+		}
+
+		c = holepunch_new_cache_entry(rd, sector);
+		r = holepunch_insert_cache_entry(rd, c);
+		if (!r)
+			break;
+		/* Lost the race, or no room; never seen by anyone else. */
+		eraser_free_map_cache(c, rd);
+		if (r != -EEXIST) {
+			DMWARN_LIMIT("Cannot cache key table sector %llu: %d",
+					sector, r);
+			return ERR_PTR(r);
+		}
+	}
+
+	/* If not found, read it, then let the waiters in. The readahead goes
+	 * out first, so that both reads are in flight together. */
+	percpu_counter_inc(&rd->stats_cache_miss);
+	holepunch_readahead(rd, sector, 1);
+	holepunch_read_cache_entry(rd, c, ignore_magic);
+	holepunch_publish_cache_entry(rd, c, 0);
+	return c;
+}
+
+/*
+ * Keeps a key table sector out of the cache while PPRF rotation rewrites it,
+ * by putting a pending entry in its place that requesters wait on. If the
+ * sector was cached, it has not been rotated yet: copies it to plain and sets
+ * cached.
+ */
+static struct eraser_map_cache *holepunch_block_cache_sector(struct holepunch_dev *rd,
+		u64 sector, struct holepunch_filekey_sector *plain, int *cached)
+{
+	struct eraser_map_cache *pending, *c;
+	int r;
+
+	pending = holepunch_new_cache_entry(rd, sector);
+	/* Only the table's reference; unblocking drops it. */
+	atomic_set(&pending->refs, 1);
+	*cached = 0;
+	/* Rotation cannot go on with the sector open to readers, nor stop
+	 * halfway, so a table that cannot grow is waited out. */
+	while ((r = holepunch_insert_cache_entry(rd, pending))) {
+		if (r != -EEXIST) {
+			DMWARN_LIMIT("Cannot block key table sector %llu: %d",
+					sector, r);
+			continue;
+		}
+		c = holepunch_find_cache_entry(rd, sector);
+		if (!c)
+			continue;
+		HP_DOWN(&c->lock, "REFRESH: sector %llu take entry", sector);
+		if (!(c->status & ERASER_CACHE_DEAD)) {
+			memcpy(plain, c->map, ERASER_SECTOR);
+			__eraser_drop_map_cache(rd, c, pending);
+			*cached = 1;
+		}
+		HP_UP(&c->lock, "REFRESH: sector %llu take entry", sector);
+		holepunch_put_cache_entry(rd, c);
+		if (*cached)
+			break;
+	}
+	return pending;
+}
+
+/* Withdraws a pending entry; its waiters then read the sector themselves. */
+static void holepunch_unblock_cache_sector(struct holepunch_dev *rd,
+		struct eraser_map_cache *pending)
+{
+	pending->status = ERASER_CACHE_DEAD;
+	rhashtable_remove_fast(&rd->map_cache, &pending->node,
+			holepunch_cache_params);
+	complete_all(&pending->loaded);
+	holepunch_put_cache_entry(rd, pending);
+}
+
+/*
+ * Records the hottest cached sectors in the hot list sector, for the next
+ * mount: Am first, then dirty entries, then A1in, newest first in each.
+ */
+static void holepunch_save_hot_sectors(struct holepunch_dev *rd)
+{
+	struct holepunch_hot_list *hot, *plain;
+	struct eraser_map_cache *c;
+	struct page *p;
+	unsigned n = 0;
+
+	if (!rd->hot_sector)
+		return;
+	/* Without room to encrypt it, keep whatever list is on disk. */
+	plain = kmalloc(sizeof(*plain), GFP_KERNEL);
+	if (!plain)
+		return;
+
+	spin_lock(&rd->map_cache_lock);
+	list_for_each_entry(c, &rd->map_cache_am, lru) {
+		if (n == HP_HOT_MAX)
+			goto full;
+		plain->sectors[n++] = c->sector;
+	}
+	list_for_each_entry_reverse(c, &rd->map_cache_dirty, dirty) {
+		if (n == HP_HOT_MAX)
+			goto full;
+		plain->sectors[n++] = c->sector;
+	}
+	list_for_each_entry(c, &rd->map_cache_a1in, lru) {
+		if (n == HP_HOT_MAX)
+			goto full;
+		plain->sectors[n++] = c->sector;
+	}
+full:
+	spin_unlock(&rd->map_cache_lock);
+	plain->nr = n;
+	plain->pad = 0;
+	memset(plain->sectors + n, 0, (HP_HOT_MAX - n) * sizeof(u32));
+
+	p = eraser_allocate_page(rd);
+	hot = kmap(p);
+	hot->magic = HP_HOT_MAGIC;
+	hot->pad0 = 0;
+	kernel_random(hot->iv, ERASER_IV_LEN);
+	holepunch_cbc(rd, (void *) hot + HP_HOT_CLEAR, (void *) plain + HP_HOT_CLEAR,
+			sizeof(*hot) - HP_HOT_CLEAR, HOLEPUNCH_ENCRYPT, rd->sec_key,
+			hot->iv);
+	memset(plain, 0, sizeof(*plain));
+	kfree(plain);
+	/* Only a hint: a torn write just loses it. */
+	eraser_write_sector(rd->hot_sector, hot, rd);
+	kunmap(p);
+	eraser_free_page(p, rd);
+	rd->hot_saved = jiffies;
+}
+
+/*
+ * Reads up to HP_LOAD_CHUNK sectors into the cache ahead of use: publishes
+ * pending entries for them, so that requesters wait for the read instead of
+ * issuing their own, reads them all as one plugged batch and then decrypts
+ * them. Sectors already cached or being read are skipped. Returns the number
+ * of sectors read, or the I/O error.
+ */
+static int holepunch_prefetch_sectors(struct holepunch_dev *rd,
+		const u64 *sectors, unsigned nr, int hot)
+{
+	struct eraser_map_cache *batch[HP_LOAD_CHUNK];
+	struct eraser_map_cache *c;
+	struct holepunch_meta_batch b;
+	struct blk_plug plug;
+	unsigned i, n = 0;
+	int r;
+
+	holepunch_meta_batch_init(&b);
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; ++i) {
+		c = holepunch_new_cache_entry(rd, sectors[i]);
+		if (holepunch_insert_cache_entry(rd, c)) {
+			eraser_free_map_cache(c, rd);
+			continue;
+		}
+		c->map = kmap(eraser_allocate_page(rd));
+		holepunch_meta_rw(rd, &b, READ,
+				rd->hp_h->key_table_start + c->sector, c->map, 1);
+		batch[n++] = c;
+	}
+	blk_finish_plug(&plug);
+	r = holepunch_meta_batch_wait(&b);
+
+	for (i = 0; i < n; ++i) {
+		c = batch[i];
+		if (unlikely(r)) {
+			/* Waiters read it themselves. */
+			eraser_free_sector(c->map, rd);
+			c->map = NULL;
+			holepunch_unblock_cache_sector(rd, c);
+		} else {
+			holepunch_decrypt_cache_entry(rd, c, 0);
+			holepunch_publish_cache_entry(rd, c, hot);
+		}
+		holepunch_put_cache_entry(rd, c);
+	}
+	return r ? r : n;
+}
+
+/*
+ * Prefetches the hot list of the last mount, HP_LOAD_CHUNK sectors at a time,
+ * straight onto Am. Stops early when the device goes away.
+ */
+static void holepunch_warm_cache(struct work_struct *work)
+{
+	struct holepunch_dev *rd = container_of(work, struct holepunch_dev,
+			warm_work);
+	unsigned done = 0, n;
+	int r = 0;
+
+	while (done < rd->warm_total && r >= 0 && !atomic_read(&rd->shutdown)) {
+		n = min_t(unsigned, rd->warm_total - done, HP_LOAD_CHUNK);
+		r = holepunch_prefetch_sectors(rd, rd->warm_list + done, n, 1);
+		done += n;
+		WRITE_ONCE(rd->warm_done, done);
+	}
+	if (r < 0)
+		DMWARN("Cache warm-up read failed: %d", r);
+	DMINFO("Cache warm-up done: %u of %u sectors", done, rd->warm_total);
+	kfree(rd->warm_list);
+	rd->warm_list = NULL;
+}
+
+/*
+ * Reads the readahead window, admitted like any other miss. The window may
+ * grow while it is being read.
+ */
+static void holepunch_readahead_work(struct work_struct *work)
+{
+	struct holepunch_dev *rd = container_of(work, struct holepunch_dev,
+			ra_work);
+	u64 sectors[HP_LOAD_CHUNK];
+	u64 first;
+	unsigned i, n;
+	int r = 0;
+
+	spin_lock(&rd->ra_lock);
+	first = rd->ra_first;
+	while (first < rd->ra_first + rd->ra_nr && r >= 0
+			&& !atomic_read(&rd->shutdown)) {
+		n = min_t(u64, rd->ra_first + rd->ra_nr - first, HP_LOAD_CHUNK);
+		spin_unlock(&rd->ra_lock);
+		for (i = 0; i < n; ++i)
+			sectors[i] = first + i;
+		r = holepunch_prefetch_sectors(rd, sectors, n, 0);
+		if (r > 0)
+			rd->stats_readahead += r;
+		first += n;
+		spin_lock(&rd->ra_lock);
+	}
+	rd->ra_nr = 0;
+	spin_unlock(&rd->ra_lock);
+}
+
+/*
+ * Feeds a miss on sector, or a hit on the readahead mark, to the readahead
+ * state, and starts reading the next window if the stream is sequential.
+ */
+static void holepunch_readahead(struct holepunch_dev *rd, u64 sector, int miss)
+{
+	u64 start, n;
+	unsigned window;
+	int queue = 0;
+
+	if (rd->key_table)
+		return;
+	spin_lock(&rd->ra_lock);
+	if (miss) {
+		if (sector == rd->ra_last + 1 || sector == rd->ra_next)
+			window = rd->ra_window ? rd->ra_window * 2 : HP_RA_MIN;
+		else
+			window = rd->ra_window / 2 >= HP_RA_MIN ? rd->ra_window / 2 : 0;
+		rd->ra_last = sector;
+		start = sector + 1;
+	} else {
+		if (sector != rd->ra_mark)
+			goto out;
+		window = rd->ra_window * 2;
+		start = rd->ra_next;
+	}
+	rd->ra_window = min_t(unsigned, window, HP_RA_MAX);
+	if (!rd->ra_window || start >= rd->key_table_len)
+		goto out;
+
+	n = min_t(u64, rd->ra_window, rd->key_table_len - start);
+	if (rd->ra_nr) {
+		/* Only a stream running past the window in flight extends it. */
+		if (start != rd->ra_first + rd->ra_nr)
+			goto out;
+		rd->ra_nr += n;
+	} else {
+		rd->ra_first = start;
+		rd->ra_nr = n;
+		queue = 1;
+	}
+	rd->ra_mark = start;
+	rd->ra_next = start + n;
+out:
+	spin_unlock(&rd->ra_lock);
+	if (queue)
+		queue_work(system_unbound_wq, &rd->ra_work);
+}
+
+/* Starts warming the cache up with the saved hot list, if there is one. */
+static void holepunch_start_warmup(struct holepunch_dev *rd)
+{
+	struct holepunch_hot_list *hot, *plain = NULL;
+	unsigned long budget = READ_ONCE(rd->cache_budget);
+	unsigned i, n;
+
+	/* A pinned table never misses. */
+	if (rd->key_table || !rd->hot_sector)
+		return;
+	hot = eraser_read_sector(rd->hot_sector, NULL, rd);
+	if (hot->magic != HP_HOT_MAGIC)
+		goto out;
+	plain = kmalloc(sizeof(*plain), GFP_KERNEL);
+	if (!plain)
+		goto out;
+	holepunch_cbc(rd, (void *) plain + HP_HOT_CLEAR, (void *) hot + HP_HOT_CLEAR,
+			sizeof(*hot) - HP_HOT_CLEAR, HOLEPUNCH_DECRYPT, rd->sec_key,
+			hot->iv);
+	n = min_t(unsigned, plain->nr, HP_HOT_MAX);
+	if (budget)
+		n = min_t(unsigned long, n, budget);
+	if (!n)
+		goto out;
+	rd->warm_list = kmalloc(n * sizeof(u64), GFP_KERNEL);
+	if (!rd->warm_list)
+		goto out;
+	for (i = 0; i < n; ++i)
+		if (plain->sectors[i] < rd->key_table_len)
+			rd->warm_list[rd->warm_total++] = plain->sectors[i];
+	queue_work(system_unbound_wq, &rd->warm_work);
+out:
+	if (plain) {
+		memset(plain, 0, sizeof(*plain));
+		kfree(plain);
+	}
+	eraser_free_sector(hot, rd);
+}
+
+/*
+ * Gets the entry for this inode with its entry lock held, for changes that
+ * have to reach the disk. Tries again if the entry is dropped meanwhile.
+ * Returns an ERR_PTR if the sector could not be cached.
+ */
+static struct eraser_map_cache *holepunch_lock_cache_entry(struct holepunch_dev *rd,
+		u64 ino)
+{
+	struct eraser_map_cache *c;
+
+	while (1) {
+		c = holepunch_get_cache_entry(rd, ino, 0);
+		if (IS_ERR(c))
+			return c;
+		HP_DOWN(&c->lock, "inode %llu lock entry", ino);
+		if (likely(!(c->status & ERASER_CACHE_DEAD)))
+			return c;
+		HP_UP(&c->lock, "inode %llu entry dropped", ino);
+		holepunch_put_cache_entry(rd, c);
+	}
+}
+
+static void holepunch_unlock_cache_entry(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	HP_UP(&c->lock, "sector %llu unlock entry", c->sector);
+	holepunch_put_cache_entry(rd, c);
+}
+
+static inline struct holepunch_key_slot *holepunch_key_slot(struct holepunch_dev *rd,
+		u64 ino)
+{
+	return &rd->key_cache[hash_64(ino, HOLEPUNCH_KEY_CACHE_BITS)];
+}
+
+static void holepunch_free_key_handle(struct holepunch_key_handle *h)
+{
+	memset(h->key, 0, HOLEPUNCH_KEY_LEN);
+	kfree(h);
+}
+
+static void holepunch_free_key_handle_rcu(struct rcu_head *head)
+{
+	holepunch_free_key_handle(container_of(head, struct holepunch_key_handle,
+			rcu));
+}
+
+/*
+ * Copies an inode's key out of the key cache, marking it used if asked, and
+ * returns 1. Takes no lock. On a miss returns 0 and, if gen is given, the slot
+ * generation for the fill; that takes the slot lock.
+ */
+static int holepunch_key_cache_get(struct holepunch_dev *rd, u8 *dst, u64 ino,
+		int use, u32 *gen)
+{
+	struct holepunch_key_slot *s = holepunch_key_slot(rd, ino);
+	struct holepunch_key_handle *h;
+	int hit = 0;
+
+	rcu_read_lock();
+	h = rcu_dereference(s->h);
+	if (h && h->ino == ino) {
+		memcpy(dst, h->key, HOLEPUNCH_KEY_LEN);
+		hit = 1;
+		if (use) {
+			/* Pairs with the unlink marking the handle dead before it
+			 * clears the bit: either it sees the bit set, or we see
+			 * the handle dead and go get the new key. */
+			set_bit(ino, rd->slot_used);
+			smp_mb__after_atomic();
+			hit = !READ_ONCE(h->dead);
+		}
+	}
+	rcu_read_unlock();
+	if (!hit && gen) {
+		spin_lock(&s->lock);
+		*gen = s->gen;
+		spin_unlock(&s->lock);
+	}
+	return hit;
+}
+
+/* Caches a key read from its sector, unless an unlink got in since the miss. */
+static void holepunch_key_cache_fill(struct holepunch_dev *rd, u8 *key, u64 ino,
+		u32 gen)
+{
+	struct holepunch_key_slot *s = holepunch_key_slot(rd, ino);
+	struct holepunch_key_handle *h, *old = NULL;
+
+	h = kmalloc(sizeof(*h), GFP_NOIO);
+	if (!h)
+		return;
+	h->ino = ino;
+	h->dead = 0;
+	memcpy(h->key, key, HOLEPUNCH_KEY_LEN);
+
+	spin_lock(&s->lock);
+	if (s->gen == gen) {
+		old = rcu_dereference_protected(s->h, lockdep_is_held(&s->lock));
+		rcu_assign_pointer(s->h, h);
+		h = NULL;
+	}
+	spin_unlock(&s->lock);
+	if (old)
+		call_rcu(&old->rcu, holepunch_free_key_handle_rcu);
+	if (h)
+		holepunch_free_key_handle(h);
+}
+
+/*
+ * Forgets an inode's key after it was replaced. Call under the key lock of
+ * the sector entry, before looking at the used bit.
+ */
+static void holepunch_key_cache_invalidate(struct holepunch_dev *rd, u64 ino)
+{
+	struct holepunch_key_slot *s = holepunch_key_slot(rd, ino);
+	struct holepunch_key_handle *h;
+
+	spin_lock(&s->lock);
+	h = rcu_dereference_protected(s->h, lockdep_is_held(&s->lock));
+	if (h && h->ino == ino) {
+		WRITE_ONCE(h->dead, 1);
+		RCU_INIT_POINTER(s->h, NULL);
+	} else {
+		h = NULL;
+	}
+	++s->gen;
+	spin_unlock(&s->lock);
+	/* Order the above before the caller looks at the used bit. */
+	smp_mb();
+	if (h)
+		call_rcu(&h->rcu, holepunch_free_key_handle_rcu);
+}
+
+/* Drops every cached key; nothing may look keys up anymore. */
+static void holepunch_key_cache_free(struct holepunch_dev *rd)
+{
+	struct holepunch_key_handle *h;
+	unsigned i;
+
+	for (i = 0; i < HP_KEY_CACHE_SLOTS; ++i) {
+		h = rcu_dereference_protected(rd->key_cache[i].h, 1);
+		if (h)
+			holepunch_free_key_handle(h);
+	}
+	vfree(rd->key_cache);
+}
+
+/* Marking the key as used must happen under the key lock, so that an unlink
+ * never sees a key as unused while data is being encrypted with it. A dropped
+ * entry still holds the right keys, as unlinks only change live ones. Key
+ * cache hits mark it without a lock, and check the handle is still live
+ * afterwards. */
+static int holepunch_get_inode_key(struct holepunch_dev *rd, u8 *dst, u64 ino,
+		int use)
+{
+	struct eraser_map_cache *c;
+	u32 gen;
+
+	if (likely(holepunch_key_cache_get(rd, dst, ino, use, &gen))) {
+		percpu_counter_inc(&rd->stats_key_hit);
+		return 0;
+	}
+
+	c = holepunch_get_cache_entry(rd, ino, 0);
+	if (IS_ERR(c))
+		return PTR_ERR(c);
+	spin_lock(&c->key_lock);
+	memcpy(dst, c->map->entries[ino % HP_KEY_PER_SECTOR].key, HOLEPUNCH_KEY_LEN);
+	if (use)
+		set_bit(ino, rd->slot_used);
+	spin_unlock(&c->key_lock);
+	holepunch_put_cache_entry(rd, c);
+	holepunch_key_cache_fill(rd, dst, ino, gen);
+	return 0;
+}
+
+/*
+ * Takes the oldest dirty entry off the dirty list if it is due, with a
+ * reference held: once it has been dirty for ERASER_CACHE_EXP_LAST_DIRTY, or
+ * right away while too many entries are dirty.
+ */
+static struct eraser_map_cache *holepunch_cache_next_due(struct holepunch_dev *rd)
+{
+	struct eraser_map_cache *c;
+
+	spin_lock(&rd->map_cache_lock);
+	c = list_first_entry_or_null(&rd->map_cache_dirty, struct eraser_map_cache,
+			dirty);
+	if (c && (rd->map_cache_dirty_len > HP_CACHE_DIRTY_HIGH
+			|| time_after_eq(jiffies, c->dirtied + ERASER_CACHE_EXP_LAST_DIRTY))
+			&& atomic_inc_not_zero(&c->refs)) {
+		list_del_init(&c->dirty);
+		--rd->map_cache_dirty_len;
+	} else {
+		c = NULL;
+	}
+	spin_unlock(&rd->map_cache_lock);
+	return c;
+}
+
+/* Jiffies until the oldest dirty entry is due, or the longest sleep. */
+static long holepunch_cache_writeback_timeout(struct holepunch_dev *rd)
+{
+	struct eraser_map_cache *c;
+	long t = ERASER_CACHE_EVICTION_PERIOD * HZ;
+	long due;
+
+	spin_lock(&rd->map_cache_lock);
+	c = list_first_entry_or_null(&rd->map_cache_dirty, struct eraser_map_cache,
+			dirty);
+	if (c) {
+		due = (long) (c->dirtied + ERASER_CACHE_EXP_LAST_DIRTY - jiffies);
+		t = clamp(due, 1L, t);
+	}
+	spin_unlock(&rd->map_cache_lock);
+	return t;
+}
+
+/*
+ * Cache writeback runs in a separate kernel thread. It sleeps until the oldest
+ * dirty entry is due or it is woken up: when the first entry gets dirty, when
+ * too many are, or when the cache goes over budget. Due entries are taken off
+ * the dirty list before the work on them, so only their own lock is held
+ * across the puncture or write; they are filed again by status afterwards.
+ */
+/*
+ * The unlink probe is sized so that it should never run out of instances, but
+ * if it does, the unlinks it missed keep their keys and nothing can tell which
+ * files they were. The probe is shared by all devices, so each one warns and
+ * counts the misses in its status; only the administrator can tell whether
+ * files on it were affected.
+ */
+static void holepunch_unlink_check_missed(struct holepunch_dev *rd)
+{
+	int missed = READ_ONCE(eraser_unlink_kretprobe.nmissed);
+
+	if (missed == rd->unlink_missed)
+		return;
+	DMWARN("%s: unlink probe missed %d unlinks; deleted files may be recoverable",
+			rd->eraser_name, missed - rd->unlink_missed);
+	atomic_add(missed - rd->unlink_missed, &rd->stats_unlink_missed);
+	rd->unlink_missed = missed;
+}
+
+static int holepunch_evict_map_cache(void *data)
+{
+	struct holepunch_dev *rd = (struct holepunch_dev *)data;
+	struct eraser_map_cache *c;
+
+	while (!kthread_should_stop())
+	{
+		wait_event_interruptible_timeout(rd->cache_wait,
+				kthread_should_stop() || test_and_clear_bit(0, &rd->cache_kick),
+				holepunch_cache_writeback_timeout(rd));
+#ifdef HOLEPUNCH_DEBUG
+		// KWORKERMSG("Evict thread wake");
+#endif
+		while ((c = holepunch_cache_next_due(rd))) {
+			down(&c->lock);
+			if (c->status & ERASER_CACHE_DIRTY)
+			{
+#ifdef HOLEPUNCH_DEBUG
+				KWORKERMSG("Evict thread persisting sector %llu", c->sector);
+#endif
+				holepunch_persist_unlink(rd, c);
+			}
+			else if (c->status & ERASER_CACHE_REKEYED)
+				holepunch_writeback_cache_entry(rd, c);
+			holepunch_cache_refile(rd, c);
+			holepunch_unlock_cache_entry(rd, c);
+		}
+		holepunch_cache_trim(rd, holepunch_cache_excess(rd));
+
+		holepunch_unlink_check_missed(rd);
+
+		/* Keeps the hot list fresh in case the device is never closed. */
+		if (time_after(jiffies, rd->hot_saved + HP_HOT_SAVE_PERIOD))
+			holepunch_save_hot_sectors(rd);
+	}
+	return 0;
+}
+
+/*
+ * Writes back every cached key table sector holding keys not yet on disk, as
+ * one plugged batch. Entry locks are only tried, never waited for, while the
+ * PPRF read lock is held; busy entries are written back one by one after the
+ * batch is done. Locks stay held until the writes complete, so that nothing
+ * can write or re-read a sector with a write in flight.
+ */
+static void holepunch_writeback_key_table(struct holepunch_dev *rd)
+{
+	struct holepunch_meta_batch batch;
+	struct eraser_map_cache *c, *n;
+	struct blk_plug plug;
+	struct page *p;
+	void *data;
+	LIST_HEAD(pages);
+	LIST_HEAD(held);
+	LIST_HEAD(busy);
+
+	if (!atomic_read(&rd->cache_unwritten))
+		return;
+
+	holepunch_meta_batch_init(&batch);
+
+	HP_DOWN_READ(&rd->pprf_sem, "Flush: key table");
+	blk_start_plug(&plug);
+	holepunch_for_each_cache_entry(rd, c) {
+		if (!(c->status & ERASER_CACHE_REKEYED))
+			continue;
+		/* Both lists keep their own reference. */
+		atomic_inc(&c->refs);
+		if (down_trylock(&c->lock)) {
+			list_add_tail(&c->batch, &busy);
+			continue;
+		}
+		if (!(c->status & ERASER_CACHE_REKEYED)) {
+			holepunch_unlock_cache_entry(rd, c);
+			continue;
+		}
+		p = eraser_allocate_page(rd);
+		data = kmap(p);
+		holepunch_encrypt_cache_entry(rd, c, data);
+		list_add(&p->lru, &pages);
+		holepunch_meta_rw(rd, &batch, WRITE,
+				rd->hp_h->key_table_start + c->sector, data, 1);
+		kunmap(p);
+		holepunch_cache_written(rd, c);
+		++rd->stats_flush_writeback;
+		list_add_tail(&c->batch, &held);
+	}
+	blk_finish_plug(&plug);
+	HP_UP_READ(&rd->pprf_sem, "Flush: key table");
+
+	if (holepunch_meta_batch_wait(&batch))
+		DMERR("Key table writeback failed!");
+	list_for_each_entry_safe(c, n, &held, batch) {
+		list_del_init(&c->batch);
+		holepunch_unlock_cache_entry(rd, c);
+	}
+	while (!list_empty(&pages)) {
+		p = list_first_entry(&pages, struct page, lru);
+		list_del(&p->lru);
+		eraser_free_page(p, rd);
+	}
+
+	list_for_each_entry_safe(c, n, &busy, batch) {
+		list_del_init(&c->batch);
+		HP_DOWN(&c->lock, "Flush: busy sector %llu", c->sector);
+		if (c->status & ERASER_CACHE_REKEYED) {
+			holepunch_writeback_cache_entry(rd, c);
+			++rd->stats_flush_writeback;
+		}
+		holepunch_unlock_cache_entry(rd, c);
+	}
+}
+
+/* Bottom half for flushes: write back cached keys, then pass the flushes on. */
+static void holepunch_do_flush(struct work_struct *work)
+{
+	struct holepunch_dev *rd = container_of(work, struct holepunch_dev,
+			flush_work);
+	struct bio_list bios;
+	struct bio *bio;
+	unsigned long flags;
+
+	bio_list_init(&bios);
+	spin_lock_irqsave(&rd->flush_lock, flags);
+	bio_list_merge(&bios, &rd->flush_bios);
+	bio_list_init(&rd->flush_bios);
+	spin_unlock_irqrestore(&rd->flush_lock, flags);
+
+	holepunch_writeback_key_table(rd);
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+static void holepunch_queue_flush(struct holepunch_dev *rd, struct bio *bio)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rd->flush_lock, flags);
+	bio_list_add(&rd->flush_bios, bio);
+	spin_unlock_irqrestore(&rd->flush_lock, flags);
+	queue_work(rd->io_queue, &rd->flush_work);
+}
+
+/*
+ * Makes an inode's key durable before a FUA write that depends on it. The FUA
+ * data write only covers itself, so the key sector goes out FUA as well.
+ */
+static int holepunch_sync_inode_key(struct holepunch_dev *rd, u64 ino)
+{
+	struct eraser_map_cache *c;
+
+	c = holepunch_lock_cache_entry(rd, ino);
+	if (IS_ERR(c))
+		return PTR_ERR(c);
+	if (c->status & ERASER_CACHE_REKEYED)
+		__holepunch_writeback_cache_entry(rd, c, WRITE_FUA);
+	holepunch_unlock_cache_entry(rd, c);
+	return 0;
+}
+
+/*
+ * I/O mapping & encryption/decryption functions.
+ */
+
+/* Called when an encrypted clone bio is written to disk. The work lives in the
+ * original bio, so that one is ended last. */
+static void HOLEPUNCH_ENCRYPTed_bio_end_io(struct bio *encrypted_bio)
+{
+	struct bio_vec vec;
+	struct eraser_io_work *w = (struct eraser_io_work *)encrypted_bio->bi_private;
+	struct bio *bio = w->bio;
+
+	encrypted_bio->bi_iter = w->iter;
+	while (encrypted_bio->bi_iter.bi_size)
+	{
+		vec = bio_iter_iovec(encrypted_bio, encrypted_bio->bi_iter);
+		bio_advance_iter(encrypted_bio, &encrypted_bio->bi_iter, vec.bv_len);
+		eraser_free_page(vec.bv_page, w->rd);
 	}
 
-	/* Clone the original bio's pages, encrypt them, submit in a new bio. */
-	encrypted_bio = eraser_allocate_bio_multi_vector(w->bio->bi_iter.bi_size / ERASER_SECTOR, w->rd);
+	bio->bi_error = encrypted_bio->bi_error;
+	w->state = HP_IO_DONE;
+	bio_put(encrypted_bio);
+	bio_endio(bio);
+}
+
+/*
+ * Allocates the bio and pages an encrypted write goes out in. With GFP_KERNEL
+ * this always succeeds; otherwise it may run out of memory, and returns NULL
+ * having kept nothing.
+ */
+static struct bio *holepunch_alloc_encrypted(struct eraser_io_work *w, gfp_t gfp)
+{
+	struct bio *encrypted_bio;
+	unsigned n = w->iter.bi_size / ERASER_SECTOR;
+	struct bio_vec *bv;
+	struct page *p;
+	int i;
+
+	encrypted_bio = bio_alloc_bioset(gfp, n, w->rd->bioset);
+	if (!encrypted_bio)
+		return NULL;
 	encrypted_bio->bi_bdev = w->bio->bi_bdev;
-	encrypted_bio->bi_iter.bi_sector = w->bio->bi_iter.bi_sector;
+	encrypted_bio->bi_iter.bi_sector = w->iter.bi_sector;
 	encrypted_bio->bi_rw = w->bio->bi_rw;
 	encrypted_bio->bi_private = w;
 	encrypted_bio->bi_end_io = &HOLEPUNCH_ENCRYPTed_bio_end_io;
 
-	clone = bio_clone_fast(w->bio, GFP_NOIO, w->rd->bioset);
-	while (clone->bi_iter.bi_size)
+	while (n--)
 	{
-		vec = bio_iter_iovec(clone, clone->bi_iter);
-		bio_advance_iter(clone, &clone->bi_iter, vec.bv_len);
-
-		p = eraser_allocate_page(w->rd);
-		holepunch_cbc_sector(w->rd, kmap(p), kmap(vec.bv_page), 
-				HOLEPUNCH_ENCRYPT, key, clone->bi_iter.bi_sector);
-		kunmap(p);
-		kunmap(vec.bv_page);
+		p = mempool_alloc(w->rd->page_pool, gfp);
+		if (!p)
+			goto nomem;
 		bio_add_page(encrypted_bio, p, ERASER_SECTOR, 0);
 	}
+	return encrypted_bio;
 
-	submit_bio(0, encrypted_bio);
-	bio_put(clone);
+nomem:
+	bio_for_each_segment_all(bv, encrypted_bio, i)
+		eraser_free_page(bv->bv_page, w->rd);
+	bio_put(encrypted_bio);
+	return NULL;
 }
 
-/* Bottom half entry for read operations. */
-static void eraser_do_read_bottomhalf(struct eraser_io_work *w)
+/*
+ * Runs the cipher over an I/O's sectors from iter on: a write's are encrypted
+ * into the pages of its encrypted bio from index idx, a read's are decrypted
+ * in place. The bio's own iterator is not used; a read's was used up by the
+ * read itself.
+ */
+static void holepunch_crypt_range(struct eraser_io_work *w,
+		struct bvec_iter iter, unsigned idx)
 {
-	struct bio *clone;
 	struct bio_vec vec;
-	u8 key[HOLEPUNCH_KEY_LEN];
+	struct page *p;
 
-	if (w->is_file)	{
-		holepunch_get_inode_key(w->rd, key,
-				bio_iter_iovec(w->bio, w->bio->bi_iter)
-				.bv_page->mapping->host->i_ino);
+	while (iter.bi_size)
+	{
+		vec = bio_iter_iovec(w->bio, iter);
+		bio_advance_iter(w->bio, &iter, vec.bv_len);
+
+		if (w->state == HP_IO_WRITE) {
+			p = w->out->bi_io_vec[idx++].bv_page;
+			holepunch_cbc_sector(w->rd, kmap(p), kmap(vec.bv_page), 
+					HOLEPUNCH_ENCRYPT, w->key, iter.bi_sector);
+			kunmap(p);
+		} else {
+			holepunch_cbc_sector_inplace(w->rd, kmap(vec.bv_page), 
+					HOLEPUNCH_DECRYPT, w->key, iter.bi_sector);
+		}
+		kunmap(vec.bv_page);
+	}
+}
+
+/* Sends an encrypted write off, or ends a decrypted read. */
+static void holepunch_crypt_done(struct eraser_io_work *w)
+{
+	if (w->state == HP_IO_WRITE) {
+		submit_bio(0, w->out);
 	} else {
-		memcpy(key, w->rd->sec_key, HOLEPUNCH_KEY_LEN);
+		/* Ends it for real this time; see eraser_end_io. */
+		w->state = HP_IO_DONE;
+		bio_endio(w->bio);
 	}
+}
 
-	/* Read is complete at this point. Simply iterate over pages and decrypt. */
-	clone = bio_clone_fast(w->bio, GFP_NOIO, w->rd->bioset);
-	while (clone->bi_iter.bi_size)
-	{
-		vec = bio_iter_iovec(clone, clone->bi_iter);
-		bio_advance_iter(clone, &clone->bi_iter, vec.bv_len);
+/*
+ * Encrypts a write and submits it right away, without the crypto workers. May
+ * fail to allocate unless gfp is GFP_KERNEL; returns -ENOMEM then, having done
+ * nothing.
+ */
+static int holepunch_submit_encrypted(struct eraser_io_work *w, gfp_t gfp)
+{
+	w->out = holepunch_alloc_encrypted(w, gfp);
+	if (!w->out)
+		return -ENOMEM;
+	holepunch_crypt_range(w, w->iter, 0);
+	holepunch_crypt_done(w);
+	return 0;
+}
 
-		holepunch_cbc_sector_inplace(w->rd, kmap(vec.bv_page), 
-				HOLEPUNCH_DECRYPT, key, clone->bi_iter.bi_sector);
-		kunmap(vec.bv_page);
+/*
+ * Gets the key for an I/O into w->key if that needs neither I/O nor a lock:
+ * the sector key, or an inode key in the key cache. Returns 1 if it did.
+ */
+static int holepunch_try_io_key(struct eraser_io_work *w, int use)
+{
+	u64 ino;
+
+	if (!w->is_file) {
+		memcpy(w->key, w->rd->sec_key, HOLEPUNCH_KEY_LEN);
+		return 1;
+	}
+	ino = bio_iter_iovec(w->bio, w->iter).bv_page->mapping->host->i_ino;
+	if (!holepunch_key_cache_get(w->rd, w->key, ino, use, NULL))
+		return 0;
+	percpu_counter_inc(&w->rd->stats_key_hit);
+	return 1;
+}
+
+/*
+ * Crypto workers. Large I/Os are cut into chunks of HP_CRYPTO_CHUNK, which go
+ * on the queue of the worker of the CPU they came from. Workers take from the
+ * head of their own queue, and when it is empty steal from the tail of the
+ * next busy one, so that a single large I/O gets spread over all of them.
+ */
+
+/* Takes a chunk off a worker's queue: the first one, or the last to steal. */
+static struct holepunch_crypto_chunk *holepunch_crypto_take(
+		struct holepunch_crypto_worker *cw, int steal)
+{
+	struct holepunch_crypto_chunk *c = NULL;
+
+	spin_lock(&cw->lock);
+	if (cw->len) {
+		if (steal)
+			c = list_last_entry(&cw->queue, struct holepunch_crypto_chunk, list);
+		else
+			c = list_first_entry(&cw->queue, struct holepunch_crypto_chunk, list);
+		list_del(&c->list);
+		--cw->len;
+	}
+	spin_unlock(&cw->lock);
+	if (c)
+		atomic_dec(&cw->rd->crypto_queued);
+	return c;
+}
+
+/* Does a chunk; the last one of an I/O to be done finishes the I/O. */
+static void holepunch_crypto_run(struct holepunch_crypto_chunk *c)
+{
+	struct eraser_io_work *w = c->w;
+	struct holepunch_dev *rd = w->rd;
+
+	holepunch_crypt_range(w, c->iter, c->idx);
+	if (atomic_dec_and_test(&w->pending)) {
+		kfree(w->chunks);
+		holepunch_crypt_done(w);
+		atomic_dec(&rd->jobs);
+	}
+}
+
+static int holepunch_crypto_thread(void *data)
+{
+	struct holepunch_crypto_worker *cw = data, *victim;
+	struct holepunch_dev *rd = cw->rd;
+	struct holepunch_crypto_chunk *c;
+	unsigned i, me = cw - rd->crypto_workers;
+	u64 t;
+
+	while (!kthread_should_stop()) {
+		c = holepunch_crypto_take(cw, 0);
+		for (i = 1; !c && i < rd->nr_crypto_workers; ++i) {
+			victim = &rd->crypto_workers[(me + i) % rd->nr_crypto_workers];
+			if (READ_ONCE(victim->len) && (c = holepunch_crypto_take(victim, 1)))
+				++cw->stats_stolen;
+		}
+		if (!c) {
+			wait_event_interruptible_exclusive(rd->crypto_wait,
+					atomic_read(&rd->crypto_queued) || kthread_should_stop());
+			continue;
+		}
+
+		t = ktime_get_ns();
+		holepunch_crypto_run(c);
+		cw->stats_busy_ns += ktime_get_ns() - t;
+		++cw->stats_chunks;
+	}
+
+	return 0;
+}
+
+/*
+ * Does an I/O's crypto once its key is in w->key. Large ones are cut into
+ * chunks: this thread does the first one and the crypto workers the rest.
+ * Anything else, or if there is no memory for the chunks, is done right here.
+ */
+static void holepunch_crypt(struct eraser_io_work *w)
+{
+	struct holepunch_dev *rd = w->rd;
+	struct holepunch_crypto_worker *cw;
+	struct holepunch_crypto_chunk *c;
+	struct bvec_iter iter = w->iter;
+	unsigned nr, i;
+
+	nr = DIV_ROUND_UP(iter.bi_size, HP_CRYPTO_CHUNK);
+	c = nr > 1 ? kmalloc_array(nr, sizeof(*c), GFP_NOIO) : NULL;
+	if (!c) {
+		holepunch_crypt_range(w, w->iter, 0);
+		holepunch_crypt_done(w);
+		return;
+	}
+
+	w->chunks = c;
+	atomic_set(&w->pending, nr);
+	/* Dropped by the last chunk, so that the target waits for it. */
+	atomic_inc(&rd->jobs);
+	for (i = 0; i < nr; ++i) {
+		c[i].w = w;
+		c[i].idx = i * (HP_CRYPTO_CHUNK / ERASER_SECTOR);
+		c[i].iter = iter;
+		c[i].iter.bi_size = min_t(unsigned, iter.bi_size, HP_CRYPTO_CHUNK);
+		bio_advance_iter(w->bio, &iter, c[i].iter.bi_size);
+	}
+
+	cw = &rd->crypto_workers[rd->crypto_home[raw_smp_processor_id()]];
+	spin_lock(&cw->lock);
+	for (i = 1; i < nr; ++i)
+		list_add_tail(&c[i].list, &cw->queue);
+	cw->len += nr - 1;
+	spin_unlock(&cw->lock);
+	atomic_add(nr - 1, &rd->crypto_queued);
+	wake_up_nr(&rd->crypto_wait, nr - 1);
+
+	holepunch_crypto_run(c);
+}
+
+static void holepunch_stop_crypto_workers(struct holepunch_dev *rd)
+{
+	unsigned i;
+
+	for (i = 0; i < rd->nr_crypto_workers; ++i)
+		kthread_stop(rd->crypto_workers[i].task);
+	kfree(rd->crypto_workers);
+	kfree(rd->crypto_home);
+}
+
+/* Starts a crypto worker on each CPU in crypto_cpus, or on all of them. */
+static int holepunch_start_crypto_workers(struct holepunch_dev *rd)
+{
+	struct holepunch_crypto_worker *cw;
+	cpumask_var_t mask;
+	unsigned i;
+	int cpu, r = 0;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	if (crypto_cpus[0] && cpulist_parse(crypto_cpus, mask)) {
+		DMWARN("Invalid crypto_cpus \"%s\", using all CPUs", crypto_cpus);
+		cpumask_clear(mask);
+	}
+	cpumask_and(mask, mask, cpu_online_mask);
+	if (cpumask_empty(mask))
+		cpumask_copy(mask, cpu_online_mask);
+
+	rd->nr_crypto_workers = 0;
+	rd->crypto_workers = kcalloc(cpumask_weight(mask), sizeof(*cw), GFP_KERNEL);
+	rd->crypto_home = kmalloc_array(nr_cpu_ids, sizeof(*rd->crypto_home), GFP_KERNEL);
+	if (!rd->crypto_workers || !rd->crypto_home) {
+		kfree(rd->crypto_workers);
+		kfree(rd->crypto_home);
+		r = -ENOMEM;
+		goto out;
 	}
+	atomic_set(&rd->crypto_queued, 0);
+	init_waitqueue_head(&rd->crypto_wait);
+
+	for_each_cpu(cpu, mask) {
+		cw = &rd->crypto_workers[rd->nr_crypto_workers];
+		cw->rd = rd;
+		cw->cpu = cpu;
+		spin_lock_init(&cw->lock);
+		INIT_LIST_HEAD(&cw->queue);
+		cw->task = kthread_create(&holepunch_crypto_thread, cw, "holepunch_crypt/%d", cpu);
+		if (IS_ERR(cw->task)) {
+			r = PTR_ERR(cw->task);
+			holepunch_stop_crypto_workers(rd);
+			goto out;
+		}
+		kthread_bind(cw->task, cpu);
+		wake_up_process(cw->task);
+		++rd->nr_crypto_workers;
+	}
+
+	/* CPUs without a worker of their own queue to some other one. */
+	for_each_possible_cpu(cpu)
+		rd->crypto_home[cpu] = cpu % rd->nr_crypto_workers;
+	for (i = 0; i < rd->nr_crypto_workers; ++i)
+		rd->crypto_home[rd->crypto_workers[i].cpu] = i;
+	rd->crypto_start = ktime_get_ns();
+	DMINFO("Crypto workers: %u", rd->nr_crypto_workers);
+
+out:
+	free_cpumask_var(mask);
+	return r;
+}
 
+/* Ends an I/O whose key could not be had, without touching its data. */
+static void holepunch_fail_io(struct eraser_io_work *w, int error)
+{
+	w->state = HP_IO_DONE;
+	w->bio->bi_error = error;
 	bio_endio(w->bio);
-	bio_put(w->bio);
+}
+
+/* Bottom-half entry for write operations. */
+static void eraser_do_write_bottomhalf(struct eraser_io_work *w)
+{
+	u64 ino;
+	int r;
+
+	if (w->is_file)
+	{
+		ino = bio_iter_iovec(w->bio, w->bio->bi_iter)
+				.bv_page->mapping->host->i_ino;
+		r = holepunch_get_inode_key(w->rd, w->key, ino, 1);
+		if (!r && unlikely(w->bio->bi_rw & REQ_FUA))
+			r = holepunch_sync_inode_key(w->rd, ino);
+		if (unlikely(r)) {
+			holepunch_fail_io(w, r);
+			return;
+		}
+	} else {
+		memcpy(w->key, w->rd->sec_key, HOLEPUNCH_KEY_LEN);
+	}
+
+	w->out = holepunch_alloc_encrypted(w, GFP_KERNEL);
+	holepunch_crypt(w);
+}
+
+/* Bottom half entry for read operations. */
+static void eraser_do_read_bottomhalf(struct eraser_io_work *w)
+{
+	int r;
+
+	if (w->is_file)	{
+		r = holepunch_get_inode_key(w->rd, w->key,
+				bio_iter_iovec(w->bio, w->iter)
+				.bv_page->mapping->host->i_ino, 0);
+		if (unlikely(r)) {
+			holepunch_fail_io(w, r);
+			return;
+		}
+	} else {
+		memcpy(w->key, w->rd->sec_key, HOLEPUNCH_KEY_LEN);
+	}
 
-	bio_put(clone);
-	eraser_free_io_work(w);
+	/* Read is complete at this point. Simply decrypt the pages. */
+	holepunch_crypt(w);
 }
 
 /* I/O queues. */
@@ -1462,25 +3478,41 @@ static void eraser_do_io(struct work_struct *work)
 	atomic_dec(&rd->jobs);
 }
 
-static void eraser_queue_io(struct eraser_io_work *w)
+/* Sends an I/O to the bottom half. After the shutdown signal nothing is
+ * queued anymore; returns -EIO, and the caller has to end the bio. */
+static int eraser_queue_io(struct eraser_io_work *w)
 {
-	int b;
-
-	b = atomic_read(&w->rd->shutdown);
-	if (b)
-		return; /*don't try to do anything if the shutdown signal has been sent */
+	if (atomic_read(&w->rd->shutdown))
+		return -EIO;
 	atomic_inc(&w->rd->jobs);
 
 	INIT_WORK(&w->work, eraser_do_io);
 	queue_work(w->rd->io_queue, &w->work);
+	return 0;
 }
 
-/* Called when the original bio's read is complete. Next we wil decrypt in the
- * bottom half. */
-static void eraser_read_end_io(struct bio *clone)
+/*
+ * DM end_io hook. Called when a read is complete: small reads whose key is at
+ * hand are decrypted right here; others are held back while they are
+ * decrypted in the bottom half, which ends them again once done. Everything
+ * else goes on as is.
+ */
+static int eraser_end_io(struct dm_target *ti, struct bio *bio, int error)
 {
-	eraser_queue_io((struct eraser_io_work *)clone->bi_private);
-	bio_put(clone);
+	struct eraser_io_work *w = dm_per_bio_data(bio, sizeof(struct eraser_io_work));
+
+	if (w->state != HP_IO_READ || error)
+		return error;
+	if (w->iter.bi_size <= HP_INLINE_READ_MAX && holepunch_try_io_key(w, 0)) {
+		holepunch_decrypt_atomic(w->rd, bio, w->iter, w->key);
+		percpu_counter_inc(&w->rd->stats_inline);
+		w->state = HP_IO_DONE;
+		return 0;
+	}
+	/* Nothing is decrypted after the shutdown signal; don't hold it. */
+	if (eraser_queue_io(w))
+		return -EIO;
+	return DM_ENDIO_INCOMPLETE;
 }
 
 /*
@@ -1492,12 +3524,14 @@ static void eraser_read_end_io(struct bio *clone)
  */
 static int eraser_map_bio(struct dm_target *ti, struct bio *bio)
 {
-	struct bio *clone;
-	struct eraser_io_work *w;
+	struct eraser_io_work *w = dm_per_bio_data(bio, sizeof(struct eraser_io_work));
 	struct holepunch_dev *rd = (struct holepunch_dev *)ti->private;
 
-	if (unlikely(!rd->virt_dev))
-		rd->virt_dev = bio->bi_bdev->bd_dev;
+	w->state = HP_IO_PASS;
+	if (unlikely(READ_ONCE(rd->failed))) {
+		bio_io_error(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
 
 	bio->bi_bdev = rd->real_dev->bdev;
 	// #ifdef HOLEPUNCH_DEBUG
@@ -1506,7 +3540,18 @@ static int eraser_map_bio(struct dm_target *ti, struct bio *bio)
 	// #endif
 	bio->bi_iter.bi_sector = bio->bi_iter.bi_sector + (rd->hp_h->data_start * ERASER_SECTOR_SCALE);
 
-	if (unlikely(bio->bi_rw & (REQ_FLUSH | REQ_DISCARD)))
+	if (unlikely(bio->bi_rw & REQ_FLUSH))
+	{
+		/* A flush must also cover keys that only live in the cache. */
+		if (atomic_read(&rd->cache_unwritten))
+		{
+			holepunch_queue_flush(rd, bio);
+			return DM_MAPIO_SUBMITTED;
+		}
+		return DM_MAPIO_REMAPPED;
+	}
+
+	if (unlikely(bio->bi_rw & REQ_DISCARD))
 	{
 		return DM_MAPIO_REMAPPED;
 	}
@@ -1518,7 +3563,9 @@ static int eraser_map_bio(struct dm_target *ti, struct bio *bio)
 		/* 	DMCRIT("remapping... sector: %lu, size: %u", bio->bi_iter.bi_sector, bio->bi_iter.bi_size); */
 		/* } */
 
-		w = eraser_allocate_io_work(bio, rd);
+		w->rd = rd;
+		w->bio = bio;
+		w->iter = bio->bi_iter;
 
 		/* Perform a few NULL pointer checks, these things do happen
 		 * when bio is not a read/write operation. */
@@ -1535,24 +3582,30 @@ static int eraser_map_bio(struct dm_target *ti, struct bio *bio)
 			w->is_file = 0; /* We will perform good old disk sector encryption. */
 		}
 
-		/* We need to perform I/O to read keys, so send to bottom half. */
+		/* We may need to perform I/O to read keys, so send to bottom
+		 * half unless the key is at hand. Nothing may wait on memory
+		 * here, as bios submitted so far are only sent once we return.
+		 * Large writes go to the bottom half anyway, to be spread over
+		 * the crypto workers. */
 		if (bio_data_dir(bio) == WRITE)
 		{
-			bio_get(bio);
-			eraser_queue_io(w);
+			w->state = HP_IO_WRITE;
+			if (!(bio->bi_rw & REQ_FUA) && bio->bi_iter.bi_size <= HP_CRYPTO_CHUNK
+					&& holepunch_try_io_key(w, 1)
+					&& !holepunch_submit_encrypted(w, GFP_NOWAIT)) {
+				percpu_counter_inc(&rd->stats_inline);
+				return DM_MAPIO_SUBMITTED;
+			}
+			if (eraser_queue_io(w))
+				bio_io_error(bio);
 			return DM_MAPIO_SUBMITTED;
 		}
 		else if (bio_data_dir(bio) == READ)
 		{
-			/* First submit the original I/O so that the read
-			 * operation is performed. We will catch completion in a
-			 * callback and do the decryption. */
-			bio_get(bio);
-			clone = bio_clone_fast(bio, GFP_NOIO, rd->bioset);
-			clone->bi_private = w;
-			clone->bi_end_io = &eraser_read_end_io;
-			submit_bio(0, clone);
-			return DM_MAPIO_SUBMITTED;
+			/* First let the read itself be performed. We will catch
+			 * completion in end_io and do the decryption. */
+			w->state = HP_IO_READ;
+			return DM_MAPIO_REMAPPED;
 		}
 	}
 
@@ -1566,7 +3619,8 @@ static int eraser_map_bio(struct dm_target *ti, struct bio *bio)
 
 
 /* The following three functions journal (HOLEPUNCH_JOURNALING) 
- * or write directly otherwise.
+ * or stage async writes otherwise; either way the writes are done by
+ * holepunch_journal_commit.
  * Needs PPRF read lock held. */
 static void holepunch_write_key_table_sector(struct holepunch_dev *rd,
 		struct holepunch_filekey_sector *sector, u64 index)
@@ -1585,7 +3639,7 @@ static void holepunch_write_key_table_sector(struct holepunch_dev *rd,
 #ifdef HOLEPUNCH_JOURNAL
 	holepunch_journal_write(rd, sectorno, data, HPJ_PPRF_PUNCT);
 #else
-	eraser_write_sector(sectorno, data, rd);
+	holepunch_meta_stage(rd, sectorno, data);
 #endif
 	kunmap(p);
 	eraser_free_page(p, rd);
@@ -1608,7 +3662,7 @@ static void holepunch_write_fkt_bottom_sector(struct holepunch_dev *rd,
 #ifdef HOLEPUNCH_JOURNAL
 	holepunch_journal_write(rd, sectorno, map, HPJ_PPRF_PUNCT);
 #else
-	eraser_write_sector(sectorno, map, rd);
+	holepunch_meta_stage(rd, sectorno, map);
 #endif
 
 	sectorno = rd->hp_h->fkt_start + rd->hp_h->fkt_top_width + index;
@@ -1617,7 +3671,7 @@ static void holepunch_write_fkt_bottom_sector(struct holepunch_dev *rd,
 #ifdef HOLEPUNCH_JOURNAL
 	holepunch_journal_write(rd, sectorno, map, HPJ_PPRF_PUNCT);
 #else
-	eraser_write_sector(sectorno, map, rd);
+	holepunch_meta_stage(rd, sectorno, map);
 #endif
 	hp_dbg_incrstate_die(rd, "write fkt bot jnl exit");
 
@@ -1643,7 +3697,7 @@ static void holepunch_write_pprf_key_sector(struct holepunch_dev *rd,
 #ifdef HOLEPUNCH_JOURNAL
 	holepunch_journal_write(rd, sectorno, map, HPJ_PPRF_PUNCT);
 #else
-	eraser_write_sector(sectorno, map, rd);
+	holepunch_meta_stage(rd, sectorno, map);
 #endif
 	hp_dbg_incrstate_die(rd, "write pprf jnl exit");
 
@@ -1651,11 +3705,12 @@ static void holepunch_write_pprf_key_sector(struct holepunch_dev *rd,
 
 
 /*
- * Lock cache bucket from outside, but also pass it in, in case refresh needed.
- * Takes the PPRF write lock.
+ * Entry lock must be held; it is dropped and retaken if a refresh is needed,
+ * which drops the entry. Takes the PPRF write lock. Does not rotate the master key; returns 1 if the
+ * caller still has to, 0 if a PPRF refresh already did.
  */
-static void holepunch_persist_unlink(struct holepunch_dev *rd,
-		struct eraser_map_cache *c, struct semaphore *cache_lock)
+static int __holepunch_persist_unlink(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
 {
 	u32 punctured_index, start_index, end_index;
 	u32 punctured_sector, start_sector, end_sector;
@@ -1671,15 +3726,15 @@ static void holepunch_persist_unlink(struct holepunch_dev *rd,
 		KWORKERMSG("Puncture by refreshing");
 #endif
 		hp_dbg_setstate(rd, 8*STATEUNIT);
-		HP_UP(cache_lock, "PPRF: persist -> refresh");
+		HP_UP(&c->lock, "PPRF: persist -> refresh");
 		/* todo: we should not have to force evict here */
 		// eraser_force_evict_map_cache(rd, 0);
 		HP_DOWN_READ(&rd->pprf_sem, "PPRF: persist -> refresh");
 		++rd->stats_refresh;
 		holepunch_rotate_pprf(rd);
 		HP_UP_READ(&rd->pprf_sem, "PPRF: persist -> refresh");
-		HP_DOWN(cache_lock, "PPRF: reacquire");
-		return;
+		HP_DOWN(&c->lock, "PPRF: reacquire");
+		return 0;
 	}
 
 	HP_DOWN_WRITE(&rd->pprf_sem, "PPRF: persist unlink");
@@ -1741,82 +3796,383 @@ static void holepunch_persist_unlink(struct holepunch_dev *rd,
 			holepunch_write_pprf_key_sector(rd, s, map, false);
 		}
 	}
-	kunmap(p);
-	eraser_free_page(p, rd);
+	kunmap(p);
+	eraser_free_page(p, rd);
+
+	holepunch_write_key_table_sector(rd, c->map, c->sector);
+	holepunch_cache_written(rd, c);
+	c->status = 0;
+	holepunch_cache_refile(rd, c);
+	holepunch_journal_write(rd, 0, rd->hp_h, HPJ_PPRF_PUNCT);
+
+
+	holepunch_journal_commit(rd);
+	HP_UP_WRITE(&rd->pprf_sem, "PPRF: persist unlink");
+	hp_dbg_setstate(rd, 5*STATEUNIT);
+
+#ifdef HOLEPUNCH_DEBUG
+	KWORKERMSG("Persist successful\n");
+#endif
+	return 1;
+}
+
+/* Persist a dirty sector and rotate the master key. */
+static void holepunch_persist_unlink(struct holepunch_dev *rd,
+		struct eraser_map_cache *c)
+{
+	if (__holepunch_persist_unlink(rd, c))
+		holepunch_rotate_master(rd);
+}
+
+/*
+ * Deletion scheduler.
+ */
+
+/* Puts a sample in a log2 histogram. */
+static inline void holepunch_hist_add(u64 *hist, unsigned long v)
+{
+	int b = fls(v);
+
+	if (b >= HP_SCHED_HIST_BUCKETS)
+		b = HP_SCHED_HIST_BUCKETS - 1;
+	++hist[b];
+}
+
+/* Upper bound of the histogram bucket holding the pct-th percentile. */
+static u64 holepunch_hist_percentile(u64 *hist, unsigned pct)
+{
+	u64 total = 0, seen = 0;
+	int b;
+
+	for (b = 0; b < HP_SCHED_HIST_BUCKETS; ++b)
+		total += hist[b];
+	if (!total)
+		return 0;
+
+	for (b = 0; b < HP_SCHED_HIST_BUCKETS - 1; ++b) {
+		seen += hist[b];
+		if (seen * 100 >= total * pct)
+			break;
+	}
+	return (1ULL << b) - 1;
+}
+
+/*
+ * Makes every pending deletion durable: punctures each dirty key table sector
+ * once and rotates the master key once, then records the batch and adapts the
+ * batch window. Deletion lock must be held.
+ */
+static void holepunch_delete_flush(struct holepunch_dev *rd)
+{
+	struct eraser_unlink_work *w, *n;
+	struct eraser_map_cache *c;
+	unsigned long now, min_window;
+	unsigned ms;
+	u64 count = 0;
+	int rotate;
+	LIST_HEAD(batch);
+
+	if (list_empty(&rd->delete_pending))
+		return;
+	list_splice_init(&rd->delete_pending, &batch);
+	rd->delete_dirty = 0;
+	rd->delete_count = 0;
+
+	/*
+	 * Rotate even if the eviction thread punctured our sectors first: its
+	 * own rotation may still be in flight, and the batch is only durable
+	 * once a master key rotation started after the punctures completes.
+	 * A PPRF refresh rotates the master key itself.
+	 */
+	rotate = 1;
+	holepunch_for_each_cache_entry(rd, c) {
+		HP_DOWN(&c->lock, "Sector %llu delete flush", c->sector);
+		/* After a PPRF refresh the rest of the walk finds dead entries. */
+		if (c->status & ERASER_CACHE_DIRTY)
+			rotate = __holepunch_persist_unlink(rd, c);
+		else if (c->status & ERASER_CACHE_REKEYED)
+			holepunch_writeback_cache_entry(rd, c);
+		HP_UP(&c->lock, "Sector %llu delete flush", c->sector);
+	}
+	if (rotate)
+		holepunch_rotate_master(rd);
+
+	now = jiffies;
+	list_for_each_entry_safe(w, n, &batch, list) {
+		ms = jiffies_to_msecs(now - w->queued);
+		holepunch_hist_add(rd->stats_latency_hist, ms);
+		if (ms > rd->stats_latency_max)
+			rd->stats_latency_max = ms;
+		++count;
+		list_del(&w->list);
+		eraser_free_unlink_work(w);
+	}
+	holepunch_hist_add(rd->stats_batch_hist, count);
+	++rd->stats_batches;
+
+	/* Wait longer while unlinks keep arriving, shorter once they do not. */
+	min_window = msecs_to_jiffies(HP_SCHED_MIN_WINDOW_MS);
+	if (count > 1)
+		rd->delete_window = max(rd->delete_window * 2, min_window);
+	else
+		rd->delete_window /= 2;
+	if (rd->delete_window > rd->delete_deadline)
+		rd->delete_window = rd->delete_deadline;
+	if (rd->delete_window < min_window)
+		rd->delete_window = count > 1 ? rd->delete_window : 0;
+
+#ifdef HOLEPUNCH_DEBUG
+	KWORKERMSG("Deletion batch: %llu unlinks, next window %u ms", count,
+			jiffies_to_msecs(rd->delete_window));
+#endif
+}
+
+/*
+ * Flushes pending deletions now if the batch window is closed, too many
+ * unlinks or sectors are pending or the PPRF is running out of room, and otherwise arms
+ * the flush timer so that the oldest deletion is durable by the end of the
+ * window. Deletion lock must be held.
+ */
+static void holepunch_delete_schedule(struct holepunch_dev *rd)
+{
+	unsigned long due;
+	u64 headroom, need;
+
+	if (list_empty(&rd->delete_pending))
+		return;
+
+	headroom = rd->hp_h->pprf_capacity - holepunch_pprf_size_get(rd);
+	need = rd->delete_dirty * 2 * rd->hp_h->pprf_depth;
+	if (!rd->delete_window || rd->delete_dirty >= HP_SCHED_MAX_DIRTY ||
+			rd->delete_count >= HP_SCHED_MAX_PENDING || need >= headroom) {
+		holepunch_delete_flush(rd);
+		return;
+	}
 
-	holepunch_write_key_table_sector(rd, c->map, c->sector);
-	c->status = 0;
-	holepunch_journal_write(rd, 0, rd->hp_h, HPJ_PPRF_PUNCT);
+	due = rd->delete_oldest + rd->delete_window;
+	queue_delayed_work(rd->unlink_queue, &rd->delete_flush_work,
+			time_after(due, jiffies) ? due - jiffies : 0);
+}
 
+static void holepunch_delete_flush_work(struct work_struct *work)
+{
+	struct holepunch_dev *rd = container_of(to_delayed_work(work),
+			struct holepunch_dev, delete_flush_work);
 
-	holepunch_journal_commit(rd);
-	HP_UP_WRITE(&rd->pprf_sem, "PPRF: persist unlink");
-	hp_dbg_setstate(rd, 5*STATEUNIT);
-	holepunch_rotate_master(rd);
+	HP_DOWN(&rd->delete_lock, "Delete: flush timer");
+	holepunch_delete_flush(rd);
+	HP_UP(&rd->delete_lock, "Delete: flush timer");
+}
 
-#ifdef HOLEPUNCH_DEBUG
-	KWORKERMSG("Persist successful\n");
-#endif
+/*
+ * Returns once every unlink queued before the call is irrecoverable: applied,
+ * punctured, and the master key that followed committed to the TPM.
+ */
+static int holepunch_delete_barrier(struct holepunch_dev *rd)
+{
+	flush_work(&rd->unlink_batch_work);
+	HP_DOWN(&rd->delete_lock, "Delete: barrier");
+	holepunch_delete_flush(rd);
+	++rd->stats_barriers;
+	HP_UP(&rd->delete_lock, "Delete: barrier");
+	return holepunch_flush_master_commit(rd);
+}
+
+static int holepunch_unlink_cmp(void *priv, struct list_head *a,
+		struct list_head *b)
+{
+	struct eraser_unlink_work *wa = list_entry(a, struct eraser_unlink_work, list);
+	struct eraser_unlink_work *wb = list_entry(b, struct eraser_unlink_work, list);
+
+	if (wa->ino / HP_KEY_PER_SECTOR < wb->ino / HP_KEY_PER_SECTOR)
+		return -1;
+	return wa->ino / HP_KEY_PER_SECTOR > wb->ino / HP_KEY_PER_SECTOR;
 }
 
-/* Bottom half for unlink operations. */
+/*
+ * Bottom half for unlink operations. Drains everything queued so far, sorted
+ * by key table sector, and re-randomizes all victim keys of each sector in
+ * one go. Sectors with a victim key that was ever used are left dirty for the
+ * deletion scheduler, which re-tags and punctures each of them once per batch.
+ */
 static void holepunch_do_unlink(struct work_struct *work)
 {
+	struct holepunch_dev *rd = container_of(work, struct holepunch_dev,
+			unlink_batch_work);
+	struct eraser_unlink_work *w, *n;
 	struct eraser_map_cache *c;
-	struct semaphore *cache_lock;
-	struct eraser_unlink_work *w = container_of(work, struct eraser_unlink_work, work);
-	
-	c = holepunch_get_cache_entry(w->rd, w->ino, &cache_lock, 0);
+	u8 key[HOLEPUNCH_KEY_LEN];
+	unsigned long flags;
+	u64 sector;
+	int used;
+	LIST_HEAD(batch);
+
+	spin_lock_irqsave(&rd->unlink_lock, flags);
+	list_splice_init(&rd->unlink_list, &batch);
+	spin_unlock_irqrestore(&rd->unlink_lock, flags);
+
+	/* Drop the inode references the probe could not. */
+	list_for_each_entry_safe(w, n, &batch, list) {
+		if (w->inode) {
+			iput(w->inode);
+			w->inode = NULL;
+		}
+		if (!w->unlinked) {
+			list_del(&w->list);
+			eraser_free_unlink_work(w);
+		}
+	}
+
+	list_sort(NULL, &batch, holepunch_unlink_cmp);
+
+	HP_DOWN(&rd->delete_lock, "Delete: apply");
+	while (!list_empty(&batch)) {
+		w = list_first_entry(&batch, struct eraser_unlink_work, list);
+		sector = w->ino / HP_KEY_PER_SECTOR;
+		c = holepunch_lock_cache_entry(rd, w->ino);
+		if (IS_ERR(c)) {
+			/* No unlink may be lost: keep the rest for the next run. */
+			spin_lock_irqsave(&rd->unlink_lock, flags);
+			list_splice(&batch, &rd->unlink_list);
+			spin_unlock_irqrestore(&rd->unlink_lock, flags);
+			queue_work(rd->unlink_queue, &rd->unlink_batch_work);
+			break;
+		}
+
+		list_for_each_entry_safe(w, n, &batch, list) {
+			if (w->ino / HP_KEY_PER_SECTOR != sector)
+				break;
 #ifdef HOLEPUNCH_DEBUG
-	KWORKERMSG("Unlink: %lu/(bucket:%lu)", w->ino, (w->ino/HP_KEY_PER_SECTOR)%ERASER_MAP_CACHE_BUCKETS);
-#endif
-	kernel_random(c->map->entries[w->ino % HP_KEY_PER_SECTOR].key, HOLEPUNCH_KEY_LEN);
-	c->status = ERASER_CACHE_DIRTY;
-	c->last_dirty = jiffies;
-#ifndef HOLEPUNCH_BATCHING
-	holepunch_persist_unlink(w->rd, c, cache_lock);
+			KWORKERMSG("Unlink: %lu/(sector:%llu)", w->ino, sector);
 #endif
-	HP_UP(cache_lock, "Cache: unlink");
-	eraser_free_unlink_work(w);
+			kernel_random(key, HOLEPUNCH_KEY_LEN);
+			spin_lock(&c->key_lock);
+			memcpy(c->map->entries[w->ino % HP_KEY_PER_SECTOR].key, key,
+					HOLEPUNCH_KEY_LEN);
+			holepunch_key_cache_invalidate(rd, w->ino);
+			used = test_and_clear_bit(w->ino, rd->slot_used);
+			spin_unlock(&c->key_lock);
+			++rd->stats_unlink;
+			if (!(c->status & ERASER_CACHE_REKEYED)) {
+				c->status |= ERASER_CACHE_REKEYED;
+				atomic_inc(&rd->cache_unwritten);
+			}
+
+			/* A key that never encrypted anything needs no puncture;
+			 * the new one only has to reach the disk eventually. */
+			if (!used) {
+				++rd->stats_unlink_unused;
+				list_del(&w->list);
+				eraser_free_unlink_work(w);
+				continue;
+			}
+
+			if (c->status & ERASER_CACHE_DIRTY)
+				++rd->stats_unlink_coalesced;
+			else
+				++rd->delete_dirty;
+			c->status |= ERASER_CACHE_DIRTY;
+
+			if (list_empty(&rd->delete_pending) ||
+					time_before(w->queued, rd->delete_oldest))
+				rd->delete_oldest = w->queued;
+			list_move_tail(&w->list, &rd->delete_pending);
+			++rd->delete_count;
+		}
+		holepunch_cache_refile(rd, c);
+		holepunch_unlock_cache_entry(rd, c);
+	}
+	memset(key, 0, HOLEPUNCH_KEY_LEN);
+	holepunch_delete_schedule(rd);
+	HP_UP(&rd->delete_lock, "Delete: apply");
 }
 
 static void eraser_queue_unlink(struct eraser_unlink_work *w)
 {
-	INIT_WORK(&w->work, holepunch_do_unlink);
-	queue_work(w->rd->unlink_queue, &w->work);
+	struct holepunch_dev *rd = w->rd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rd->unlink_lock, flags);
+	list_add_tail(&w->list, &rd->unlink_list);
+	spin_unlock_irqrestore(&rd->unlink_lock, flags);
+	queue_work(rd->unlink_queue, &rd->unlink_batch_work);
 }
 
-/* kprobe for vfs_unlink. */
-static int eraser_unlink_kprobe_entry(struct kprobe *p, struct pt_regs *regs)
+/*
+ * Return probe on vfs_unlink. The entry handler only looks the victim's device
+ * up in holepunch_dev_hash and lets unlinks on any other device go right away
+ * without holding a probe instance. Whether the last link went can only be
+ * told once the unlink is done, since the link count is not stable before
+ * the victim is locked: the entry handler takes an inode reference, and the
+ * return handler queues the work only if the unlink succeeded and no link is
+ * left, so no permission checks need to be repeated here. The work is
+ * allocated up front, so the decision never waits on memory. The device
+ * cannot go away in between, since the file system being unlinked from holds
+ * it open.
+ */
+static int eraser_unlink_probe_entry(struct kretprobe_instance *ri,
+		struct pt_regs *regs)
 {
-	struct holepunch_dev *rd;
-	struct eraser_unlink_work *w;
-	struct inode *dir = (struct inode *)regs->di;
+	struct holepunch_unlink_probe_data *d =
+		(struct holepunch_unlink_probe_data *)ri->data;
 	struct dentry *victim = (struct dentry *)regs->si;
-
 	struct inode *inode = d_backing_inode(victim);
+	struct holepunch_dev *rd;
+	dev_t dev;
 
-	/* Perform all permission checks first, maybe we cannot delete. */
-	if (d_is_negative(victim) || !inode || !inode->i_sb || !inode->i_sb->s_bdev || victim->d_parent->d_inode != dir || inode_permission(dir, MAY_WRITE | MAY_EXEC) || IS_APPEND(dir) || (check_sticky(dir, inode) || IS_APPEND(inode) || IS_IMMUTABLE(inode) || IS_SWAPFILE(inode)) || d_is_dir(victim) || IS_DEADDIR(dir))
-		return 0;
+	if (!inode || !inode->i_sb->s_bdev)
+		return 1;
+	dev = inode->i_sb->s_bdev->bd_dev;
 
-	/* Queue an unlink work for the proper ERASER instance. */
-	list_for_each_entry(rd, &holepunch_dev_list, list)
+	rcu_read_lock();
+	hash_for_each_possible_rcu(holepunch_dev_hash, rd, hash, dev)
 	{
-		if (rd->virt_dev == inode->i_sb->s_bdev->bd_dev)
-		{
-			w = eraser_allocate_unlink_work(inode->i_ino, rd);
-			eraser_queue_unlink(w);
+		if (rd->virt_dev != dev)
+			continue;
+		if (!S_ISREG(inode->i_mode) ||
+				inode->i_ino >= rd->key_table_len * HP_KEY_PER_SECTOR)
+			break;
+		d->w = eraser_allocate_unlink_work(inode->i_ino, rd);
+		if (!d->w) {
+			atomic_inc(&rd->stats_unlink_missed);
 			break;
 		}
+		ihold(inode);
+		d->w->inode = inode;
+		rcu_read_unlock();
+		return 0;
 	}
+	rcu_read_unlock();
+
+	return 1;
+}
 
+static int eraser_unlink_probe_return(struct kretprobe_instance *ri,
+		struct pt_regs *regs)
+{
+	struct holepunch_unlink_probe_data *d =
+		(struct holepunch_unlink_probe_data *)ri->data;
+	struct eraser_unlink_work *w = d->w;
+
+	w->unlinked = !regs_return_value(regs) && !w->inode->i_nlink;
+	/* The caller usually holds a reference too; if not, the last one may
+	 * evict the inode, which can't be done here. */
+	if (atomic_add_unless(&w->inode->i_count, -1, 1))
+		w->inode = NULL;
+
+	if (w->unlinked || w->inode)
+		eraser_queue_unlink(w);
+	else
+		eraser_free_unlink_work(w);
 	return 0;
 }
 
-static struct kprobe eraser_unlink_kprobe = {
-	.symbol_name = "vfs_unlink",
-	.pre_handler = eraser_unlink_kprobe_entry,
+static struct kretprobe eraser_unlink_kretprobe = {
+	.kp.symbol_name = "vfs_unlink",
+	.entry_handler = eraser_unlink_probe_entry,
+	.handler = eraser_unlink_probe_return,
+	.data_size = sizeof(struct holepunch_unlink_probe_data),
+	.maxactive = HOLEPUNCH_UNLINK_PROBE_MAXACTIVE,
 };
 
 /*
@@ -1826,13 +4182,28 @@ static struct kprobe eraser_unlink_kprobe = {
 #define ERASER_NETLINK 31
 #define ERASER_MSG_PAYLOAD (ERASER_NAME_LEN + HOLEPUNCH_KEY_LEN)
 
+/* Retry interval for GET KEY sends that fail, doubled up to the max. Once sent,
+ * the request is repeated if no key has come after the max. */
+#define HP_KEY_RETRY_MIN_MS 10
+#define HP_KEY_RETRY_MAX_MS 3000
+
 enum
 {
 	ERASER_MSG_GET_KEY,
 	ERASER_MSG_SET_KEY,
 	ERASER_MSG_DIE,
+	ERASER_MSG_HELPER_READY, /* Helper is listening; payload has no key. */
+	ERASER_MSG_SET_KEY_FAIL, /* Helper could not write the key it echoes. */
 };
 
+/* A master key that can't be sent, or that the helper fails to write, is
+ * retried this many times, HP_MASTER_COMMIT_RETRY_MS apart and then further.
+ * Waits for a commit give up after HP_MASTER_COMMIT_TIMEOUT. Either way the
+ * device then fails all I/O, as deletions can no longer be made durable. */
+#define HP_MASTER_COMMIT_TRIES 5
+#define HP_MASTER_COMMIT_RETRY_MS 100
+#define HP_MASTER_COMMIT_TIMEOUT (30 * HZ)
+
 static struct sock *eraser_sock;
 
 /* Rather, we ask it to die nicely. */
@@ -1883,6 +4254,7 @@ static int eraser_get_master_key(struct holepunch_dev *rd)
 	memcpy(payload, rd->eraser_name, ERASER_NAME_LEN);
 
 	/* Send! */
+	++rd->stats_key_requests;
 	if (nlmsg_unicast(eraser_sock, skb_out, rd->helper_pid) != 0)
 	{
 		DMWARN("Cannot send GET KEY.");
@@ -1892,6 +4264,41 @@ static int eraser_get_master_key(struct holepunch_dev *rd)
 	return ERASER_SUCCESS;
 }
 
+/*
+ * Waits for the master key requested with eraser_get_master_key; sent says
+ * whether that request went out. The netlink callback completes
+ * master_key_wait when the key arrives, and also when the helper reports that
+ * it is listening, so that a request it missed is sent again right away. Only
+ * failed sends are retried on a timer.
+ */
+static void holepunch_wait_master_key(struct holepunch_dev *rd, int sent)
+{
+	unsigned backoff = HP_KEY_RETRY_MIN_MS;
+	unsigned timeout;
+
+	while (!test_bit(ERASER_KEY_GOT_KEY, &rd->master_key_status))
+	{
+		if (test_and_clear_bit(ERASER_KEY_HELPER_READY, &rd->master_key_status)) {
+			sent = 0;
+			backoff = HP_KEY_RETRY_MIN_MS;
+		}
+		if (!sent)
+			sent = eraser_get_master_key(rd) == ERASER_SUCCESS;
+
+		if (sent) {
+			timeout = HP_KEY_RETRY_MAX_MS;
+		} else {
+			timeout = backoff;
+			backoff = min(2 * backoff, (unsigned) HP_KEY_RETRY_MAX_MS);
+		}
+		if (!wait_for_completion_timeout(&rd->master_key_wait,
+				msecs_to_jiffies(timeout)) && sent) {
+			DMINFO("Waiting for master key.");
+			sent = 0;
+		}
+	}
+}
+
 /* Sync a new master key. */
 static int eraser_set_master_key(struct holepunch_dev *rd)
 {
@@ -1925,6 +4332,127 @@ static int eraser_set_master_key(struct holepunch_dev *rd)
 	return ERASER_SUCCESS;
 }
 
+/*
+ * Master key commit queue. Rotations update rd->master_key immediately and only
+ * queue the TPM write; while one key is in flight, newer keys coalesce so that
+ * only the newest is sent once the helper acknowledges.
+ */
+/* Puts the device in the error state; waiters for commits give up. */
+static void holepunch_fail(struct holepunch_dev *rd, const char *why)
+{
+	if (!xchg(&rd->failed, 1))
+		DMERR("%s: %s; failing all I/O", rd->eraser_name, why);
+	wake_up_all(&rd->master_commit_wait);
+}
+
+static void holepunch_master_commit_work(struct work_struct *work)
+{
+	struct holepunch_dev *rd = container_of(work, struct holepunch_dev,
+			master_commit_work);
+	unsigned tries;
+
+	if (rd->master_commit_tries)
+		msleep(HP_MASTER_COMMIT_RETRY_MS * rd->master_commit_tries);
+
+	spin_lock(&rd->master_commit_lock);
+	if (READ_ONCE(rd->failed) ||
+			test_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status) ||
+			rd->master_commit_done == rd->master_commit_queued) {
+		spin_unlock(&rd->master_commit_lock);
+		return;
+	}
+	memcpy(rd->new_master_key, rd->master_key, HOLEPUNCH_KEY_LEN);
+	rd->stats_master_coalesced += rd->master_commit_queued - rd->master_commit_done - 1;
+	++rd->stats_master_commits;
+	rd->master_commit_sent = rd->master_commit_queued;
+	set_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status);
+	spin_unlock(&rd->master_commit_lock);
+
+	for (tries = 1; eraser_set_master_key(rd) != ERASER_SUCCESS; ++tries) {
+		if (tries == HP_MASTER_COMMIT_TRIES) {
+			holepunch_fail(rd, "Cannot send master key to the helper");
+			return;
+		}
+		msleep(HP_MASTER_COMMIT_RETRY_MS);
+	}
+}
+
+/* Called on a SET ACK from the helper; key is the key it wrote. */
+static void holepunch_master_commit_ack(struct holepunch_dev *rd, u8 *key)
+{
+	int more;
+
+	spin_lock(&rd->master_commit_lock);
+	if (!test_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status) ||
+			memcmp(key, rd->new_master_key, HOLEPUNCH_KEY_LEN)) {
+		spin_unlock(&rd->master_commit_lock);
+		DMWARN("Received unsolicited ACK. Dropping.");
+		return;
+	}
+	memcpy(rd->tpm_master_key, rd->new_master_key, HOLEPUNCH_KEY_LEN);
+	rd->master_commit_done = rd->master_commit_sent;
+	rd->master_commit_tries = 0;
+	clear_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status);
+	more = rd->master_commit_done != rd->master_commit_queued;
+	spin_unlock(&rd->master_commit_lock);
+
+	if (more)
+		schedule_work(&rd->master_commit_work);
+	wake_up_all(&rd->master_commit_wait);
+}
+
+/* Called on a SET NACK from the helper; the key is sent again, if it is
+ * still worth it, after a while. */
+static void holepunch_master_commit_nack(struct holepunch_dev *rd, u8 *key)
+{
+	unsigned tries;
+
+	spin_lock(&rd->master_commit_lock);
+	if (!test_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status) ||
+			memcmp(key, rd->new_master_key, HOLEPUNCH_KEY_LEN)) {
+		spin_unlock(&rd->master_commit_lock);
+		DMWARN("Received unsolicited NACK. Dropping.");
+		return;
+	}
+	tries = ++rd->master_commit_tries;
+	clear_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status);
+	spin_unlock(&rd->master_commit_lock);
+
+	DMWARN("Helper could not write the master key (%u/%u).", tries,
+			HP_MASTER_COMMIT_TRIES);
+	if (tries >= HP_MASTER_COMMIT_TRIES)
+		holepunch_fail(rd, "Cannot write master key to the TPM");
+	else
+		schedule_work(&rd->master_commit_work);
+}
+
+static bool holepunch_master_committed(struct holepunch_dev *rd)
+{
+	bool r;
+
+	spin_lock(&rd->master_commit_lock);
+	r = rd->master_commit_done == rd->master_commit_queued;
+	spin_unlock(&rd->master_commit_lock);
+	return r;
+}
+
+/* Wait until the newest master key has reached the TPM. Returns -EIO if it
+ * can't, with the device failed. */
+static int holepunch_flush_master_commit(struct holepunch_dev *rd)
+{
+	unsigned long end = jiffies + HP_MASTER_COMMIT_TIMEOUT;
+
+	while (!wait_event_timeout(rd->master_commit_wait,
+			holepunch_master_committed(rd) || READ_ONCE(rd->failed), 3 * HZ)) {
+		if (time_after(jiffies, end)) {
+			holepunch_fail(rd, "Timed out waiting for master key commit");
+			break;
+		}
+		DMINFO("Waiting for master key commit.");
+	}
+	return holepunch_master_committed(rd) ? 0 : -EIO;
+}
+
 /* Netlink message receive callback. */
 static void eraser_netlink_recv(struct sk_buff *skb_in)
 {
@@ -1933,6 +4461,7 @@ static void eraser_netlink_recv(struct sk_buff *skb_in)
 	unsigned char *payload;
 	int len;
 	u8 name[ERASER_NAME_LEN + 1];
+	u8 key[HOLEPUNCH_KEY_LEN];
 	int found;
 
 	h = (struct nlmsghdr *)skb_in->data;
@@ -1962,7 +4491,9 @@ static void eraser_netlink_recv(struct sk_buff *skb_in)
 
 	if (!found)
 	{
-		DMERR("Message to unknown device.");
+		/* Helpers start before their device. */
+		if (h->nlmsg_type != ERASER_MSG_HELPER_READY)
+			DMERR("Message to unknown device.");
 		return;
 	}
 
@@ -1984,21 +4515,32 @@ static void eraser_netlink_recv(struct sk_buff *skb_in)
 			DMWARN("Received unsolicited key. Dropping.");
 		}
 	}
+	else if (h->nlmsg_type == ERASER_MSG_HELPER_READY)
+	{
+		if (test_bit(ERASER_KEY_GET_REQUESTED, &rd->master_key_status))
+		{
+			set_bit(ERASER_KEY_HELPER_READY, &rd->master_key_status);
+			complete(&rd->master_key_wait);
+		}
+	}
 	else if (h->nlmsg_type == ERASER_MSG_SET_KEY)
 	{
-		/* We got confirmation that master key is synched to the vault. */
+		/* We got confirmation that master key is synched to the vault. The
+		 * helper echoes the key it wrote, so stale ACKs can be told apart. */
 #ifdef HOLEPUNCH_DEBUG
 		DMINFO("Received key sync ACK.");
 #endif
-		if (test_and_clear_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status))
-		{
-			set_bit(ERASER_KEY_READY_TO_REFRESH, &rd->master_key_status);
-			complete(&rd->master_key_wait);
-		}
-		else
-		{
-			DMWARN("Received unsolicited ACK. Dropping.");
-		}
+		holepunch_ecb(rd, key, payload + ERASER_NAME_LEN,
+					  HOLEPUNCH_KEY_LEN, HOLEPUNCH_DECRYPT, rd->sec_key);
+		holepunch_master_commit_ack(rd, key);
+		memset(key, 0, HOLEPUNCH_KEY_LEN);
+	}
+	else if (h->nlmsg_type == ERASER_MSG_SET_KEY_FAIL)
+	{
+		holepunch_ecb(rd, key, payload + ERASER_NAME_LEN,
+					  HOLEPUNCH_KEY_LEN, HOLEPUNCH_DECRYPT, rd->sec_key);
+		holepunch_master_commit_nack(rd, key);
+		memset(key, 0, HOLEPUNCH_KEY_LEN);
 	}
 	else
 	{
@@ -2009,7 +4551,7 @@ static void eraser_netlink_recv(struct sk_buff *skb_in)
 	 * properly! */
 }
 
-// TODO this could be simpler (one netlink send function too)
+/* Queue a new master key for the TPM; returns without waiting for the helper. */
 static void holepunch_tpm_set_master(struct holepunch_dev *rd, u8 *new_key)
 {
 #ifdef HOLEPUNCH_DEBUG
@@ -2030,20 +4572,15 @@ static void holepunch_tpm_set_master(struct holepunch_dev *rd, u8 *new_key)
 
 #endif
 	hp_dbg_incrstate_die(rd, "before set tpm");
-	memcpy(rd->new_master_key, new_key, HOLEPUNCH_KEY_LEN);
-	__set_bit(ERASER_KEY_SET_REQUESTED, &rd->master_key_status);
-	while (eraser_set_master_key(rd))
-	{
-		msleep(100);
-	}
-	msleep(10);
-	hp_dbg_incrstate_die(rd, "waiting for tpm reply");
-
-	while (!test_and_clear_bit(ERASER_KEY_READY_TO_REFRESH, &rd->master_key_status))
-	{
-		wait_for_completion_timeout(&rd->master_key_wait, 1 * HZ);
-	}
-	memcpy(rd->master_key, rd->new_master_key, HOLEPUNCH_KEY_LEN);
+	/* The on-disk state already depends on the new key, so switch to it now and
+	 * let the TPM catch up in the background. */
+	spin_lock(&rd->master_commit_lock);
+	memcpy(rd->master_key, new_key, HOLEPUNCH_KEY_LEN);
+	++rd->master_commit_queued;
+	spin_unlock(&rd->master_commit_lock);
+	hp_dbg_incrstate_die(rd, "queued tpm commit");
+
+	schedule_work(&rd->master_commit_work);
 	hp_dbg_incrstate_die(rd, "after set tpm");
 
 }
@@ -2060,14 +4597,28 @@ static struct netlink_kernel_cfg eraser_netlink_cfg =
 /*
  * Constructor.
  */
+/* Charge the time since *t to a mount phase. */
+static void holepunch_mount_phase(struct holepunch_dev *rd,
+		enum holepunch_mount_phase phase, u64 *t)
+{
+	u64 now = ktime_get_ns();
+
+	rd->stats_mount_ns[phase] += now - *t;
+	*t = now;
+}
+
 static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct holepunch_dev *rd;
 	char dummy;
 	int helper_pid, i;
-	u8 hash[HP_HASH_LEN];
+	unsigned deadline_ms, budget_kb;
+	int pin = 0;
 	u8 new_key[HOLEPUNCH_KEY_LEN];
 	int need_master_rot = 0;
+	int key_sent;
+	struct holepunch_load fkt_top, fkt_bottom, pprf;
+	u64 t, mount_start;
 
 	/*
 	 * argv[0]: real block device path
@@ -2075,14 +4626,18 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	 * argv[2]: hex key
 	 * argv[3]: virtual device path
 	 * argv[4]: helper pid
+	 * argv[5]: optional, deletion deadline in msecs
+	 * argv[6]: optional, map cache budget in KiB
+	 * argv[7]: optional, "pinned" to keep the whole key table in memory
 	 */
-	if (argc != 5)
+	if (argc < 5 || argc > 8)
 	{
 		ti->error = "Invalid argument count.";
 		return -EINVAL;
 	}
 
 	DMINFO("Creating ERASER on %s", argv[0]);
+	mount_start = t = ktime_get_ns();
 
 	if (sscanf(argv[4], "%d%c", &helper_pid, &dummy) != 1)
 	{
@@ -2091,6 +4646,45 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 	DMINFO("Helper PID: %d", helper_pid);
 
+	/* Table lines leave the key out; the user tool has to supply it. */
+	if (!strcmp(argv[2], "-"))
+	{
+		ti->error = "Key not given.";
+		return -EINVAL;
+	}
+	/* The key must be whole. */
+	if (strlen(argv[2]) != 2 * HOLEPUNCH_KEY_LEN ||
+			hex2bin(new_key, argv[2], HOLEPUNCH_KEY_LEN))
+	{
+		ti->error = "Invalid key.";
+		return -EINVAL;
+	}
+	memset(new_key, 0, HOLEPUNCH_KEY_LEN);
+
+	deadline_ms = delete_deadline_ms;
+	if (argc >= 6 && sscanf(argv[5], "%u%c", &deadline_ms, &dummy) != 1)
+	{
+		ti->error = "Invalid deletion deadline.";
+		return -EINVAL;
+	}
+
+	budget_kb = cache_budget_kb;
+	if (argc >= 7 && sscanf(argv[6], "%u%c", &budget_kb, &dummy) != 1)
+	{
+		ti->error = "Invalid cache budget.";
+		return -EINVAL;
+	}
+
+	if (argc == 8)
+	{
+		if (strcasecmp(argv[7], "pinned"))
+		{
+			ti->error = "Invalid key table mode.";
+			return -EINVAL;
+		}
+		pin = 1;
+	}
+
 	/* Lock everything until we make sure this device is create-able. */
 	down(&holepunch_dev_lock);
 
@@ -2111,19 +4705,21 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 
 	rd->helper_pid = helper_pid;
 	atomic_set(&rd->shutdown, 0);
+	rd->failed = 0;
+	rd->unlink_missed = eraser_unlink_kretprobe.nmissed;
 	atomic_set(&rd->jobs, 0);
 
 	/* Decode disk encryption key. */
-	// TODO add error checking for kalloc failing or invalid hex (could probably
-	// also make key fixed-length instead of kallocing)
+	// TODO add error checking for kalloc failing (could probably also make key
+	// fixed-length instead of kallocing)
 	rd->sec_key = eraser_hex_decode(argv[2]);
 	/* We don't need the key argument anymore, wipe it clean. */
 	memset(argv[2], 0, strlen(argv[2]));
 
 	/* Initialize crypto. */
 	rd->cpus = num_online_cpus();
-	rd->ecb_tfm = kmalloc(rd->cpus * sizeof *rd->ecb_tfm, GFP_KERNEL);
-	for (i = 0; i < rd->cpus; ++i)
+	rd->ecb_tfm = kmalloc(2 * rd->cpus * sizeof *rd->ecb_tfm, GFP_KERNEL);
+	for (i = 0; i < 2 * rd->cpus; ++i)
 	{
 		rd->ecb_tfm[i] = crypto_alloc_blkcipher("ecb(aes)", 0, 0);
 		if (IS_ERR(rd->ecb_tfm[i]))
@@ -2132,8 +4728,8 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			goto init_ecb_tfm_fail;
 		}
 	}
-	rd->cbc_tfm = kmalloc(rd->cpus * sizeof *rd->cbc_tfm, GFP_KERNEL);
-	for (i = 0; i < rd->cpus; ++i)
+	rd->cbc_tfm = kmalloc(2 * rd->cpus * sizeof *rd->cbc_tfm, GFP_KERNEL);
+	for (i = 0; i < 2 * rd->cpus; ++i)
 	{
 		rd->cbc_tfm[i] = crypto_alloc_blkcipher("cbc(aes)", 0, 0);
 		if (IS_ERR(rd->cbc_tfm[i]))
@@ -2164,20 +4760,19 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		rd->prg_input[i] = i;
 	}
 
-	/* Get the master key. */
+	/* Ask for the master key. It is not needed until the metadata has been
+	 * read, so the helper answers while we set up. */
 	init_completion(&rd->master_key_wait);
+	spin_lock_init(&rd->master_commit_lock);
+	INIT_WORK(&rd->master_commit_work, holepunch_master_commit_work);
+	init_waitqueue_head(&rd->master_commit_wait);
+	rd->master_commit_queued = 0;
+	rd->master_commit_sent = 0;
+	rd->master_commit_done = 0;
+	rd->master_commit_tries = 0;
 	rd->master_key_status = 0;
 	__set_bit(ERASER_KEY_GET_REQUESTED, &rd->master_key_status);
-	while (eraser_get_master_key(rd) != ERASER_SUCCESS)
-	{
-		DMWARN("Cannot send GET master key. Will retry.");
-		msleep(3000);
-	}
-	while (!test_bit(ERASER_KEY_GOT_KEY, &rd->master_key_status))
-	{
-		DMINFO("Waiting for master key.");
-		wait_for_completion_timeout(&rd->master_key_wait, 3 * HZ);
-	}
+	key_sent = eraser_get_master_key(rd) == ERASER_SUCCESS;
 
 	/* Create bioset and page pool. */
 	rd->bioset = bioset_create(ERASER_BIOSET_SIZE, 0);
@@ -2202,7 +4797,12 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Bad header length.";
 		goto read_header_fail;
 	}
-	if (rd->hp_h->key_table_start - rd->hp_h->journal_start != HP_JOURNAL_LEN)
+	/* Newer volumes keep the hot list right after the journal. */
+	rd->hot_sector = 0;
+	if (rd->hp_h->key_table_start - rd->hp_h->journal_start == HP_JOURNAL_LEN + 1
+			&& rd->hp_h->hot_start == rd->hp_h->journal_start + HP_JOURNAL_LEN)
+		rd->hot_sector = rd->hp_h->hot_start;
+	else if (rd->hp_h->key_table_start - rd->hp_h->journal_start != HP_JOURNAL_LEN)
 	{
 		ti->error = "Bad journal length.";
 		goto read_header_fail;
@@ -2245,26 +4845,21 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 #endif
 
 	/* Work caches and queues. */
-	rd->_io_work_pool = KMEM_CACHE(eraser_io_work, 0);
-	if (!rd->_io_work_pool)
-	{
-		ti->error = "Could not create io cache.";
-		goto create_io_cache_fail;
-	}
-
-	rd->io_work_pool = mempool_create_slab_pool(ERASER_IO_WORK_POOL_SIZE, rd->_io_work_pool);
-	if (!rd->io_work_pool)
-	{
-		ti->error = "Could not create io pool.";
-		goto create_io_pool_fail;
-	}
-
 	rd->io_queue = create_workqueue("eraser_io");
 	if (!rd->io_queue)
 	{
 		ti->error = "Could not create io queue.";
 		goto create_io_queue_fail;
 	}
+	if (holepunch_start_crypto_workers(rd))
+	{
+		ti->error = "Could not start crypto workers.";
+		goto start_crypto_workers_fail;
+	}
+	spin_lock_init(&rd->flush_lock);
+	bio_list_init(&rd->flush_bios);
+	INIT_WORK(&rd->flush_work, holepunch_do_flush);
+	atomic_set(&rd->cache_unwritten, 0);
 
 	rd->_unlink_work_pool = KMEM_CACHE(eraser_unlink_work, 0);
 	if (!rd->_unlink_work_pool)
@@ -2286,6 +4881,18 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Could not create unlink queue.";
 		goto create_unlink_queue_fail;
 	}
+	spin_lock_init(&rd->unlink_lock);
+	INIT_LIST_HEAD(&rd->unlink_list);
+	INIT_WORK(&rd->unlink_batch_work, holepunch_do_unlink);
+
+	sema_init(&rd->delete_lock, 1);
+	INIT_LIST_HEAD(&rd->delete_pending);
+	INIT_DELAYED_WORK(&rd->delete_flush_work, holepunch_delete_flush_work);
+	rd->delete_deadline = msecs_to_jiffies(deadline_ms);
+	rd->delete_window = 0;
+	rd->delete_dirty = 0;
+	rd->delete_count = 0;
+	DMINFO("Deletion deadline: %u ms", deadline_ms);
 
 	rd->_map_cache_pool = KMEM_CACHE(eraser_map_cache, 0);
 	if (!rd->_map_cache_pool)
@@ -2301,13 +4908,90 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto create_map_cache_pool_fail;
 	}
 
-	for (i = 0; i < ERASER_MAP_CACHE_BUCKETS; ++i)
+	if (rhashtable_init(&rd->map_cache, &holepunch_cache_params))
+	{
+		ti->error = "Could not create map cache table.";
+		goto init_map_cache_fail;
+	}
+
+	if (percpu_counter_init(&rd->map_cache_count, 0, GFP_KERNEL))
+	{
+		ti->error = "Could not create map cache counter.";
+		goto init_map_cache_count_fail;
+	}
+
+	if (percpu_counter_init(&rd->stats_cache_hit, 0, GFP_KERNEL))
 	{
-		INIT_LIST_HEAD(&rd->map_cache_list[i]);
-		sema_init(&rd->cache_lock[i], 1);
+		ti->error = "Could not create map cache counter.";
+		goto init_cache_hit_fail;
+	}
+
+	if (percpu_counter_init(&rd->stats_cache_miss, 0, GFP_KERNEL))
+	{
+		ti->error = "Could not create map cache counter.";
+		goto init_cache_miss_fail;
+	}
+
+	if (percpu_counter_init(&rd->stats_key_hit, 0, GFP_KERNEL))
+	{
+		ti->error = "Could not create key cache counter.";
+		goto init_key_hit_fail;
+	}
+
+	if (percpu_counter_init(&rd->stats_inline, 0, GFP_KERNEL))
+	{
+		ti->error = "Could not create inline I/O counter.";
+		goto init_inline_fail;
+	}
+
+	rd->map_cache_ghost = vzalloc(HP_CACHE_GHOSTS * sizeof(struct holepunch_cache_ghost));
+	if (!rd->map_cache_ghost)
+	{
+		ti->error = "Could not allocate map cache ghosts.";
+		goto alloc_cache_ghost_fail;
+	}
+
+	rd->key_cache = vmalloc(HP_KEY_CACHE_SLOTS * sizeof(struct holepunch_key_slot));
+	if (!rd->key_cache)
+	{
+		ti->error = "Could not allocate key cache.";
+		goto alloc_key_cache_fail;
+	}
+	for (i = 0; i < HP_KEY_CACHE_SLOTS; ++i) {
+		RCU_INIT_POINTER(rd->key_cache[i].h, NULL);
+		spin_lock_init(&rd->key_cache[i].lock);
+		rd->key_cache[i].gen = 0;
 	}
 
-	rd->map_cache_count = 0;
+	spin_lock_init(&rd->map_cache_lock);
+	INIT_LIST_HEAD(&rd->map_cache_list);
+	INIT_LIST_HEAD(&rd->map_cache_a1in);
+	INIT_LIST_HEAD(&rd->map_cache_am);
+	rd->map_cache_a1in_len = 0;
+	INIT_LIST_HEAD(&rd->map_cache_dirty);
+	rd->map_cache_dirty_len = 0;
+	init_waitqueue_head(&rd->cache_wait);
+	rd->cache_kick = 0;
+	rd->hot_saved = jiffies;
+	INIT_WORK(&rd->warm_work, holepunch_warm_cache);
+	spin_lock_init(&rd->ra_lock);
+	INIT_WORK(&rd->ra_work, holepunch_readahead_work);
+	rd->ra_last = rd->ra_next = rd->ra_mark = ~0ULL;
+	rd->ra_nr = 0;
+	rd->ra_window = 0;
+	rd->map_cache_ghost_next = 0;
+	hash_init(rd->map_cache_ghost_hash);
+	holepunch_cache_set_budget(rd, budget_kb);
+	DMINFO("Cache budget: %u KiB", budget_kb);
+
+	rd->cache_shrinker.count_objects = holepunch_cache_shrink_count;
+	rd->cache_shrinker.scan_objects = holepunch_cache_shrink_scan;
+	rd->cache_shrinker.seeks = DEFAULT_SEEKS;
+	if (register_shrinker(&rd->cache_shrinker))
+	{
+		ti->error = "Could not register map cache shrinker.";
+		goto register_shrinker_fail;
+	}
 
 #ifdef HOLEPUNCH_DEBUG
 	rd->state = 0;
@@ -2316,17 +5000,66 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	/* Journal recovery, if necessary. */
 	rd->journal_entry = 0;
 	rd->journal = eraser_read_sector(rd->hp_h->journal_start, NULL, rd);
+	/* Every control block write carries the record; keep the one on disk. */
+	memcpy(&rd->master_rec, (void *)rd->journal + HPJ_MASTER_REC_OFFSET,
+			sizeof(rd->master_rec));
 #ifdef HOLEPUNCH_DEBUG
 	DMINFO("Journal state: %llu\n", rd->journal[0]);
 
 	/* PPRF key and FKT. */
 	DMINFO("Allocating %llu bytes for FKT", rd->fkt_len*ERASER_SECTOR);
 #endif
+	/* Any key may have been used before this mount. */
+	rd->slot_used_len = BITS_TO_LONGS(rd->key_table_len * HP_KEY_PER_SECTOR)
+			* sizeof(unsigned long);
+	rd->slot_used = vmalloc(rd->slot_used_len);
+	if (!rd->slot_used) {
+		ti->error = "Could not allocate key slot map.";
+		goto alloc_slot_used_fail;
+	}
+	memset(rd->slot_used, 0xff, rd->slot_used_len);
+
 	rd->pprf_fkt = vmalloc(rd->fkt_len * ERASER_SECTOR);
 	if (!rd->pprf_fkt) {
 		ti->error = "Could not allocate pprf fkt.";
 		goto alloc_pprf_fkt_fail;
 	}
+#ifdef HOLEPUNCH_JOURNAL
+	rd->journal_data = vmalloc(HP_JOURNAL_LEN * ERASER_SECTOR);
+	if (!rd->journal_data) {
+		ti->error = "Could not allocate journal buffer.";
+		goto alloc_journal_data_fail;
+	}
+	rd->master_rot_data = vmalloc(rd->hp_h->fkt_top_width * ERASER_SECTOR);
+	if (!rd->master_rot_data) {
+		ti->error = "Could not allocate master rotation buffer.";
+		goto alloc_master_rot_data_fail;
+	}
+#endif
+	holepunch_meta_batch_init(&rd->meta_stage);
+	INIT_LIST_HEAD(&rd->meta_stage_pages);
+
+	/* Start reading the FKT; it is decrypted as soon as the master key is
+	 * final. After a crash in a master rotation it is read later instead. */
+	if (rd->journal[0] != HPJ_MASTER_ROT)
+		holepunch_read_fkt_start(rd, &fkt_top, &fkt_bottom, 1);
+	holepunch_mount_phase(rd, HP_MOUNT_SETUP, &t);
+
+	holepunch_wait_master_key(rd, key_sent);
+	memcpy(rd->tpm_master_key, rd->master_key, HOLEPUNCH_KEY_LEN);
+
+	/* A crash may have left the newest master key queued but not yet in the
+	 * TPM; the FKT on disk already depends on it, so commit it first. Master
+	 * rotations in progress are recovered from their journal entry below. */
+	if (rd->journal[0] != HPJ_MASTER_ROT &&
+			holepunch_master_record_resolve(rd, rd->journal, new_key)) {
+		DMINFO("Recovering pending master key commit");
+		holepunch_tpm_set_master(rd, new_key);
+		holepunch_flush_master_commit(rd);
+	}
+	if (rd->journal[0] != HPJ_MASTER_ROT)
+		holepunch_load_release(&fkt_top);
+	holepunch_mount_phase(rd, HP_MOUNT_KEY, &t);
 
 	switch(rd->journal[0])
 	{	
@@ -2338,9 +5071,9 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			goto skip_pprf_load;
 	}
 	
-	holepunch_read_fkt(rd);
-	holepunch_dump_fkt(rd);
-
+	/* The PPRF key can be read as soon as the top level FKT, which holds its
+	 * size, is in; its sectors are decrypted once the bottom level is. */
+	holepunch_load_wait(&fkt_top);
 
 	if (likely(rd->hp_h->in_use)) {
 		rd->pprf_key_capacity = round_up(2 * holepunch_pprf_size_get(rd), HP_PPRF_PER_SECTOR);
@@ -2352,6 +5085,7 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 #endif
 	rd->pprf_key = vmalloc(rd->pprf_key_capacity * sizeof(struct pprf_keynode));
 	if (!rd->pprf_key) {
+		holepunch_read_fkt_finish(rd, &fkt_top, &fkt_bottom);
 		ti->error = "Could not allocate pprf key.";
 		goto alloc_pprf_key_fail;
 	}
@@ -2365,19 +5099,29 @@ static int eraser_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		 */
 		case HPJ_PPRF_INIT:
 		case HPJ_PPRF_ROT:
+			holepunch_read_fkt_finish(rd, &fkt_top, &fkt_bottom);
 			goto skip_pprf_load;
 	}
 
 	if (likely(rd->hp_h->in_use)) {
-		holepunch_read_pprf(rd);
+		if (holepunch_read_pprf_start(rd, &pprf, &fkt_bottom)) {
+			holepunch_read_fkt_finish(rd, &fkt_top, &fkt_bottom);
+			ti->error = "Could not allocate pprf key buffer.";
+			goto read_pprf_fail;
+		}
+		holepunch_read_fkt_finish(rd, &fkt_top, &fkt_bottom);
+		holepunch_read_pprf_finish(rd, &pprf);
 		// DMINFO("PPRF state before crash recovery\n");
 		// print_pprf(rd->pprf_key, holepunch_pprf_size_get(rd));
 	} else {
+		holepunch_read_fkt_finish(rd, &fkt_top, &fkt_bottom);
 		rd->pprf_key->type = PPRF_KEYLEAF;
 		// memset(rd->pprf_key->v.key, 0, PRG_INPUT_LEN);
 	}
+	holepunch_dump_fkt(rd);
 
 skip_pprf_load:
+	holepunch_mount_phase(rd, HP_MOUNT_LOAD, &t);
 
 
 	switch (rd->journal[0])
@@ -2386,13 +5130,10 @@ skip_pprf_load:
 		break;
 	case HPJ_MASTER_ROT:
 		DMINFO("Recovering master key rotation");
-		holepunch_hash(rd, rd->master_key, HOLEPUNCH_KEY_LEN, hash);
-		if (!memcmp(hash, (void *)rd->journal + 8 + HOLEPUNCH_KEY_LEN, HP_HASH_LEN))
+		if (holepunch_master_record_resolve(rd, rd->journal, new_key))
 		{
-			/* TPM still contains old key. */
-			holepunch_ecb(rd, new_key, rd->journal + 1, HOLEPUNCH_KEY_LEN,
-					HOLEPUNCH_DECRYPT, rd->master_key);
-			holepunch_do_master_rotation(rd, new_key);
+			/* TPM still contains an old key. */
+			holepunch_recover_master_rotation(rd, new_key);
 		}
 		goto read_fkt;
 	case HPJ_PPRF_ROT:
@@ -2436,7 +5177,7 @@ skip_pprf_load:
 		}
 	journal_clear:
 		rd->journal[0] = HPJ_NONE;
-		eraser_write_sector(rd->hp_h->journal_start, rd->journal, rd);
+		holepunch_journal_write_control(rd, rd->journal);
 		// DMINFO("\nPPRF state after rotation/initialization\n");
 		// print_pprf(rd->pprf_key, holepunch_pprf_size_get(rd));
 		break;
@@ -2456,6 +5197,12 @@ skip_pprf_load:
 		DMINFO("Rotating master on crash recovery\n");
 		holepunch_rotate_master(rd);
 	}
+	holepunch_mount_phase(rd, HP_MOUNT_RECOVERY, &t);
+
+	if (pin) {
+		holepunch_pin_key_table(rd);
+		holepunch_mount_phase(rd, HP_MOUNT_LOAD, &t);
+	}
 
 	rd->evict_map_cache_thread = kthread_run(&holepunch_evict_map_cache, rd, "holepunch_evict");
 	if (IS_ERR(rd->evict_map_cache_thread))
@@ -2473,11 +5220,29 @@ skip_pprf_load:
 	strcpy(rd->virt_dev_path, argv[3]);
 
 	ti->num_discard_bios = 1;
+	ti->num_flush_bios = 1;
+	ti->per_io_data_size = sizeof(struct eraser_io_work);
 	ti->private = rd;
 
 	rd->stats_evaluate = 0;
 	rd->stats_puncture = 0;
 	rd->stats_refresh = 0;
+
+	/* Start catching unlinks on the virtual device. */
+	rd->virt_dev = disk_devt(dm_disk(dm_table_get_md(ti->table)));
+	down(&holepunch_dev_lock);
+	hash_add_rcu(holepunch_dev_hash, &rd->hash, rd->virt_dev);
+	up(&holepunch_dev_lock);
+	holepunch_start_warmup(rd);
+	DMINFO("Mounted in %llu ms: setup %llu, key %llu, load %llu, recovery %llu",
+			(ktime_get_ns() - mount_start) / NSEC_PER_MSEC,
+			rd->stats_mount_ns[HP_MOUNT_SETUP] / NSEC_PER_MSEC,
+			rd->stats_mount_ns[HP_MOUNT_KEY] / NSEC_PER_MSEC,
+			rd->stats_mount_ns[HP_MOUNT_LOAD] / NSEC_PER_MSEC,
+			rd->stats_mount_ns[HP_MOUNT_RECOVERY] / NSEC_PER_MSEC);
+#ifdef HOLEPUNCH_META_BENCH
+	holepunch_meta_benchmark(rd);
+#endif
 #ifdef HOLEPUNCH_DEBUG
 	dump_key(rd->master_key, "Master key");
 	dump_key(rd->sec_key, "Sector key");
@@ -2489,10 +5254,43 @@ skip_pprf_load:
 
 	/* Lots to clean up after an error. */
 create_evict_thread_fail:
+	/* Recovery may have started a readahead. */
+	flush_work(&rd->ra_work);
+	holepunch_unpin_key_table(rd);
+read_pprf_fail:
 	vfree(rd->pprf_key);
 alloc_pprf_key_fail:
+	vfree(rd->master_rot_data);
+#ifdef HOLEPUNCH_JOURNAL
+alloc_master_rot_data_fail:
+#endif
+	vfree(rd->journal_data);
+#ifdef HOLEPUNCH_JOURNAL
+alloc_journal_data_fail:
+#endif
 	vfree(rd->pprf_fkt);
 alloc_pprf_fkt_fail:
+	vfree(rd->slot_used);
+alloc_slot_used_fail:
+	unregister_shrinker(&rd->cache_shrinker);
+register_shrinker_fail:
+	vfree(rd->key_cache);
+alloc_key_cache_fail:
+	vfree(rd->map_cache_ghost);
+alloc_cache_ghost_fail:
+	percpu_counter_destroy(&rd->stats_inline);
+init_inline_fail:
+	percpu_counter_destroy(&rd->stats_key_hit);
+init_key_hit_fail:
+	percpu_counter_destroy(&rd->stats_cache_miss);
+init_cache_miss_fail:
+	percpu_counter_destroy(&rd->stats_cache_hit);
+init_cache_hit_fail:
+	percpu_counter_destroy(&rd->map_cache_count);
+init_map_cache_count_fail:
+	rhashtable_destroy(&rd->map_cache);
+init_map_cache_fail:
+	rcu_barrier();
 	mempool_destroy(rd->map_cache_pool);
 create_map_cache_pool_fail:
 	kmem_cache_destroy(rd->_map_cache_pool);
@@ -2503,31 +5301,30 @@ create_unlink_queue_fail:
 create_unlink_pool_fail:
 	kmem_cache_destroy(rd->_unlink_work_pool);
 create_unlink_cache_fail:
+	holepunch_stop_crypto_workers(rd);
+start_crypto_workers_fail:
 	destroy_workqueue(rd->io_queue);
 create_io_queue_fail:
-	mempool_destroy(rd->io_work_pool);
-create_io_pool_fail:
-	kmem_cache_destroy(rd->_io_work_pool);
-create_io_cache_fail:
 	eraser_free_sector(rd->hp_h, rd);
 read_header_fail:
 	mempool_destroy(rd->page_pool);
 create_page_pool_fail:
 	bioset_free(rd->bioset);
 create_bioset_fail:
+	cancel_work_sync(&rd->master_commit_work);
 	kfree(rd->prg_input);
 init_prg_input_fail:
 	crypto_free_shash(rd->sha_tfm);
 init_sha_tfm_fail:
 	crypto_free_blkcipher(rd->ctr_tfm);
 init_ctr_tfm_fail:
-	i = rd->cpus;
+	i = 2 * rd->cpus;
 init_cbc_tfm_fail:
 	/* We may have created some of the transforms. */
 	for (i = i - 1; i >= 0; --i)
 		crypto_free_blkcipher(rd->cbc_tfm[i]);
 	kfree(rd->cbc_tfm);
-	i = rd->cpus;
+	i = 2 * rd->cpus;
 init_ecb_tfm_fail:
 	/* We may have created some of the transforms. */
 	for (i = i - 1; i >= 0; --i)
@@ -2558,6 +5355,12 @@ static void eraser_dtr(struct dm_target *ti)
 	// HP_DOWN_WRITE(&rd->pprf_sem, "PPRF on DTR");
 	DMINFO("Destroying.");
 
+	/* No new unlinks after this. */
+	down(&holepunch_dev_lock);
+	hash_del_rcu(&rd->hash);
+	up(&holepunch_dev_lock);
+	synchronize_rcu();
+
 	/* wait for all requests to be finished 
 	 * TODO: maybe use a waitqueue */
 	atomic_set(&rd->shutdown, 1);
@@ -2565,26 +5368,43 @@ static void eraser_dtr(struct dm_target *ti)
 		DMINFO("%u jobs remaining\n", i);
 		msleep_interruptible(1000);
 	}
+	flush_work(&rd->warm_work);
+	flush_work(&rd->ra_work);
 
 
 
 	kfree(rd->real_dev_path);
 	kfree(rd->virt_dev_path);
 
-	/* Stop auto eviction and write back cached maps. */
+	/* Persist queued unlinks, stop auto eviction and write back cached maps. */
+	flush_workqueue(rd->unlink_queue);
+	cancel_delayed_work_sync(&rd->delete_flush_work);
+	HP_DOWN(&rd->delete_lock, "Delete: dtr");
+	holepunch_delete_flush(rd);
+	HP_UP(&rd->delete_lock, "Delete: dtr");
 	kthread_stop(rd->evict_map_cache_thread);
+	unregister_shrinker(&rd->cache_shrinker);
+	holepunch_save_hot_sectors(rd);
 
 	DMINFO("evict cache");
 	eraser_force_evict_map_cache(rd, 1);
 
+	/* The helper must have the newest master key before it goes away. */
+	DMINFO("flush master key");
+	holepunch_flush_master_commit(rd);
+	cancel_work_sync(&rd->master_commit_work);
+
 	/* Keys no longer needed, wipe them. */
 	eraser_kill_helper(rd);
 	memset(rd->new_master_key, 0, HOLEPUNCH_KEY_LEN);
+	memset(rd->tpm_master_key, 0, HOLEPUNCH_KEY_LEN);
 	memset(rd->master_key, 0, HOLEPUNCH_KEY_LEN);
 	memset(rd->sec_key, 0, HOLEPUNCH_KEY_LEN);
 
 	DMINFO("write header");
-	/* Write header */
+	/* Write header, without any hot list an older version kept in it. */
+	memset((void *) rd->hp_h + sizeof(*rd->hp_h), 0,
+			ERASER_SECTOR - sizeof(*rd->hp_h));
 	holepunch_write_header(rd);
 	eraser_free_sector(rd->hp_h, rd);
 #ifdef HOLEPUNCH_DEBUG
@@ -2594,9 +5414,22 @@ static void eraser_dtr(struct dm_target *ti)
 #endif
 
 	vfree(rd->pprf_key);
+	vfree(rd->master_rot_data);
+	vfree(rd->journal_data);
 	vfree(rd->pprf_fkt);
-
-	/* Clean up. */
+	vfree(rd->slot_used);
+
+	/* Clean up. Evicted entries are freed after an RCU grace period. */
+	holepunch_key_cache_free(rd);
+	vfree(rd->map_cache_ghost);
+	percpu_counter_destroy(&rd->stats_inline);
+	percpu_counter_destroy(&rd->stats_key_hit);
+	percpu_counter_destroy(&rd->stats_cache_miss);
+	percpu_counter_destroy(&rd->stats_cache_hit);
+	percpu_counter_destroy(&rd->map_cache_count);
+	rhashtable_destroy(&rd->map_cache);
+	rcu_barrier();
+	holepunch_unpin_key_table(rd);
 	mempool_destroy(rd->map_cache_pool);
 	kmem_cache_destroy(rd->_map_cache_pool);
 
@@ -2604,9 +5437,8 @@ static void eraser_dtr(struct dm_target *ti)
 	mempool_destroy(rd->unlink_work_pool);
 	kmem_cache_destroy(rd->_unlink_work_pool);
 
+	holepunch_stop_crypto_workers(rd);
 	destroy_workqueue(rd->io_queue);
-	mempool_destroy(rd->io_work_pool);
-	kmem_cache_destroy(rd->_io_work_pool);
 
 	mempool_destroy(rd->page_pool);
 	bioset_free(rd->bioset);
@@ -2614,11 +5446,11 @@ static void eraser_dtr(struct dm_target *ti)
 	kfree(rd->prg_input);
 	crypto_free_shash(rd->sha_tfm);
 	crypto_free_blkcipher(rd->ctr_tfm);
-	for (i = 0; i < rd->cpus; ++i)
+	for (i = 0; i < 2 * rd->cpus; ++i)
 		crypto_free_blkcipher(rd->cbc_tfm[i]);
 	kfree(rd->cbc_tfm);
 
-	for (i = 0; i < rd->cpus; ++i)
+	for (i = 0; i < 2 * rd->cpus; ++i)
 		crypto_free_blkcipher(rd->ecb_tfm[i]);
 	kfree(rd->ecb_tfm);
 
@@ -2629,12 +5461,142 @@ static void eraser_dtr(struct dm_target *ti)
 	up(&holepunch_dev_lock);
 	// HP_UP_WRITE(&rd->pprf_sem, "PPRF on DTR");
 
-	KWORKERMSG("== Usage stats ==\nEvals: %llu\nPunctures: %llu\nRefreshes: %llu\n",
-			   rd->stats_evaluate, rd->stats_puncture, rd->stats_refresh);
+	KWORKERMSG("== Usage stats ==\nEvals: %llu\nPunctures: %llu\nRefreshes: %llu\n"
+			   "Master commits: %llu (coalesced: %llu)\n"
+			   "Unlinks: %llu (coalesced: %llu, unused: %llu)\nDeletion batches: %llu\n"
+			   "Deletion latency ms p50/p99/max: %llu/%llu/%u\n",
+			   rd->stats_evaluate, rd->stats_puncture, rd->stats_refresh,
+			   rd->stats_master_commits, rd->stats_master_coalesced,
+			   rd->stats_unlink, rd->stats_unlink_coalesced,
+			   rd->stats_unlink_unused, rd->stats_batches,
+			   holepunch_hist_percentile(rd->stats_latency_hist, 50),
+			   holepunch_hist_percentile(rd->stats_latency_hist, 99),
+			   rd->stats_latency_max);
 
 	DMINFO("Success.");
 }
 
+/*
+ * Target messages:
+ *   barrier           - blocks until all earlier unlinks are irrecoverable.
+ *   deadline <ms>     - sets the max time to durable deletion (0: no batching).
+ *   cache_budget <kb> - sets the map cache budget (0: no budget).
+ */
+static int eraser_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct holepunch_dev *rd = (struct holepunch_dev *)ti->private;
+	unsigned ms, kb;
+	char dummy;
+
+	if (argc == 1 && !strcasecmp(argv[0], "barrier"))
+	{
+		return holepunch_delete_barrier(rd);
+	}
+
+	if (argc == 2 && !strcasecmp(argv[0], "deadline"))
+	{
+		if (sscanf(argv[1], "%u%c", &ms, &dummy) != 1)
+			return -EINVAL;
+		HP_DOWN(&rd->delete_lock, "Delete: set deadline");
+		rd->delete_deadline = msecs_to_jiffies(ms);
+		if (rd->delete_window > rd->delete_deadline)
+			rd->delete_window = rd->delete_deadline;
+		holepunch_delete_schedule(rd);
+		HP_UP(&rd->delete_lock, "Delete: set deadline");
+		DMINFO("Deletion deadline: %u ms", ms);
+		return 0;
+	}
+
+	if (argc == 2 && !strcasecmp(argv[0], "cache_budget"))
+	{
+		if (sscanf(argv[1], "%u%c", &kb, &dummy) != 1)
+			return -EINVAL;
+		holepunch_cache_set_budget(rd, kb);
+		holepunch_cache_trim(rd, holepunch_cache_excess(rd));
+		DMINFO("Cache budget: %u KiB", kb);
+		return 0;
+	}
+
+	DMWARN("Unrecognised message received.");
+	return -EINVAL;
+}
+
+/*
+ * Reports the deletion scheduler state and stats. Percentiles are upper bounds
+ * of log2 histogram buckets.
+ */
+static void eraser_status(struct dm_target *ti, status_type_t type,
+		unsigned status_flags, char *result, unsigned maxlen)
+{
+	struct holepunch_dev *rd = (struct holepunch_dev *)ti->private;
+	struct holepunch_crypto_worker *cw;
+	unsigned sz = 0;
+	u64 elapsed;
+	unsigned i;
+
+	switch (type)
+	{
+	case STATUSTYPE_INFO:
+		DMEMIT("deadline_ms %u window_ms %u unlinks %llu unused %llu batches %llu barriers %llu "
+				"flush_writeback %llu meta_bios %llu meta_sectors %llu "
+				"mount_ms_setup %llu mount_ms_key %llu mount_ms_load %llu "
+				"mount_ms_recovery %llu key_requests %llu cache_miss_waits %llu "
+				"cache_entries %lld cache_kb %llu cache_budget_kb %u cache_shrunk %llu "
+				"cache_hits %lld cache_misses %lld cache_ghost_hits %llu cache_a1in %lu "
+				"cache_dirty %lu key_hits %lld inline_ios %lld pinned %d failed %d "
+				"unlinks_missed %d "
+				"readahead_window %u readahead_sectors %llu "
+				"batch_p50 %llu batch_p99 %llu latency_ms_p50 %llu "
+				"latency_ms_p90 %llu latency_ms_p99 %llu latency_ms_max %u",
+				jiffies_to_msecs(rd->delete_deadline),
+				jiffies_to_msecs(rd->delete_window),
+				rd->stats_unlink, rd->stats_unlink_unused, rd->stats_batches,
+				rd->stats_barriers, rd->stats_flush_writeback,
+				rd->stats_meta_bios, rd->stats_meta_sectors,
+				rd->stats_mount_ns[HP_MOUNT_SETUP] / NSEC_PER_MSEC,
+				rd->stats_mount_ns[HP_MOUNT_KEY] / NSEC_PER_MSEC,
+				rd->stats_mount_ns[HP_MOUNT_LOAD] / NSEC_PER_MSEC,
+				rd->stats_mount_ns[HP_MOUNT_RECOVERY] / NSEC_PER_MSEC,
+				rd->stats_key_requests, rd->stats_cache_miss_wait,
+				percpu_counter_sum_positive(&rd->map_cache_count),
+				percpu_counter_sum_positive(&rd->map_cache_count)
+						* HP_CACHE_ENTRY_SIZE / 1024,
+				rd->cache_budget_kb, rd->stats_cache_shrunk,
+				percpu_counter_sum_positive(&rd->stats_cache_hit),
+				percpu_counter_sum_positive(&rd->stats_cache_miss),
+				rd->stats_cache_ghost_hit, rd->map_cache_a1in_len,
+				rd->map_cache_dirty_len,
+				percpu_counter_sum_positive(&rd->stats_key_hit),
+				percpu_counter_sum_positive(&rd->stats_inline),
+				rd->key_table != NULL, READ_ONCE(rd->failed),
+				atomic_read(&rd->stats_unlink_missed),
+				rd->ra_window, rd->stats_readahead,
+				holepunch_hist_percentile(rd->stats_batch_hist, 50),
+				holepunch_hist_percentile(rd->stats_batch_hist, 99),
+				holepunch_hist_percentile(rd->stats_latency_hist, 50),
+				holepunch_hist_percentile(rd->stats_latency_hist, 90),
+				holepunch_hist_percentile(rd->stats_latency_hist, 99),
+				rd->stats_latency_max);
+		/* Per crypto worker: busy percent, chunks, chunks stolen. */
+		elapsed = ktime_get_ns() - rd->crypto_start;
+		DMEMIT(" crypto_workers %u", rd->nr_crypto_workers);
+		for (i = 0; i < rd->nr_crypto_workers; ++i) {
+			cw = &rd->crypto_workers[i];
+			DMEMIT(" crypto_cpu%d %llu:%llu:%llu", cw->cpu,
+					div64_u64(cw->stats_busy_ns * 100, elapsed ?: 1),
+					cw->stats_chunks, cw->stats_stolen);
+		}
+		break;
+	case STATUSTYPE_TABLE:
+		/* The sector key was wiped from the arguments; never show it. */
+		DMEMIT("%s %s - %s %d %u %u%s", rd->real_dev_path, rd->eraser_name,
+				rd->virt_dev_path, rd->helper_pid,
+				jiffies_to_msecs(rd->delete_deadline), rd->cache_budget_kb,
+				rd->key_table ? " pinned" : "");
+		break;
+	}
+}
+
 static void eraser_io_hints(struct dm_target *ti, struct queue_limits *limits)
 {
 	limits->logical_block_size = ERASER_SECTOR;
@@ -2650,17 +5612,17 @@ static struct target_type eraser_target = {
 	.ctr = eraser_ctr,
 	.dtr = eraser_dtr,
 	.map = eraser_map_bio,
+	.end_io = eraser_end_io,
+	.status = eraser_status,
+	.message = eraser_message,
 	.io_hints = eraser_io_hints,
 };
 
 
 static void config_messages(void)
 {
-#ifdef HOLEPUNCH_BATCHING
-	DMINFO("Batching enabled");
-#else
-	DMINFO("Batching disabled");
-#endif
+	DMINFO("Default deletion deadline: %u ms", delete_deadline_ms);
+	DMINFO("Default cache budget: %u KiB", cache_budget_kb);
 #ifdef HOLEPUNCH_JOURNAL
 	DMINFO("Journaling enabled");
 #else
@@ -2695,10 +5657,13 @@ static int __init dm_eraser_init(void)
 		return -1;
 	}
 
-	r = register_kprobe(&eraser_unlink_kprobe);
+	eraser_unlink_kretprobe.maxactive = max_t(int,
+			HOLEPUNCH_UNLINK_PROBE_MAXACTIVE,
+			HOLEPUNCH_UNLINK_PROBE_PER_CPU * num_possible_cpus());
+	r = register_kretprobe(&eraser_unlink_kretprobe);
 	if (r < 0)
 	{
-		DMERR("Register kprobe failed %d", r);
+		DMERR("Register kretprobe failed %d", r);
 		return r;
 	}
 
@@ -2725,7 +5690,9 @@ static void __exit dm_eraser_exit(void)
 {
 	remove_proc_entry(HOLEPUNCH_PROC_FILE, NULL);
 	dm_unregister_target(&eraser_target);
-	unregister_kprobe(&eraser_unlink_kprobe);
+	unregister_kretprobe(&eraser_unlink_kretprobe);
+	if (eraser_unlink_kretprobe.nmissed)
+		DMWARN("Unlink probe missed %d unlinks.", eraser_unlink_kretprobe.nmissed);
 	netlink_kernel_release(eraser_sock);
 	DMINFO("HOLEPUNCH unloaded.");
 }
@@ -16,12 +16,18 @@
 #include <crypto/rng.h>
 #include <linux/workqueue.h>
 #include <linux/list.h>
+#include <linux/list_sort.h>
 #include <linux/kfifo.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/kprobes.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/rhashtable.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
 #include <linux/vmalloc.h>
 #include <linux/kthread.h>
 #include <net/sock.h>
@@ -29,6 +35,7 @@
 /* #include <net/genetlink.h> */
 #include <linux/skbuff.h>
 #include <linux/wait.h>
+#include <linux/spinlock.h>
 
 #include "pprf-tree.h"
 
@@ -55,6 +62,13 @@
 
 /* Cache flags & constants. */
 #define ERASER_CACHE_DIRTY       0x000000001
+/* Holds keys not yet on disk; written back under the current tag. */
+#define ERASER_CACHE_REKEYED     0x000000002
+/* Dropped from the cache; only lingers until the last reference goes. */
+#define ERASER_CACHE_DEAD        0x000000004
+
+/* Log2 histogram size for the deletion scheduler stats. */
+#define HP_SCHED_HIST_BUCKETS 16
 
 /*
  * Memory pools.
@@ -63,7 +77,6 @@
  */
 #define ERASER_BIOSET_SIZE 1024
 #define ERASER_PAGE_POOL_SIZE 1024
-#define ERASER_IO_WORK_POOL_SIZE 1024
 #define ERASER_UNLINK_WORK_POOL_SIZE 1024
 #define ERASER_MAP_CACHE_POOL_SIZE 1024
 
@@ -199,6 +212,10 @@ struct holepunch_header {
 	u8 pprf_depth;
 	u8 in_use;
 
+	/* Hot list sector, between the journal and the key table; volumes
+	 * created without one have no room for it there. */
+	u64 hot_start;
+
 	/* tag_counter and pprf_size are stored in the top-level FKT block
 	 * since they are mutable - this helps save an IO op */
 };
@@ -212,13 +229,13 @@ struct holepunch_header {
 enum {
 	/* No active journal entry. */
 	HPJ_NONE = 0,
-	/* Master key rotation. Following the type is the new master key, encrypted by
-	 * the old master key, followed by the hash of the old key. Recovery proceeds
-	 * by comparing the hash of the current master key to the stored hash. If they
-	 * match, pprf_fkt_top_width blocks should be copied from the journal to
+	/* Master key rotation. The new master key is described by the master key
+	 * record (see below). Recovery proceeds by comparing the hash of the current
+	 * master key to the hashes stored in the record. If one matches,
+	 * pprf_fkt_top_width blocks should be copied from the journal to
 	 * pprf_fkt_start in sequence, then the new key written to the TPM (obtained
-	 * via decrypting the on-disc version), and finally the journal cleared. If they
-	 * don't match, the journal can simply be cleared.
+	 * via decrypting the matching slot), and finally the journal cleared. If none
+	 * match, the journal can simply be cleared.
 	 */
 	HPJ_MASTER_ROT,
 	/* PPRF key rotation. Following the type is the new PPRF key encrypted by the
@@ -247,21 +264,134 @@ enum {
 	HPJ_GENERIC
 };
 
+/*
+ * Master key commits to the TPM are asynchronous, so at any point the TPM may
+ * hold the last acknowledged key, the key in flight to the helper, or the key
+ * queued behind it. The upper half of the journal control block always carries
+ * a record of the newest master key encrypted under each of those candidates,
+ * together with their hashes; every control block write restamps it, so it
+ * survives unrelated journal transactions. On mount, a slot whose hash matches
+ * the key in the TPM means the newest key never made it there.
+ */
+#define HPJ_MASTER_REC_OFFSET (ERASER_SECTOR / 2) /* In bytes. */
+#define HPJ_MASTER_REC_MAGIC 0x6d6b7265636f7264
+#define HPJ_MASTER_REC_SLOTS 3
+
+struct holepunch_master_record {
+	u64 magic;
+	struct {
+		u8 enc_key[HOLEPUNCH_KEY_LEN]; /* Newest key, encrypted by the candidate. */
+		u8 hash[HP_HASH_LEN];          /* Hash of the candidate. */
+	} slots[HPJ_MASTER_REC_SLOTS];
+};
 
 /*
- * Map entry and cache structs.
+ * The hot list sector lists the hottest key table sectors, as of the last
+ * close (or the last periodic save), so that the next mount can warm the
+ * cache up with them in the background. Which inodes are hot says something
+ * about the files, so everything after the IV is encrypted under the sector
+ * key, with a fresh IV on every save. It is only a hint: a list without the
+ * magic is ignored, and so are sectors out of range.
  */
+#define HP_HOT_MAGIC 0x686f74656e637279
+#define HP_HOT_CLEAR 32 /* Bytes left in the clear: magic, pad and IV. */
+#define HP_HOT_MAX ((ERASER_SECTOR - HP_HOT_CLEAR - 8) / sizeof(u32))
+#define HP_HOT_SAVE_PERIOD (10 * 60 * HZ)
+
+struct holepunch_hot_list {
+	u64 magic;
+	u64 pad0;
+	u8 iv[ERASER_IV_LEN];
+	/* Encrypted from here on. */
+	u32 nr;
+	u32 pad;
+	u32 sectors[HP_HOT_MAX];           /* Key table indices, hottest first. */
+};
+
 
-#define ERASER_MAP_CACHE_BUCKETS 1024
+/*
+ * Map entry and cache structs.
+ */
 
+/*
+ * A cached key table sector. Lookups run under RCU and pin the entry with a
+ * reference; the table itself holds one until the entry is dropped. Keys are
+ * read and replaced under key_lock, so that hits never sleep. Anything that
+ * writes the sector back, re-tags it or drops it takes lock. An entry is in
+ * the table from the start of its read, and loaded is completed once map is
+ * valid; an entry that never gets a map is a placeholder.
+ */
 struct eraser_map_cache {
 	u64 sector;
 	u64 status;
-	unsigned long last_dirty;
+	unsigned long dirtied;             /* When it went on the dirty list. */
 	unsigned long last_access;
 	unsigned long first_access;
 	struct holepunch_filekey_sector *map;
-	struct list_head list;
+	struct holepunch_dev *rd;
+	struct rhash_head node;
+	struct list_head list;             /* On the cache list until freed. */
+	struct list_head lru;              /* On a replacement queue while clean. */
+	struct list_head dirty;            /* On the dirty list while not. */
+	struct list_head batch;            /* On a writeback batch. */
+	u8 queue;
+	u8 referenced;                     /* Hit since the Am clock hand passed. */
+	atomic_t refs;
+	spinlock_t key_lock;
+	struct semaphore lock;
+	struct completion loaded;
+	struct rcu_head rcu;
+};
+
+/*
+ * Map cache replacement (2Q). A sector seen for the first time goes on A1in,
+ * a FIFO holding about a quarter of the cache. Sectors evicted from A1in are
+ * remembered on A1out, a ring of ghosts; one that misses again while still a
+ * ghost has proved itself and goes on Am, which is evicted by CLOCK. A scan
+ * over cold sectors thus only churns A1in, and leaves Am alone.
+ */
+enum {
+	HP_CACHE_A1IN,
+	HP_CACHE_AM,
+};
+#define HP_CACHE_A1IN_SHARE 4              /* A1in gets 1/4 of the budget. */
+#define HP_CACHE_GHOSTS 4096
+#define HP_CACHE_GHOST_BITS 10
+/* Trimming gives up after this many entries it could not lock. */
+#define HP_CACHE_TRIM_BUSY 32
+/* Inserting into the cache table gives up after this many 1 ms waits. */
+#define HP_CACHE_INSERT_TRIES 100
+
+struct holepunch_cache_ghost {
+	u64 sector;
+	struct hlist_node hash;
+};
+
+/*
+ * Per-inode key cache, in front of the map cache: a hot file only needs its
+ * own key resident, not the key table sector around it, so clean sectors can
+ * go once their keys are cached. Direct-mapped by inode; each slot publishes
+ * an immutable key handle under RCU, so every bio of a file being streamed
+ * finds its key without taking a lock. Unlinks retire the handle and bump the
+ * slot generation; a key read from a sector is only cached if the generation
+ * has not moved since, so a key replaced meanwhile never is.
+ */
+#ifndef HOLEPUNCH_KEY_CACHE_BITS
+#define HOLEPUNCH_KEY_CACHE_BITS 14
+#endif
+#define HP_KEY_CACHE_SLOTS (1 << HOLEPUNCH_KEY_CACHE_BITS)
+
+struct holepunch_key_handle {
+	u64 ino;
+	int dead;                          /* Set once the key is replaced. */
+	u8 key[HOLEPUNCH_KEY_LEN];
+	struct rcu_head rcu;
+};
+
+struct holepunch_key_slot {
+	struct holepunch_key_handle __rcu *h;
+	spinlock_t lock;                   /* Serializes changes to h and gen. */
+	u32 gen;
 };
 
 /* Master key status flags. */
@@ -271,9 +401,62 @@ enum {
 	ERASER_KEY_SET_REQUESTED,
 	ERASER_KEY_SLOT_MAP_DIRTY,
 	ERASER_KEY_READY_TO_REFRESH,
+	ERASER_KEY_HELPER_READY,
+};
+
+
+
+/* A batch of metadata I/O in flight. */
+struct holepunch_meta_batch {
+	atomic_t pending;
+	struct completion done;
+	int error;
+};
+
+struct holepunch_dev;
+
+/*
+ * A metadata load: sectors are read in chunks of HP_LOAD_CHUNK, and each chunk
+ * is decrypted by a worker as soon as it arrives. A held load keeps arrived
+ * chunks on its deferred list until it is released, by its caller or by the
+ * load it depends on finishing, so no worker ever waits for a dependency.
+ * batch.done is completed for all waiters.
+ */
+#define HP_LOAD_CHUNK 32 /* In sectors. */
+
+/* Key table sectors a PPRF rotation writes per batch. */
+#define HP_ROTATE_WINDOW 32
+
+struct holepunch_load {
+	struct holepunch_dev *rd;
+	struct holepunch_meta_batch batch;
+	void (*decrypt)(struct holepunch_dev *rd, void *buf, u64 sector);
+	void *buf;
+
+	spinlock_t lock;                   /* Protects the fields below. */
+	int held;                          /* Chunks are not decrypted yet. */
+	int done;                          /* All chunks are decrypted. */
+	struct list_head deferred;         /* Chunks read while held. */
+	struct holepunch_load *next;       /* Load to release once done. */
 };
 
+struct holepunch_load_chunk {
+	struct work_struct work;
+	struct list_head list;
+	struct holepunch_load *load;
+	void *buf;
+	u64 sector;
+	unsigned nr;
+};
 
+/* Mount phases, timed by eraser_ctr. */
+enum holepunch_mount_phase {
+	HP_MOUNT_SETUP,                    /* Transforms, pools, header, journal. */
+	HP_MOUNT_KEY,                      /* Waiting for the master key. */
+	HP_MOUNT_LOAD,                     /* FKT, PPRF key, pinned key table. */
+	HP_MOUNT_RECOVERY,                 /* Journal recovery, master rotation. */
+	HP_MOUNT_PHASES,
+};
 
 /* Represents a ERASER instance. */
 struct holepunch_dev {
@@ -285,12 +468,29 @@ struct holepunch_dev {
 
 	u8 *sec_key;                       /* Sector encryption key. */
 	u8 master_key[HOLEPUNCH_KEY_LEN];     /* File encryption master key. */
-	u8 new_master_key[HOLEPUNCH_KEY_LEN]; /* Temporary key before syncing to TPM. */
+	u8 new_master_key[HOLEPUNCH_KEY_LEN]; /* Key in flight to the TPM. */
+	u8 tpm_master_key[HOLEPUNCH_KEY_LEN]; /* Last key acknowledged by the TPM. */
 	struct completion master_key_wait;
 	unsigned long master_key_status;   /* Key status flags. */
 	int helper_pid;                    /* Netlink talks to this pid. */
+
+	/* Master key commit queue; only the newest queued key is ever sent. */
+	spinlock_t master_commit_lock;
+	struct work_struct master_commit_work;
+	wait_queue_head_t master_commit_wait;
+	u64 master_commit_queued;          /* Keys handed to the queue. */
+	u64 master_commit_sent;            /* Sequence of the key in flight. */
+	u64 master_commit_done;            /* Sequence of the last acknowledged key. */
+	unsigned master_commit_tries;      /* Failed sends of the key in flight. */
+	struct holepunch_master_record master_rec;
 	u64 *journal;					
 	int journal_entry;
+	void *journal_data;                /* Staged journal blocks, by entry. */
+	void *master_rot_data;             /* Staged FKT top for master rotations. */
+
+	/* Unjournalled metadata writes in flight until the next commit. */
+	struct holepunch_meta_batch meta_stage;
+	struct list_head meta_stage_pages;
 
 	struct holepunch_header *hp_h;
 	/* Some convenience lengths, calculated from the header. */
@@ -305,15 +505,58 @@ struct holepunch_dev {
 	struct rw_semaphore pprf_sem;
 	struct pprf_keynode pprf_key_new;
 
+	/* One bit per inode: key may have encrypted data on disk. */
+	unsigned long *slot_used;
+	u64 slot_used_len;                 /* In bytes. */
+
 	/* Cache-related. */
-	struct list_head map_cache_list[ERASER_MAP_CACHE_BUCKETS];
-	struct semaphore cache_lock[ERASER_MAP_CACHE_BUCKETS];
-	u64 map_cache_count;
-	struct rw_semaphore map_cache_count_sem;
+	struct rhashtable map_cache;       /* Entries by key table sector. */
+	spinlock_t map_cache_lock;         /* Protects the lists and ghosts. */
+	struct list_head map_cache_list;
+	struct list_head map_cache_a1in;   /* Replacement queues, newest first. */
+	struct list_head map_cache_am;
+	unsigned long map_cache_a1in_len;
+	struct list_head map_cache_dirty;  /* Oldest first. */
+	unsigned long map_cache_dirty_len;
+	wait_queue_head_t cache_wait;      /* Writeback thread sleeps here. */
+	unsigned long cache_kick;          /* Bit 0: writeback thread has work. */
+	u64 hot_sector;                    /* Hot list sector, 0 if none. */
+	unsigned long hot_saved;           /* Last hot list save, in jiffies. */
+	struct work_struct warm_work;      /* Prefetches the hot list on mount. */
+	u64 *warm_list;
+	unsigned warm_total;
+	unsigned warm_done;
+
+	/* Key table readahead; one window in flight at a time. */
+	spinlock_t ra_lock;
+	struct work_struct ra_work;
+	u64 ra_last;                       /* Last sector missed. */
+	u64 ra_next;                       /* First sector past the last window. */
+	u64 ra_mark;                       /* Hitting it reads the next window. */
+	u64 ra_first;                      /* Window being read, if ra_nr. */
+	unsigned ra_nr;
+	unsigned ra_window;                /* Current size; 0 while not sequential. */
+	struct holepunch_cache_ghost *map_cache_ghost;
+	unsigned map_cache_ghost_next;
+	DECLARE_HASHTABLE(map_cache_ghost_hash, HP_CACHE_GHOST_BITS);
+	struct percpu_counter map_cache_count;
+	unsigned cache_budget_kb;
+	unsigned long cache_budget;        /* In entries; 0: no budget. */
+	struct shrinker cache_shrinker;
+	atomic_t cache_unwritten;          /* Entries with ERASER_CACHE_REKEYED. */
+	struct holepunch_key_slot *key_cache;
+	struct holepunch_filekey_sector *key_table; /* Decrypted, if pinned. */
+
+	/* Flushes wait for cached keys to be written back first. */
+	spinlock_t flush_lock;
+	struct bio_list flush_bios;
+	struct work_struct flush_work;
 	struct task_struct *evict_map_cache_thread;
 
 	/* Crypto transforms. */
 	unsigned cpus;
+	/* Two per CPU: the second one is for decrypting in completion context,
+	 * which may have interrupted a user of the first one. */
 	struct crypto_blkcipher **ecb_tfm; /* AES-ECB for PRG and keys. */
 	struct crypto_blkcipher **cbc_tfm; /* AES-CBC for files and sectors. */
 	struct crypto_blkcipher *ctr_tfm;  /* Single AES-CTR for PPRF rotation. */
@@ -324,25 +567,73 @@ struct holepunch_dev {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *unlink_queue;
 
+	/* Crypto workers for large I/Os. */
+	struct holepunch_crypto_worker *crypto_workers;
+	unsigned nr_crypto_workers;
+	unsigned *crypto_home;             /* Worker to queue to, by CPU. */
+	atomic_t crypto_queued;            /* Chunks on all queues. */
+	wait_queue_head_t crypto_wait;     /* Idle workers. */
+	u64 crypto_start;                  /* For utilization, in ns. */
+
+	/* Unlinks waiting to be applied, drained in batches by sector. */
+	spinlock_t unlink_lock;
+	struct list_head unlink_list;
+	struct work_struct unlink_batch_work;
+
+	/* Deletion scheduler: applied unlinks waiting to be made durable. */
+	struct semaphore delete_lock;
+	struct list_head delete_pending;
+	struct delayed_work delete_flush_work;
+	unsigned long delete_deadline;     /* Max time to durable deletion. */
+	unsigned long delete_window;       /* Current batch window. */
+	unsigned long delete_oldest;       /* Arrival of oldest pending unlink. */
+	u64 delete_dirty;                  /* Sectors dirtied since last flush. */
+	u64 delete_count;                  /* Unlinks pending. */
+	int unlink_missed;                 /* Probe misses already reported. */
+
 	atomic_t shutdown;
 	atomic_t jobs;
+	int failed;                        /* Keys can't be committed; I/O errors. */
 
 	/* Memory pools. */
 	struct bio_set *bioset;
 	mempool_t *page_pool;
-	struct kmem_cache *_io_work_pool;
-	mempool_t *io_work_pool;
 	struct kmem_cache *_unlink_work_pool;
 	mempool_t *unlink_work_pool;
 	struct kmem_cache *_map_cache_pool;
 	mempool_t *map_cache_pool;
 
 	struct list_head list;
+	struct hlist_node hash;            /* In holepunch_dev_hash, by virt_dev. */
 
 	/* Usage stats */
 	u64 stats_evaluate;
 	u64 stats_puncture;
 	u64 stats_refresh;
+	u64 stats_master_commits;
+	u64 stats_master_coalesced;
+	u64 stats_unlink;
+	u64 stats_unlink_coalesced;
+	u64 stats_unlink_unused;
+	atomic_t stats_unlink_missed;      /* Unlinks lost to the probe. */
+	u64 stats_batches;
+	u64 stats_barriers;
+	u64 stats_flush_writeback;         /* Key table sectors written on flush. */
+	u64 stats_meta_bios;
+	u64 stats_meta_sectors;
+	u64 stats_batch_hist[HP_SCHED_HIST_BUCKETS];   /* log2 of unlinks. */
+	u64 stats_latency_hist[HP_SCHED_HIST_BUCKETS]; /* log2 of msecs. */
+	unsigned stats_latency_max;                    /* In msecs. */
+	u64 stats_mount_ns[HP_MOUNT_PHASES];
+	u64 stats_key_requests;            /* GET KEY sends, including failures. */
+	u64 stats_cache_miss_wait;         /* Lookups that waited on a read in flight. */
+	u64 stats_cache_shrunk;            /* Entries given up to the shrinker. */
+	struct percpu_counter stats_cache_hit;
+	struct percpu_counter stats_cache_miss;
+	u64 stats_cache_ghost_hit;         /* Misses admitted straight to Am. */
+	struct percpu_counter stats_key_hit;
+	struct percpu_counter stats_inline; /* I/O done without the bottom half. */
+	u64 stats_readahead;               /* Sectors read ahead. */
 #ifdef HOLEPUNCH_DEBUG
 	volatile unsigned state;
 #endif
@@ -350,19 +641,87 @@ struct holepunch_dev {
 static LIST_HEAD(holepunch_dev_list); /* We keep all ERASERs in a list. */
 static DEFINE_SEMAPHORE(holepunch_dev_lock);
 
-/* Represents an IO operation in flight. */
+/*
+ * Running ERASERs by virtual device number, for the unlink probe. Written
+ * under holepunch_dev_lock, read under RCU.
+ */
+#define HOLEPUNCH_DEV_HASH_BITS 4
+static DEFINE_HASHTABLE(holepunch_dev_hash, HOLEPUNCH_DEV_HASH_BITS);
+
+/*
+ * Unlink probe instances; only unlinks on ERASER devices hold one, but for as
+ * long as the unlink sleeps. A miss loses the unlink, so there are plenty: at
+ * least the minimum, and more with more CPUs to run unlinks on.
+ */
+#define HOLEPUNCH_UNLINK_PROBE_MAXACTIVE 512
+#define HOLEPUNCH_UNLINK_PROBE_PER_CPU 64
+
+/* Where an I/O is; end_io only steps in for reads waiting to be decrypted. */
+enum {
+	HP_IO_PASS,                        /* Remapped as is. */
+	HP_IO_WRITE,                       /* Encrypted into a new bio. */
+	HP_IO_READ,                        /* Decrypted once the read is done. */
+	HP_IO_DONE,
+};
+
+/* Largest read decrypted in its completion context, with interrupts off. */
+#define HP_INLINE_READ_MAX (4 * ERASER_SECTOR) /* In bytes. */
+
+/* Larger I/Os are cut into chunks of this size for the crypto workers. */
+#define HP_CRYPTO_CHUNK (16 * ERASER_SECTOR) /* In bytes. */
+
+/*
+ * Represents an IO operation in flight. Lives in the per-bio data that device
+ * mapper allocates along with each bio, so the data path allocates nothing
+ * of its own but the pages of encrypted writes.
+ */
 struct eraser_io_work {
 	struct holepunch_dev *rd;
 	struct bio *bio;
+	struct bvec_iter iter;             /* The data, as it was mapped. */
 	unsigned is_file;
+	unsigned state;
 	struct work_struct work;
+	u8 key[HOLEPUNCH_KEY_LEN];
+	struct bio *out;                   /* Encrypted bio of a write. */
+	atomic_t pending;                  /* Chunks not done yet. */
+	struct holepunch_crypto_chunk *chunks;
+};
+
+/* A piece of a large I/O, for the crypto workers. */
+struct holepunch_crypto_chunk {
+	struct list_head list;
+	struct eraser_io_work *w;
+	struct bvec_iter iter;             /* Its sectors of the original bio. */
+	unsigned idx;                      /* First encrypted page, for writes. */
 };
 
+/* A crypto worker thread, bound to its CPU. */
+struct holepunch_crypto_worker {
+	struct holepunch_dev *rd;
+	struct task_struct *task;
+	int cpu;
+	spinlock_t lock;
+	struct list_head queue;            /* Chunks, taken from the head. */
+	unsigned len;
+	u64 stats_chunks;                  /* Chunks done. */
+	u64 stats_stolen;                  /* Chunks taken from other workers. */
+	u64 stats_busy_ns;                 /* Time spent on chunks. */
+} ____cacheline_aligned_in_smp;
+
 /* Represents an unlink operation in flight. */
 struct eraser_unlink_work {
 	struct holepunch_dev *rd;
 	unsigned long ino;
-	struct work_struct work;
+	unsigned long queued;              /* In jiffies. */
+	struct list_head list;
+	struct inode *inode;               /* Reference to drop, if still held. */
+	int unlinked;                      /* The last link is gone. */
+};
+
+/* Carried from vfs_unlink entry to return by the unlink probe. */
+struct holepunch_unlink_probe_data {
+	struct eraser_unlink_work *w;
 };
 
 #define HP_PPRF_EXPANSION_FACTOR 4
@@ -370,13 +729,47 @@ struct eraser_unlink_work {
 /* Cache eviction timeouts. TODO: Tweak these. */
 /* All in jiffies. */
 #define ERASER_CACHE_EXP_FIRST_ACCESS (60 * HZ)
-#define ERASER_CACHE_EXP_LAST_ACCESS (15 * HZ)
 #define ERASER_CACHE_EXP_LAST_DIRTY (5 * HZ)
-#define ERASER_CACHE_MEMORY_PRESSURE 0
+/* Past this many dirty entries, writeback starts without waiting for age. */
+#define HP_CACHE_DIRTY_HIGH 256
 
-/* In seconds. */
+/*
+ * Default map cache budget, in KiB. The eviction thread trims the cache back
+ * down to it; below the budget, only the shrinker takes clean entries away.
+ * 0 means no budget.
+ */
+#ifndef HOLEPUNCH_CACHE_BUDGET_KB
+#define HOLEPUNCH_CACHE_BUDGET_KB (16 * 1024)
+#endif
+/* Memory held by one cached key table sector. */
+#define HP_CACHE_ENTRY_SIZE (ERASER_SECTOR + sizeof(struct eraser_map_cache))
+
+/*
+ * Key table readahead. Files created together get consecutive inodes, so a
+ * run of misses on consecutive sectors starts a window of HP_RA_MIN sectors,
+ * read asynchronously; the window doubles each time the stream reaches it, up
+ * to HP_RA_MAX, and halves on every miss that breaks the run.
+ */
+#define HP_RA_MIN 4                        /* In sectors. */
+#define HP_RA_MAX 64
+
+/* Longest writeback thread sleep, in seconds. */
 #define ERASER_CACHE_EVICTION_PERIOD 5
 
+/*
+ * Deletion scheduler. Unlinks are made durable in batches; the batch window
+ * doubles while batches keep collecting more than one unlink and halves when
+ * they do not, but never exceeds the deadline. 0 disables batching.
+ */
+#ifndef HOLEPUNCH_DELETE_DEADLINE_MS
+#define HOLEPUNCH_DELETE_DEADLINE_MS 1000
+#endif
+#define HP_SCHED_MIN_WINDOW_MS 10
+/* Flush early once this many key table sectors wait to be punctured... */
+#define HP_SCHED_MAX_DIRTY 256
+/* ...or this many unlinks, so the unlink work pool does not run dry. */
+#define HP_SCHED_MAX_PENDING (ERASER_UNLINK_WORK_POOL_SIZE / 2)
+
 
 // #pragma GCC push_options
 // #pragma GCC optimize("O0")